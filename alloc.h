@@ -0,0 +1,186 @@
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+/*** Allocation Accounting ***/
+// Counts the memory an operation allocates: how many allocations, how many
+// bytes in all, how many are live right now and the most that were live at
+// once (its peak). That last one is what a memory limit per job has to cover.
+//
+// An AllocationAccount is charged for every operator new (so every vector,
+// string, Wave and new[] too) on a thread where an AllocationScope has made
+// it the current account. The thread pool and the pipeline pass the current
+// account on to the tasks and threads they start for it, so work an
+// operation splits up is still charged to the operation, even when other
+// operations are running on the same threads. Memory is given back to
+// whichever account it was charged to, whenever (and wherever) it's freed.
+//
+// This works by replacing the global operator new and delete, which puts a
+// 16-byte header on every allocation. That's the whole program's business,
+// not a header's, so it only happens where WAVE_ALLOC_STATS is defined (before
+// anything includes this), which only the main programs should do. Otherwise
+// the operators are left alone and the accounts stay at zero.
+//
+// Accounts are reference counted, since memory can outlive the operation
+// that allocated it (e.g., a table in the kernel cache): Open() one, and
+// Release() it when done; it goes away once everything charged to it is
+// freed, too.
+//
+// Example usage:
+//      AllocationAccount* account = AllocationAccount::Open();
+//      {
+//            AllocationScope scope(account);
+//            Process(filename);
+//      }
+//      std::cout << account->peak_bytes() << " bytes at most" << std::endl;
+//      account->Release();
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+class AllocationAccount {
+      public:
+            /*** Constructors ***/
+            // A new, empty account, with one reference (the caller's).
+            static AllocationAccount* Open(void);
+
+            /*** Public Methods ***/
+            void Retain(void) { refs_.fetch_add(1, std::memory_order_relaxed); }
+            void Release(void);
+
+            unsigned long long allocations(void) const { return allocations_.load(std::memory_order_relaxed); }
+            unsigned long long allocated_bytes(void) const { return allocated_bytes_.load(std::memory_order_relaxed); }
+            unsigned long long live_bytes(void) const { return live_bytes_.load(std::memory_order_relaxed); }
+            unsigned long long peak_bytes(void) const { return peak_bytes_.load(std::memory_order_relaxed); }
+
+            // The account the calling thread's allocations are charged to,
+            // or NULL.
+            static AllocationAccount* Current(void) { return current_; }
+
+            // Called by operator new and delete.
+            void Charge(unsigned long long bytes);
+            void Refund(unsigned long long bytes);
+
+      private:
+            friend class AllocationScope;
+
+            AllocationAccount(void) : allocations_(0), allocated_bytes_(0), live_bytes_(0), peak_bytes_(0), refs_(1) { }
+            AllocationAccount(AllocationAccount const&);
+            AllocationAccount& operator=(AllocationAccount const&);
+
+            std::atomic<unsigned long long> allocations_;
+            std::atomic<unsigned long long> allocated_bytes_;
+            std::atomic<unsigned long long> live_bytes_;
+            std::atomic<unsigned long long> peak_bytes_;
+
+            // One for each holder, plus one for each live allocation.
+            std::atomic<unsigned long long> refs_;
+
+            static thread_local AllocationAccount* current_;
+};
+
+thread_local AllocationAccount* AllocationAccount::current_ = NULL;
+
+// Accounts live in malloc()'s memory rather than operator new's, so they
+// aren't charged to anything themselves.
+AllocationAccount* AllocationAccount::Open(void) {
+      void* memory = std::malloc(sizeof(AllocationAccount));
+      if (!memory) throw std::bad_alloc();
+      return new (memory) AllocationAccount;
+}
+
+void AllocationAccount::Release(void) {
+      if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~AllocationAccount();
+            std::free(this);
+      }
+}
+
+void AllocationAccount::Charge(unsigned long long bytes) {
+      Retain();
+      allocations_.fetch_add(1, std::memory_order_relaxed);
+      allocated_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+      unsigned long long live = live_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+      unsigned long long peak = peak_bytes_.load(std::memory_order_relaxed);
+      while (live > peak && !peak_bytes_.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+}
+
+void AllocationAccount::Refund(unsigned long long bytes) {
+      live_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+      Release();
+}
+
+/*** AllocationScope ***/
+// Makes an account (which can be NULL, for none) the calling thread's current
+// one until the scope ends, then puts back whichever was current before.
+class AllocationScope {
+      public:
+            /*** Constructors ***/
+            explicit AllocationScope(AllocationAccount* account)
+                  : previous_(AllocationAccount::current_) {
+                  if (account) account->Retain();
+                  AllocationAccount::current_ = account;
+            }
+
+            /*** Destructor ***/
+            ~AllocationScope(void) {
+                  AllocationAccount* account = AllocationAccount::current_;
+                  AllocationAccount::current_ = previous_;
+                  if (account) account->Release();
+            }
+
+      private:
+            AllocationScope(AllocationScope const&);
+            AllocationScope& operator=(AllocationScope const&);
+
+            AllocationAccount* previous_;
+};
+
+#ifdef WAVE_ALLOC_STATS
+// Every block starts with the account it was charged to (if any) and its
+// size. The header is 16 bytes, so the block after it keeps malloc()'s
+// alignment. (The over-aligned forms of new and delete aren't replaced; they
+// go straight to the C library and aren't counted.)
+struct AllocationHeader {
+      AllocationAccount* account;
+      unsigned long long size;
+};
+static_assert(sizeof(AllocationHeader) % __STDCPP_DEFAULT_NEW_ALIGNMENT__ == 0,
+              "the header has to keep the block aligned");
+
+void* operator new(std::size_t size) {
+      AllocationHeader* header = (AllocationHeader*)std::malloc(sizeof(AllocationHeader) + size);
+      if (!header) throw std::bad_alloc();
+      header->account = AllocationAccount::Current();
+      header->size = size;
+      if (header->account) header->account->Charge(size);
+      return header + 1;
+}
+
+void operator delete(void* block) noexcept {
+      if (!block) return;
+      AllocationHeader* header = (AllocationHeader*)block - 1;
+      if (header->account) header->account->Refund(header->size);
+      std::free(header);
+}
+
+// The rest are replaced as well, so no library (or sanitizer) version of
+// them can end up paired with ours.
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete[](void* block) noexcept { operator delete(block); }
+void operator delete(void* block, std::size_t) noexcept { operator delete(block); }
+void operator delete[](void* block, std::size_t) noexcept { operator delete(block); }
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+      try {
+            return operator new(size);
+      } catch (std::bad_alloc const&) {
+            return NULL;
+      }
+}
+void* operator new[](std::size_t size, std::nothrow_t const& nothrow) noexcept { return operator new(size, nothrow); }
+void operator delete(void* block, std::nothrow_t const&) noexcept { operator delete(block); }
+void operator delete[](void* block, std::nothrow_t const&) noexcept { operator delete(block); }
+#endif
+
+#endif
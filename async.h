@@ -0,0 +1,433 @@
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+/*** Async Loading, Processing and Saving ***/
+// C++20 coroutine versions of the blocking calls (Wave::Load(), Save(), and
+// the block reads and writes in stream.h), for services that keep thousands
+// of files in flight at once without a thread for each one.
+//
+// An EventLoop runs coroutines on a single thread around epoll. Regular files
+// can't be waited on with epoll (they're always "ready"), so the blocking
+// part of each call hops over to the shared ThreadPool (see threadpool.h),
+// and the coroutine is resumed back on the loop thread when it's done. While
+// it's suspended a coroutine costs only its frame, so the number of files in
+// flight is limited by memory, not threads. Sockets and pipes can be waited
+// on directly with WaitFor().
+//
+// Task<T> is the coroutine type: it doesn't start until it's co_awaited (or
+// handed to EventLoop::Spawn()), and co_await gives back its co_return value.
+//
+// Example usage:
+//      Task<void> Louder(EventLoop& loop, std::string filename) {
+//            Wave wave;
+//            if (!co_await AsyncLoad(loop, wave, filename)) co_return;
+//            // ... process ...
+//            co_await AsyncSave(loop, wave, filename);
+//      }
+//
+//      EventLoop loop;
+//      for (unsigned i = 0; i != filenames.size(); ++i) {
+//            loop.Spawn(Louder(loop, filenames[i]));
+//      }
+//      loop.Run();
+
+#if __cplusplus < 202002L
+#error "async.h needs C++20 (-std=c++20)."
+#endif
+
+#include "stream.h"
+#include "threadpool.h"
+#include "wave.h"
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+template <class T> class Task;
+
+/*** Task ***/
+// The promise types: where a coroutine keeps its result and who to resume
+// when it's finished.
+template <class T>
+class TaskPromiseBase {
+      public:
+            std::suspend_always initial_suspend(void) noexcept { return std::suspend_always(); }
+
+            // Finishing resumes whoever was waiting on us (symmetric transfer,
+            // so long chains of awaits don't grow the stack).
+            struct FinalAwaiter {
+                  bool await_ready(void) noexcept { return false; }
+                  template <class Promise>
+                  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                        std::coroutine_handle<> continuation = handle.promise().continuation_;
+                        return continuation ? continuation : std::noop_coroutine();
+                  }
+                  void await_resume(void) noexcept { }
+            };
+            FinalAwaiter final_suspend(void) noexcept { return FinalAwaiter(); }
+
+            // We don't use exceptions.
+            void unhandled_exception(void) { std::terminate(); }
+
+            std::coroutine_handle<> continuation_;
+};
+
+template <class T>
+class TaskPromise : public TaskPromiseBase<T> {
+      public:
+            Task<T> get_return_object(void);
+            void return_value(T value) { value_.emplace(std::move(value)); }
+            T result(void) { return std::move(*value_); }
+
+      private:
+            std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase<void> {
+      public:
+            Task<void> get_return_object(void);
+            void return_void(void) { }
+            void result(void) { }
+};
+
+template <class T>
+class Task {
+      public:
+            typedef TaskPromise<T> promise_type;
+            typedef std::coroutine_handle<promise_type> Handle;
+
+            /*** Constructors ***/
+            explicit Task(Handle handle) : handle_(handle) { }
+            Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, Handle())) { }
+
+            /*** Operators ***/
+            Task& operator=(Task&& other) noexcept {
+                  if (this != &other) {
+                        if (handle_) handle_.destroy();
+                        handle_ = std::exchange(other.handle_, Handle());
+                  }
+                  return *this;
+            }
+
+            /*** Awaiting ***/
+            bool await_ready(void) const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+                  handle_.promise().continuation_ = waiter;
+                  return handle_;
+            }
+            T await_resume(void) { return handle_.promise().result(); }
+
+            /*** Destructor ***/
+            ~Task(void) { if (handle_) handle_.destroy(); }
+
+      private:
+            Task(Task const&);
+            Task& operator=(Task const&);
+
+            Handle handle_;
+};
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object(void) {
+      return Task<T>(std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+}
+
+Task<void> TaskPromise<void>::get_return_object(void) {
+      return Task<void>(std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+}
+
+/*** EventLoop ***/
+class EventLoop {
+      public:
+            /*** Constructors ***/
+            // Blocking calls get offloaded to "pool".
+            explicit EventLoop(ThreadPool& pool = ThreadPool::Shared());
+
+            /*** Public Methods ***/
+            // Starts a coroutine on the loop. The loop owns it from here on.
+            // Safe to call from any thread.
+            void Spawn(Task<void> task);
+
+            // Runs coroutines until every spawned one has finished, or until
+            // Stop(). Call from one thread at a time.
+            void Run(void);
+
+            // Makes Run() return as soon as it can. Safe to call from any
+            // thread (including from a coroutine on the loop). A Stop() that
+            // comes before Run() isn't lost: that Run() returns right away.
+            // Either way, the Run() that returns uses it up, so the loop can
+            // be run again.
+            void Stop(void);
+
+            // Resumes a suspended coroutine on the loop thread. Safe to call
+            // from any thread.
+            void Post(std::coroutine_handle<> handle);
+
+            // co_await loop.Schedule() moves the coroutine onto the loop
+            // thread (at the back of the line).
+            struct ScheduleAwaiter {
+                  EventLoop& loop;
+                  bool await_ready(void) const noexcept { return false; }
+                  void await_suspend(std::coroutine_handle<> handle) { loop.Post(handle); }
+                  void await_resume(void) const noexcept { }
+            };
+            ScheduleAwaiter Schedule(void) { return ScheduleAwaiter{*this}; }
+
+            // co_await loop.Offload(f) runs f() on the thread pool and gives
+            // back what it returns, resuming on the loop thread.
+            template <class Result>
+            struct OffloadAwaiter {
+                  EventLoop& loop;
+                  std::function<Result()> function;
+                  std::optional<Result> result;
+
+                  bool await_ready(void) const noexcept { return false; }
+                  void await_suspend(std::coroutine_handle<> handle) {
+                        loop.pool_.Submit([this, handle]() {
+                              result.emplace(function());
+                              loop.Post(handle);
+                        });
+                  }
+                  Result await_resume(void) { return std::move(*result); }
+            };
+            template <class Function>
+            OffloadAwaiter<decltype(std::declval<Function>()())> Offload(Function const& function) {
+                  return OffloadAwaiter<decltype(std::declval<Function>()())>{*this, function, std::nullopt};
+            }
+
+            // co_await loop.WaitFor(fd, EPOLLIN) suspends until the file
+            // descriptor (a socket or pipe, not a regular file) is ready, and
+            // gives back the events that happened (e.g., EPOLLIN | EPOLLHUP).
+            // Only one coroutine can wait on a given descriptor at a time.
+            struct WaitAwaiter {
+                  EventLoop& loop;
+                  int fd;
+                  unsigned events;
+                  unsigned happened;
+                  std::coroutine_handle<> handle;
+
+                  bool await_ready(void) const noexcept { return false; }
+                  bool await_suspend(std::coroutine_handle<> waiter);
+                  unsigned await_resume(void) const noexcept { return happened; }
+            };
+            WaitAwaiter WaitFor(int fd, unsigned events) {
+                  return WaitAwaiter{*this, fd, events, 0, std::coroutine_handle<>()};
+            }
+
+            // Wakes the coroutine waiting on "fd" (if one is), as if it had
+            // hung up: WaitFor() gives back EPOLLHUP. For shutting down a
+            // coroutine that would otherwise wait forever. Call on the loop
+            // thread.
+            void Cancel(int fd);
+
+            ThreadPool& pool(void) { return pool_; }
+
+            /*** Destructor ***/
+            // Waits for any Post() or Stop() still on its way in. Coroutines
+            // that haven't finished (say, after a Stop()) are leaked, not
+            // destroyed: their frames may be in use by a pool thread.
+            ~EventLoop(void);
+
+      private:
+            EventLoop(EventLoop const&);
+            EventLoop& operator=(EventLoop const&);
+
+            // A coroutine that doesn't belong to anyone: it starts right away
+            // and frees itself when it's done. Spawn() wraps tasks in one.
+            struct Detached {
+                  struct promise_type {
+                        Detached get_return_object(void) { return Detached(); }
+                        std::suspend_never initial_suspend(void) noexcept { return std::suspend_never(); }
+                        std::suspend_never final_suspend(void) noexcept { return std::suspend_never(); }
+                        void return_void(void) { }
+                        void unhandled_exception(void) { std::terminate(); }
+                  };
+            };
+            Detached Drive(Task<void> task);
+
+            // Call with mutex_ held (or on the loop thread), so the loop can't
+            // finish and be destroyed halfway through.
+            void Wake(void);
+
+            ThreadPool& pool_;
+            int epoll_fd_;
+            int wake_fd_;
+
+            std::mutex mutex_;
+            std::vector<std::coroutine_handle<> > ready_;
+
+            // Who's waiting on each descriptor. Only the loop thread uses it.
+            std::map<int, WaitAwaiter*> waiters_;
+
+            std::atomic<unsigned> running_;
+            std::atomic<bool> stopping_;
+};
+
+EventLoop::EventLoop(ThreadPool& pool) : pool_(pool), running_(0), stopping_(false) {
+      epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+      wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      epoll_event event = epoll_event();
+      event.events = EPOLLIN;
+      event.data.ptr = NULL;
+      if (epoll_fd_ < 0 || wake_fd_ < 0 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) != 0) {
+            std::cerr << "Error: I can't set up an event loop!" << std::endl;
+      }
+}
+
+EventLoop::~EventLoop(void) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (wake_fd_ >= 0) close(wake_fd_);
+      if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+void EventLoop::Spawn(Task<void> task) {
+      ++running_;
+      Drive(std::move(task));
+}
+
+EventLoop::Detached EventLoop::Drive(Task<void> task) {
+      co_await Schedule();
+      co_await task;
+      if (--running_ == 0) Wake();
+}
+
+void EventLoop::Post(std::coroutine_handle<> handle) {
+      // Wake while still holding the lock: once it's released, the loop may
+      // run out of coroutines, return, and be destroyed.
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_.push_back(handle);
+      Wake();
+}
+
+void EventLoop::Stop(void) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      Wake();
+}
+
+void EventLoop::Wake(void) {
+      unsigned long long one = 1;
+      if (write(wake_fd_, &one, sizeof(one)) < 0) {
+            // The counter is already nonzero, so the loop is awake anyway.
+      }
+}
+
+bool EventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> waiter) {
+      handle = waiter;
+
+      epoll_event event = epoll_event();
+      event.events = events | EPOLLONESHOT;
+      event.data.ptr = this;
+      if (epoll_ctl(loop.epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+            // Not something epoll can wait on: say it's ready (as epoll
+            // would for a regular file) and carry on.
+            happened = events;
+            return false;
+      }
+      loop.waiters_[fd] = this;
+      return true;
+}
+
+void EventLoop::Cancel(int fd) {
+      std::map<int, WaitAwaiter*>::iterator found = waiters_.find(fd);
+      if (found == waiters_.end()) return;
+
+      WaitAwaiter* waiter = found->second;
+      waiters_.erase(found);
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+      waiter->happened = EPOLLHUP;
+      Post(waiter->handle);
+}
+
+void EventLoop::Run(void) {
+      std::vector<std::coroutine_handle<> > ready;
+      epoll_event events[64];
+
+      while (running_ != 0 && !stopping_.exchange(false)) {
+            int nevents = epoll_wait(epoll_fd_, events, 64, -1);
+
+            for (int i = 0; i < nevents; ++i) {
+                  if (!events[i].data.ptr) {
+                        unsigned long long count;
+                        if (read(wake_fd_, &count, sizeof(count)) < 0) {
+                              // Somebody else already reset it.
+                        }
+                        continue;
+                  }
+
+                  WaitAwaiter* waiter = (WaitAwaiter*)events[i].data.ptr;
+                  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, waiter->fd, NULL);
+                  waiters_.erase(waiter->fd);
+                  waiter->happened = events[i].events;
+                  ready.push_back(waiter->handle);
+            }
+
+            {
+                  std::lock_guard<std::mutex> lock(mutex_);
+                  ready.insert(ready.end(), ready_.begin(), ready_.end());
+                  ready_.clear();
+            }
+
+            for (unsigned i = 0; i != ready.size(); ++i) ready[i].resume();
+            ready.clear();
+      }
+
+      // A Stop() that came in as the last coroutine finished was for this
+      // Run() too. Taking the lock also waits out a Post() or Stop() that's
+      // still waking us, so the caller is free to destroy the loop.
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = false;
+}
+
+/*** Async File Operations ***/
+// Same as the blocking calls they're named after, and the same rules apply
+// (e.g., only one call at a time on a given WaveReader). Nothing happens until
+// the result is co_awaited, and everything passed by reference has to outlive
+// that.
+typedef EventLoop::OffloadAwaiter<bool> AsyncBool;
+typedef EventLoop::OffloadAwaiter<unsigned> AsyncUnsigned;
+
+AsyncBool AsyncLoad(EventLoop& loop, Wave& wave, std::string const& filename) {
+      return loop.Offload([&wave, filename]() { return wave.Load(filename); });
+}
+
+AsyncBool AsyncLoadMetadata(EventLoop& loop, Wave& wave, std::string const& filename) {
+      return loop.Offload([&wave, filename]() { return wave.LoadMetadata(filename); });
+}
+
+AsyncBool AsyncSave(EventLoop& loop, Wave& wave, std::string const& filename) {
+      return loop.Offload([&wave, filename]() { return wave.Save(filename); });
+}
+
+AsyncBool AsyncOpen(EventLoop& loop, WaveReader& reader, std::string const& filename) {
+      return loop.Offload([&reader, filename]() { return reader.Open(filename); });
+}
+
+AsyncBool AsyncOpen(EventLoop& loop, WaveWriter& writer, std::string const& filename, FmtChunk const& fmt) {
+      return loop.Offload([&writer, filename, fmt]() { return writer.Open(filename, fmt); });
+}
+
+AsyncUnsigned AsyncRead(EventLoop& loop, BlockSource& source, double* out, unsigned nframes) {
+      return loop.Offload([&source, out, nframes]() { return source.Read(out, nframes); });
+}
+
+AsyncBool AsyncWrite(EventLoop& loop, BlockSink& sink, double const* samples, unsigned nframes) {
+      return loop.Offload([&sink, samples, nframes]() { return sink.Write(samples, nframes); });
+}
+
+AsyncBool AsyncClose(EventLoop& loop, WaveWriter& writer) {
+      return loop.Offload([&writer]() { return writer.Close(); });
+}
+
+#endif
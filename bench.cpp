@@ -0,0 +1,896 @@
+// Microbenchmarks for wave.h and the rest of the library, and for every
+// example operation in wave.cpp. Each benchmark runs a few times to warm up
+// (the kernel's cache, the allocator, the thread pool), then a few more times
+// for real, and reports the median time along with how much it varied:
+//      ns/frame    Time per frame of audio.
+//      MB/s        Bytes of sample data (in the file's format) per second.
+//      x realtime  Seconds of audio per second of processing.
+//
+// The inputs are made up on the spot, in a scratch directory that's removed
+// at the end, so every run measures the same thing.
+//
+// Usage: wavebench [-r <repetitions>] [-w <warmup runs>] [-s <seconds of audio>]
+//                  [-f <only benchmarks with this in their name>] [-o <results.json>]
+//                  [-c <corpus directory>] [-S <largest file, in MB>] [-t <most threads>] [-p]
+//
+// With -p, it also reads the CPU's hardware counters around each benchmark
+// (see PerfCounters), and reports instructions per cycle and cache and branch
+// misses per frame: whether a kernel is waiting on memory or busy computing.
+//
+// With -c, the format benchmarks also run on every file of a corpus made by
+// wavecorpus (see corpus.cpp).
+//
+// With -S, it runs a scaling sweep instead (see BenchScaling()): the batch
+// runner and the block-parallel work on 1, 2, 4... threads, up to one per core
+// (or -t), on files from 64 KB up to the size given, then prints each one's
+// speedup and efficiency over a single thread.
+
+#define WAVE_ALLOC_STATS
+#define WAVE_NO_MAIN
+#include "wave.cpp"
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <cerrno>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/*** Hardware Counters ***/
+// The CPU's own counts of cycles, instructions, cache misses (usually the
+// last level's) and mispredicted branches, through perf_event_open(). They
+// count this process in user space only, which is all perf_event_paranoid
+// lets us have by default. They're opened before any other thread starts, and
+// every thread started after inherits them (the pools' workers, the real-time
+// runner's thread...), so a read covers the whole process.
+//
+// Any counter that can't be opened (no access, a VM without a PMU, a seccomp
+// filter) is just left out; the benchmarks run the same without it.
+class PerfCounters {
+      public:
+            enum Event { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NEVENTS };
+
+            /*** Constructors ***/
+            PerfCounters(void);
+
+            /*** Public Methods ***/
+            bool available(Event event) const { return fds_[event] >= 0; }
+            bool any(void) const;
+
+            // Why the first counter that couldn't be opened wasn't, if one
+            // wasn't.
+            string const& error(void) const { return error_; }
+
+            // The counts so far, scaled up for any time a counter spent
+            // switched out (when there are more counters than the CPU has
+            // room for). Zero for the ones that aren't available.
+            void Read(unsigned long long counts[NEVENTS]) const;
+
+            /*** Destructor ***/
+            ~PerfCounters(void);
+
+      private:
+            PerfCounters(PerfCounters const&);
+            PerfCounters& operator=(PerfCounters const&);
+
+            int fds_[NEVENTS];
+            string error_;
+};
+
+PerfCounters::PerfCounters(void) {
+      static unsigned long long const configs[NEVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+      };
+      for (unsigned i = 0; i != NEVENTS; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // Each one on its own, since inherited counters can't be read
+            // as a group.
+            fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if (fds_[i] < 0 && error_.empty()) error_ = strerror(errno);
+      }
+}
+
+bool PerfCounters::any(void) const {
+      for (unsigned i = 0; i != NEVENTS; ++i) {
+            if (fds_[i] >= 0) return true;
+      }
+      return false;
+}
+
+void PerfCounters::Read(unsigned long long counts[NEVENTS]) const {
+      for (unsigned i = 0; i != NEVENTS; ++i) {
+            unsigned long long values[3];  // The count, time enabled and time running.
+            counts[i] = 0;
+            if (fds_[i] < 0 || read(fds_[i], values, sizeof(values)) != sizeof(values)) continue;
+            counts[i] = values[2] ? (unsigned long long)((double)values[0] * values[1] / values[2]) : 0;
+      }
+}
+
+PerfCounters::~PerfCounters(void) {
+      for (unsigned i = 0; i != NEVENTS; ++i) {
+            if (fds_[i] >= 0) close(fds_[i]);
+      }
+}
+
+/*** Results ***/
+// One benchmark's timings. "frames" and "bytes" are how much audio one run
+// processes (zero if that doesn't mean anything, as for header parsing).
+// "counts" are the hardware counters' totals over every repetition (if they
+// were read).
+struct BenchResult {
+      string name;
+      string params;
+      unsigned long long frames;
+      unsigned long long bytes;
+      double audio_seconds;
+      vector<double> seconds;
+      bool counted;
+      // Totals over the repetitions, and each repetition's own.
+      unsigned long long counts[PerfCounters::NEVENTS];
+      vector<vector<unsigned long long> > repetition_counts;
+
+      BenchResult(void) : frames(0), bytes(0), audio_seconds(0), counted(false), counts() { }
+
+      // Per repetition.
+      double count(PerfCounters::Event event) const { return counts[event] / (double)seconds.size(); }
+
+      double median(void) const {
+            vector<double> sorted = seconds;
+            sort(sorted.begin(), sorted.end());
+            unsigned n = sorted.size();
+            return n % 2 ? sorted[n/2] : (sorted[n/2 - 1] + sorted[n/2]) / 2;
+      }
+
+      double mean(void) const {
+            double total = 0;
+            for (unsigned i = 0; i != seconds.size(); ++i) total += seconds[i];
+            return total / seconds.size();
+      }
+
+      // Sample standard deviation.
+      double stddev(void) const {
+            if (seconds.size() < 2) return 0;
+            double m = mean(), total = 0;
+            for (unsigned i = 0; i != seconds.size(); ++i) total += (seconds[i] - m) * (seconds[i] - m);
+            return sqrt(total / (seconds.size() - 1));
+      }
+};
+
+/*** Bench ***/
+// Runs benchmarks and collects their results.
+class Bench {
+      public:
+            // With "counters" (which can be NULL), the hardware counters are
+            // read around every repetition too.
+            Bench(unsigned repetitions, unsigned warmup, string const& filter,
+                  PerfCounters const* counters = NULL)
+                  : repetitions_(max(1u, repetitions)), warmup_(warmup), filter_(filter),
+                    counters_(counters && counters->any() ? counters : NULL) { }
+
+            // Times "body" (which returns false if it failed), unless the
+            // filter rules it out.
+            void Run(string const& name, string const& params, unsigned long long frames,
+                     unsigned long long bytes, unsigned sample_rate, function<bool(void)> const& body);
+
+            vector<BenchResult> const& results(void) const { return results_; }
+
+            void PrintHeader(ostream& stream) const;
+
+      private:
+            unsigned repetitions_;
+            unsigned warmup_;
+            string filter_;
+            PerfCounters const* counters_;
+            vector<BenchResult> results_;
+};
+
+void Bench::PrintHeader(ostream& stream) const {
+      stream << left << setw(16) << "benchmark" << setw(16) << "params"
+             << right << setw(12) << "median ms" << setw(9) << "+/- %"
+             << setw(12) << "ns/frame" << setw(10) << "MB/s" << setw(12) << "x realtime";
+      if (counters_) stream << setw(7) << "IPC" << setw(14) << "cache miss/f" << setw(14) << "branch miss/f";
+      stream << endl;
+}
+
+void Bench::Run(string const& name, string const& params, unsigned long long frames,
+                unsigned long long bytes, unsigned sample_rate, function<bool(void)> const& body) {
+      if (!filter_.empty() && (name + " " + params).find(filter_) == string::npos) return;
+
+      // The examples talk; the table shouldn't have to listen.
+      ostringstream ignored;
+      streambuf* old_cout = cout.rdbuf(ignored.rdbuf());
+
+      BenchResult result;
+      result.name = name;
+      result.params = params;
+      result.frames = frames;
+      result.bytes = bytes;
+      result.audio_seconds = sample_rate ? frames / (double)sample_rate : 0;
+
+      bool ok = true;
+      for (unsigned i = 0; i != warmup_ && ok; ++i) ok = body();
+      for (unsigned i = 0; i != repetitions_ && ok; ++i) {
+            unsigned long long before[PerfCounters::NEVENTS], after[PerfCounters::NEVENTS];
+            if (counters_) counters_->Read(before);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            ok = body();
+            result.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            if (counters_) {
+                  counters_->Read(after);
+                  vector<unsigned long long> counts(PerfCounters::NEVENTS);
+                  for (unsigned j = 0; j != PerfCounters::NEVENTS; ++j) {
+                        counts[j] = after[j] - before[j];
+                        result.counts[j] += counts[j];
+                  }
+                  result.repetition_counts.push_back(counts);
+                  result.counted = true;
+            }
+      }
+
+      cout.rdbuf(old_cout);
+
+      cout << left << setw(16) << name << setw(16) << params << right << fixed;
+      if (!ok) {
+            cout << "  failed" << endl;
+            return;
+      }
+
+      double median = result.median();
+      cout << setw(12) << setprecision(3) << median * 1000
+           << setw(9) << setprecision(1) << 100 * result.stddev() / result.mean();
+      if (frames) {
+            cout << setw(12) << setprecision(2) << median * 1e9 / frames;
+      } else {
+            cout << setw(12) << "-";
+      }
+      if (bytes) {
+            cout << setw(10) << setprecision(1) << bytes / median / 1e6;
+      } else {
+            cout << setw(10) << "-";
+      }
+      if (result.audio_seconds) {
+            cout << setw(12) << setprecision(1) << result.audio_seconds / median;
+      } else {
+            cout << setw(12) << "-";
+      }
+      if (counters_) {
+            if (counters_->available(PerfCounters::CYCLES) && counters_->available(PerfCounters::INSTRUCTIONS)
+                        && result.counts[PerfCounters::CYCLES]) {
+                  cout << setw(7) << setprecision(2)
+                       << result.counts[PerfCounters::INSTRUCTIONS] / (double)result.counts[PerfCounters::CYCLES];
+            } else {
+                  cout << setw(7) << "-";
+            }
+            PerfCounters::Event const misses[] = { PerfCounters::CACHE_MISSES, PerfCounters::BRANCH_MISSES };
+            for (unsigned j = 0; j != 2; ++j) {
+                  if (frames && counters_->available(misses[j])) {
+                        cout << setw(14) << setprecision(4) << result.count(misses[j]) / frames;
+                  } else {
+                        cout << setw(14) << "-";
+                  }
+            }
+      }
+      cout << endl;
+      cout.unsetf(ios_base::floatfield);
+
+      results_.push_back(result);
+}
+
+// Writes the results as JSON, every repetition included, for comparing runs
+// (e.g., before and after a change).
+bool WriteJson(string const& filename, vector<BenchResult> const& results,
+               unsigned repetitions, unsigned warmup) {
+      ofstream file(filename.c_str());
+      if (!file.good()) {
+            cerr << "Error: I can't open " << filename << " for writing!" << endl;
+            return false;
+      }
+
+      file << setprecision(9);
+      file << "{\n  \"repetitions\": " << repetitions << ",\n  \"warmup\": " << warmup
+           << ",\n  \"threads\": " << ThreadPool::Shared().size() << ",\n  \"benchmarks\": [\n";
+      for (unsigned i = 0; i != results.size(); ++i) {
+            BenchResult const& result = results[i];
+            file << "    {\"name\": \"" << result.name << "\", \"params\": \"" << result.params
+                 << "\", \"frames\": " << result.frames << ", \"bytes\": " << result.bytes
+                 << ", \"audio_seconds\": " << result.audio_seconds
+                 << ", \"median\": " << result.median() << ", \"mean\": " << result.mean()
+                 << ", \"stddev\": " << result.stddev() << ", \"seconds\": [";
+            for (unsigned j = 0; j != result.seconds.size(); ++j) {
+                  file << (j ? ", " : "") << result.seconds[j];
+            }
+            file << "]";
+            if (result.counted) {
+                  // The average per repetition, like "mean," then every
+                  // repetition's counts, in the same order as "seconds."
+                  static char const* const names[PerfCounters::NEVENTS] = {
+                        "cycles", "instructions", "cache_misses", "branch_misses"
+                  };
+                  for (unsigned j = 0; j != PerfCounters::NEVENTS; ++j) {
+                        file << ", \"" << names[j] << "\": " << result.count((PerfCounters::Event)j);
+                  }
+                  file << ", \"counters\": [";
+                  for (unsigned r = 0; r != result.repetition_counts.size(); ++r) {
+                        file << (r ? ", " : "") << "{";
+                        for (unsigned j = 0; j != PerfCounters::NEVENTS; ++j) {
+                              file << (j ? ", " : "") << "\"" << names[j] << "\": " << result.repetition_counts[r][j];
+                        }
+                        file << "}";
+                  }
+                  file << "]";
+            }
+            file << "}" << (i + 1 != results.size() ? "," : "") << "\n";
+      }
+      file << "  ]\n}\n";
+
+      file.close();
+      return !file.fail();
+}
+
+/*** Inputs ***/
+// A scratch directory for the inputs and outputs, removed (with everything
+// named through it) when we're done.
+class Scratch {
+      public:
+            Scratch(void) {
+                  char directory[] = "/tmp/wavebench.XXXXXX";
+                  if (mkdtemp(directory)) directory_ = directory;
+            }
+
+            bool ok(void) const { return !directory_.empty(); }
+
+            string Path(string const& name) {
+                  string path = directory_ + "/" + name;
+                  paths_.push_back(path);
+                  return path;
+            }
+
+            ~Scratch(void) {
+                  for (unsigned i = 0; i != paths_.size(); ++i) {
+                        remove(paths_[i].c_str());
+                        remove((paths_[i] + ".part").c_str());
+                  }
+                  if (ok()) rmdir(directory_.c_str());
+            }
+
+      private:
+            Scratch(Scratch const&);
+            Scratch& operator=(Scratch const&);
+
+            string directory_;
+            vector<string> paths_;
+};
+
+// A format (bits per sample, channels, and integer or float) the benchmarks
+// run in.
+struct BenchFormat {
+      unsigned bits;
+      unsigned nchannels;
+      bool is_float;
+
+      string params(void) const {
+            ostringstream stream;
+            stream << bits << "-bit " << (is_float ? "float " : "") << nchannels << "ch";
+            return stream.str();
+      }
+};
+
+// Makes a Wave of a chord, in the given format. The same every time.
+void MakeInput(Wave& wave, BenchFormat const& format, unsigned sample_rate, unsigned nframes) {
+      wave.fmt_chunk.sample_rate = sample_rate;
+      wave.fmt_chunk.nchannels = format.nchannels;
+      wave.fmt_chunk.bits_per_sample = format.bits;
+      if (format.is_float) wave.fmt_chunk.compression = FmtChunk::COMPRESSION_FLOAT;
+      wave.Resize(nframes);
+
+      vector<double> samples(nframes);
+      vector<double> frequencies;
+      frequencies.push_back(220);
+      frequencies.push_back(277.18);
+      frequencies.push_back(329.63);
+      Multitone chord(sample_rate, frequencies, nframes);
+      chord.Read(&samples[0], nframes);
+      wave.SetSamples(0, nframes, &samples[0]);
+}
+
+// Marks up a Wave the way an editor would (see regions.h): "nregions" cue
+// points, evenly spaced, each labeled "<prefix><number>", so each region runs
+// up to the next and together they cover the whole file. Returns the labels.
+vector<string> AddRegions(Wave& wave, unsigned nregions, string const& prefix) {
+      vector<string> labels;
+      ostringstream cues, list;
+      WriteLittleEndian(cues, (uint32_t)nregions);
+      WriteLittleEndian(list, LIST_TYPE_ADTL);
+      for (unsigned i = 0; i != nregions; ++i) {
+            uint32_t id = i + 1;
+            uint32_t position = (unsigned long long)wave.nsamples() * i / nregions;
+            WriteLittleEndian(cues, id);
+            WriteLittleEndian(cues, position);
+            WriteLittleEndian(cues, (uint32_t)Chunk::CHUNK_TYPE_DATA);
+            WriteLittleEndian(cues, (uint32_t)0);
+            WriteLittleEndian(cues, (uint32_t)0);
+            WriteLittleEndian(cues, position);
+
+            labels.push_back(prefix + to_string(id));
+            string text = labels.back() + '\0';
+            if (text.size() % 2) text += '\0';
+            WriteLittleEndian(list, CHUNK_TYPE_LABL);
+            WriteLittleEndian(list, (uint32_t)(4 + text.size()));
+            WriteLittleEndian(list, id);
+            list << text;
+      }
+
+      uint32_t const types[2] = { CHUNK_TYPE_CUE, CHUNK_TYPE_LIST };
+      string const bodies[2] = { cues.str(), list.str() };
+      for (unsigned i = 0; i != 2; ++i) {
+            DataChunk chunk(types[i]);
+            chunk.ReAllocData(bodies[i].size());
+            memcpy(chunk.data(), bodies[i].data(), bodies[i].size());
+            wave.other_chunks.push_back(chunk);
+      }
+      return labels;
+}
+
+// Runs the format benchmarks (parsing, loading and decoding) on every file
+// listed in a corpus's MANIFEST (see corpus.cpp), named by file.
+bool BenchCorpus(Bench& bench, string const& directory) {
+      ifstream manifest((directory + "/MANIFEST").c_str());
+      if (!manifest.good()) {
+            cerr << "Error: I can't open " << directory << "/MANIFEST!" << endl;
+            return false;
+      }
+
+      string line;
+      while (getline(manifest, line)) {
+            istringstream fields(line);
+            string name, kind;
+            unsigned bits, nchannels, sample_rate;
+            unsigned long long nframes, bytes;
+            if (line.empty() || line[0] == '#'
+                        || !(fields >> name >> kind >> bits >> nchannels >> sample_rate >> nframes >> bytes)) {
+                  continue;
+            }
+            string filename = directory + "/" + name;
+
+            bench.Run("parse-header", name, 0, 0, 0, [&]() {
+                  Wave wave;
+                  return wave.LoadMetadata(filename);
+            });
+
+            bench.Run("load", name, nframes, bytes, sample_rate, [&]() {
+                  Wave wave;
+                  return wave.Load(filename);
+            });
+
+            Wave input;
+            if (!input.Load(filename)) return false;
+            vector<double> samples(input.nsamples());
+            bench.Run("decode", name, nframes, bytes, sample_rate, [&]() {
+                  input.GetSamples(0, samples.size(), &samples[0]);
+                  return true;
+            });
+      }
+      return true;
+}
+
+/*** Scaling ***/
+// How long one workload took on one size of file with so many threads.
+struct ScalingPoint {
+      string name;
+      string size;
+      unsigned nthreads;
+      double median;
+};
+
+// Throws away whatever it's given.
+class NullSink : public BlockSink {
+      public:
+            virtual bool Write(double const*, unsigned) { return true; }
+};
+
+string SizeName(unsigned long long bytes) {
+      ostringstream stream;
+      if (bytes >= 1 << 30) {
+            stream << bytes / (double)(1 << 30) << " GB";
+      } else if (bytes >= 1 << 20) {
+            stream << bytes / (double)(1 << 20) << " MB";
+      } else {
+            stream << bytes / (double)(1 << 10) << " KB";
+      }
+      return stream.str();
+}
+
+// Times the ways the library spreads work over threads, on each thread count
+// from 1 up to "max_threads" (doubling, plus "max_threads" itself) and each
+// file size from 64 KB up to "largest" (going up 16 times at a time):
+//      scale-batch     A batch of streamed echoes, one task per file, the way
+//                      run_jobs() in wave.cpp runs a job list.
+//      scale-decode    Decoding a whole file split up with ParallelFor(), the
+//                      way WavLoad() does.
+//      scale-mix       Mixing a batch of files with MixFiles() (see mixer.h).
+//      scale-pipeline  A gain through a Pipeline (see pipeline.h) with that
+//                      many effect stages.
+// Every thread count gets a pool of its own, so the shared one (and "-t" in
+// wave.cpp) doesn't come into it. The files are 16-bit mono, and streamed
+// wherever the library streams, so a sweep up to a GB or so only needs that
+// much memory for the decode (plus the batch's outputs on disk).
+bool BenchScaling(Bench& bench, Scratch& scratch, unsigned long long largest, unsigned max_threads,
+                  vector<ScalingPoint>& points) {
+      unsigned const sample_rate = 44100;
+      unsigned const nfiles = max(8u, 2 * max_threads);
+
+      vector<unsigned> thread_counts;
+      for (unsigned n = 1; n < max_threads; n *= 2) thread_counts.push_back(n);
+      thread_counts.push_back(max_threads);
+
+      vector<unsigned long long> sizes;
+      for (unsigned long long size = 64 << 10; size < largest; size *= 16) sizes.push_back(size);
+      sizes.push_back(largest);
+
+      string input_file = scratch.Path("scale-in.wav");
+      vector<string> outputs;
+      for (unsigned i = 0; i != nfiles; ++i) outputs.push_back(scratch.Path("scale-out-" + to_string(i) + ".wav"));
+
+      for (unsigned s = 0; s != sizes.size(); ++s) {
+            string size = SizeName(sizes[s]);
+            unsigned nframes = max(1ULL, sizes[s] / 2);
+            unsigned long long bytes = 2ULL * nframes;
+
+            {
+                  FmtChunk fmt;
+                  fmt.sample_rate = sample_rate;
+                  fmt.nchannels = 1;
+                  fmt.bits_per_sample = 16;
+                  vector<double> frequencies;
+                  frequencies.push_back(220);
+                  frequencies.push_back(277.18);
+                  frequencies.push_back(329.63);
+                  Multitone chord(sample_rate, frequencies, nframes);
+                  WaveWriter writer;
+                  if (!writer.Open(input_file, fmt)) return false;
+                  Pump(chord, writer, 1 << 16);
+                  if (!writer.Close()) return false;
+            }
+            Wave input;
+            if (!input.Load(input_file)) return false;
+            vector<string> inputs(nfiles, input_file);
+
+            for (unsigned t = 0; t != thread_counts.size(); ++t) {
+                  unsigned nthreads = thread_counts[t];
+                  ThreadPool pool(nthreads);
+                  string params = size + " " + to_string(nthreads) + " thr";
+
+                  auto record = [&](string const& name) {
+                        vector<BenchResult> const& results = bench.results();
+                        if (!results.empty() && results.back().name == name && results.back().params == params) {
+                              points.push_back(ScalingPoint{ name, size, nthreads, results.back().median() });
+                        }
+                  };
+
+                  bench.Run("scale-batch", params, nfiles * (unsigned long long)nframes, nfiles * bytes,
+                            sample_rate, [&]() {
+                        atomic<bool> ok(true);
+                        TaskGroup batch(pool);
+                        for (unsigned i = 0; i != nfiles; ++i) {
+                              batch.Run([&, i]() {
+                                    if (!run_streamed('e', vector<string>{ input_file, outputs[i] })) ok = false;
+                              });
+                        }
+                        batch.Wait();
+                        return ok.load();
+                  });
+                  record("scale-batch");
+
+                  bench.Run("scale-decode", params, nframes, bytes, sample_rate, [&]() {
+                        ParallelFor(pool, 0, nframes, 1 << 16, [&](unsigned begin, unsigned end) {
+                              vector<double> block(min(end - begin, 1u << 16));
+                              for (unsigned i = begin; i < end; i += block.size()) {
+                                    input.GetSamples(i, min<unsigned>(block.size(), end - i), &block[0]);
+                              }
+                        });
+                        return true;
+                  });
+                  record("scale-decode");
+
+                  bench.Run("scale-mix", params, nfiles * (unsigned long long)nframes, nfiles * bytes,
+                            sample_rate, [&]() {
+                        NullSink sink;
+                        return MixFiles(inputs, sink, pool);
+                  });
+                  record("scale-mix");
+
+                  bench.Run("scale-pipeline", params, nframes, bytes, sample_rate, [&]() {
+                        WaveReader reader;
+                        if (!reader.Open(input_file)) return false;
+                        NullSink sink;
+                        Pipeline pipeline(nthreads);
+                        return pipeline.Run(reader, [](double* samples, unsigned n, unsigned long long) {
+                              for (unsigned i = 0; i != n; ++i) samples[i] *= 1.2;
+                        }, sink, pool);
+                  });
+                  record("scale-pipeline");
+            }
+
+            // The outputs add up; don't keep them around for the next size.
+            for (unsigned i = 0; i != nfiles; ++i) remove(outputs[i].c_str());
+      }
+      return true;
+}
+
+// Prints each workload's speedup (its time on one thread over its time on
+// more) and efficiency (the speedup per thread) at every size, and where the
+// speedup peaked, which is about where adding threads stops paying.
+void PrintScaling(ostream& stream, vector<ScalingPoint> const& points) {
+      stream << endl << left << setw(16) << "scaling" << setw(10) << "size" << right << setw(8) << "threads"
+             << setw(12) << "median ms" << setw(10) << "speedup" << setw(12) << "efficiency" << endl;
+
+      vector<bool> printed(points.size(), false);
+      for (unsigned i = 0; i != points.size(); ++i) {
+            if (printed[i]) continue;
+
+            // One curve: the points for a workload and size, in thread order.
+            vector<ScalingPoint> curve;
+            for (unsigned j = i; j != points.size(); ++j) {
+                  if (points[j].name == points[i].name && points[j].size == points[i].size) {
+                        curve.push_back(points[j]);
+                        printed[j] = true;
+                  }
+            }
+            double base = curve[0].nthreads == 1 ? curve[0].median : 0;
+
+            unsigned best = 0;
+            for (unsigned j = 0; j != curve.size(); ++j) {
+                  ScalingPoint const& point = curve[j];
+                  stream << left << setw(16) << point.name << setw(10) << point.size << right << setw(8)
+                         << point.nthreads << fixed << setw(12) << setprecision(3) << point.median * 1000;
+                  if (base && point.median) {
+                        double speedup = base / point.median;
+                        stream << setw(10) << setprecision(2) << speedup
+                               << setw(11) << setprecision(0) << 100 * speedup / point.nthreads << "%";
+                  }
+                  stream << endl;
+                  stream.unsetf(ios_base::floatfield);
+                  if (point.median < curve[best].median) best = j;
+            }
+            if (curve.size() > 1) {
+                  stream << "  (fastest with " << curve[best].nthreads << " thread(s))" << endl;
+            }
+      }
+}
+
+// Usage: see the top of the file.
+int main(int argc, char** argv) {
+      unsigned repetitions = 5, warmup = 1;
+      double audio_seconds = 10;
+      double scaling_megabytes = 0;
+      unsigned max_threads = 0;
+      bool count = false;
+      string filter, json, corpus;
+      for (int arg = 1; arg < argc; arg += 2) {
+            string flag = argv[arg];
+            if (flag == "-p") {
+                  count = true;
+                  --arg;
+                  continue;
+            }
+            if (arg + 1 == argc) flag = "";
+
+            if (flag == "-r") {
+                  repetitions = atoi(argv[arg + 1]);
+            } else if (flag == "-w") {
+                  warmup = atoi(argv[arg + 1]);
+            } else if (flag == "-s") {
+                  audio_seconds = atof(argv[arg + 1]);
+            } else if (flag == "-f") {
+                  filter = argv[arg + 1];
+            } else if (flag == "-o") {
+                  json = argv[arg + 1];
+            } else if (flag == "-c") {
+                  corpus = argv[arg + 1];
+            } else if (flag == "-S") {
+                  scaling_megabytes = atof(argv[arg + 1]);
+            } else if (flag == "-t") {
+                  max_threads = atoi(argv[arg + 1]);
+            } else {
+                  cerr << "Usage: " << argv[0] << " [-r <repetitions>] [-w <warmup runs>]"
+                       << " [-s <seconds of audio>]" << endl
+                       << "       [-f <only benchmarks with this in their name>] [-o <results.json>]" << endl
+                       << "       [-c <corpus directory>] [-S <largest file, in MB>] [-t <most threads>] [-p]" << endl;
+                  return 2;
+            }
+      }
+
+      // Before any thread starts, so they all inherit the counters.
+      unique_ptr<PerfCounters> counters;
+      if (count) {
+            counters.reset(new PerfCounters);
+            if (!counters->any()) {
+                  cerr << "Warning: the hardware counters aren't available (" << counters->error()
+                       << "). Timing only." << endl;
+            } else if (!counters->error().empty()) {
+                  cerr << "Warning: some of the hardware counters aren't available (" << counters->error()
+                       << ")." << endl;
+            }
+      }
+
+      Scratch scratch;
+      if (!scratch.ok()) {
+            cerr << "Error: I can't make a scratch directory!" << endl;
+            return 1;
+      }
+
+      if (scaling_megabytes > 0) {
+            if (!max_threads) max_threads = max(1u, thread::hardware_concurrency());
+            unsigned long long largest = min<double>(scaling_megabytes * (1 << 20), WaveWriter::MAX_DATA_BYTES);
+
+            cout << "Scaling from 1 to " << max_threads << " thread(s), on files up to " << SizeName(largest)
+                 << ", " << repetitions << " repetition(s) after " << warmup << " warmup run(s)." << endl;
+            Bench bench(repetitions, warmup, filter, counters.get());
+            bench.PrintHeader(cout);
+            vector<ScalingPoint> points;
+            if (!BenchScaling(bench, scratch, largest, max_threads, points)) return 1;
+            PrintScaling(cout, points);
+
+            if (!json.empty() && !WriteJson(json, bench.results(), repetitions, warmup)) return 1;
+            return 0;
+      }
+
+      unsigned const sample_rate = 44100;
+      unsigned const nframes = max(1.0, audio_seconds * sample_rate);
+
+      BenchFormat const formats[] = {
+            { 8, 1 }, { 16, 1 }, { 24, 1 }, { 32, 1 },
+            { 8, 2 }, { 16, 2 }, { 24, 2 }, { 32, 2 },
+            { 16, 6 }, { 32, 2, true }, { 64, 2, true },
+      };
+      unsigned const nformats = sizeof(formats)/sizeof(formats[0]);
+
+      cout << nframes << " frames at " << sample_rate << " Hz, " << repetitions << " repetition(s) after "
+           << warmup << " warmup run(s), " << ThreadPool::Shared().size() << " thread(s)." << endl;
+      Bench bench(repetitions, warmup, filter, counters.get());
+      bench.PrintHeader(cout);
+
+      // The library, in every format.
+      for (unsigned f = 0; f != nformats; ++f) {
+            BenchFormat const& format = formats[f];
+            string params = format.params();
+
+            Wave input;
+            MakeInput(input, format, sample_rate, nframes);
+            string tag = to_string(format.bits) + (format.is_float ? "f-" : "-") + to_string(format.nchannels);
+            string filename = scratch.Path("in-" + tag + ".wav");
+            if (!input.Save(filename)) return 1;
+
+            unsigned long long bytes = input.data_chunk.chunk_size;
+            vector<double> samples(nframes);
+            input.GetSamples(0, nframes, &samples[0]);
+
+            bench.Run("parse-header", params, 0, 0, 0, [&]() {
+                  Wave wave;
+                  return wave.LoadMetadata(filename);
+            });
+
+            bench.Run("load", params, nframes, bytes, sample_rate, [&]() {
+                  Wave wave;
+                  return wave.Load(filename);
+            });
+
+            string saved = scratch.Path("save-" + tag + ".wav");
+            bench.Run("save", params, nframes, bytes, sample_rate, [&]() {
+                  return input.Save(saved);
+            });
+
+            bench.Run("get-sample", params, nframes, bytes, sample_rate, [&]() {
+                  double total = 0;
+                  for (unsigned i = 0; i != nframes; ++i) total += input.GetSample(i);
+                  return total == total;
+            });
+
+            Wave output;
+            output.fmt_chunk = input.fmt_chunk;
+            output.Resize(nframes);
+            bench.Run("set-sample", params, nframes, bytes, sample_rate, [&]() {
+                  for (unsigned i = 0; i != nframes; ++i) output.SetSample(i, samples[i]);
+                  return true;
+            });
+
+            bench.Run("decode", params, nframes, bytes, sample_rate, [&]() {
+                  Wave::DecodeSamples(input.fmt_chunk, input.data_chunk.data(), nframes, &samples[0]);
+                  return true;
+            });
+
+            bench.Run("encode", params, nframes, bytes, sample_rate, [&]() {
+                  Wave::EncodeSamples(output.fmt_chunk, &samples[0], nframes, output.data_chunk.data());
+                  return true;
+            });
+
+            bench.Run("wavload", params, nframes, bytes, sample_rate, [&]() {
+                  double* loaded = WavLoad(filename);
+                  delete[] loaded;
+                  return loaded != NULL;
+            });
+      }
+
+      if (!corpus.empty() && !BenchCorpus(bench, corpus)) return 1;
+
+      // The examples, on the 16-bit mono input, with their output in the
+      // same format.
+      Wave input;
+      BenchFormat const mono = { 16, 1, false };
+      MakeInput(input, mono, sample_rate, nframes);
+      string in1 = scratch.Path("op-in1.wav"), in2 = scratch.Path("op-in2.wav");
+      if (!input.Save(in1) || !input.Save(in2)) return 1;
+      unsigned long long bytes = input.data_chunk.chunk_size;
+
+      string list = scratch.Path("op-list.txt");
+      {
+            ofstream file(list.c_str());
+            for (unsigned i = 0; i != 4; ++i) {
+                  string copy = scratch.Path("op-list-" + to_string(i) + ".wav");
+                  if (!input.Save(copy)) return 1;
+                  file << copy << "\n";
+            }
+      }
+      string index_file = scratch.Path("op-index");
+      if (!run('i', vector<string>{ list, index_file })) return 1;
+
+      // The same input cut into labeled regions, for the extraction. Its
+      // outputs go in the scratch directory too.
+      Wave marked = input;
+      vector<string> labels = AddRegions(marked, 8, "region");
+      string regions_file = scratch.Path("op-regions.wav");
+      if (!marked.Save(regions_file)) return 1;
+      string regions_prefix = scratch.Path("op-region-");
+      for (unsigned i = 0; i != labels.size(); ++i) scratch.Path("op-region-" + labels[i] + ".wav");
+
+      struct Op {
+            char mode;
+            char const* name;
+      };
+      Op const ops[] = {
+            { 'f', "faster" }, { 's', "slower" }, { 'e', "echo" }, { 'r', "reverse" },
+            { '+', "amp-up" }, { '-', "amp-down" }, { 'R', "realtime-echo" }, { 'm', "mix" },
+            { 'M', "mix-all" }, { 'p', "pitch" }, { 'i', "index" }, { 'l', "lookup" }, { 'g', "generate" },
+            { 'x', "extract" },
+      };
+
+      string result = scratch.Path("op-out.wav");
+      if (!input.Save(result)) return 1;
+      for (unsigned i = 0; i != sizeof(ops)/sizeof(ops[0]); ++i) {
+            vector<string> args;
+            unsigned long long op_frames = nframes, op_bytes = bytes;
+            switch (ops[i].mode) {
+                  case 'm': args = { in1, in2, result }; op_frames *= 2; op_bytes *= 2; break;
+                  case 'M': args = { list, result }; op_frames *= 4; op_bytes *= 4; break;
+                  case 'p': args = { in1, scratch.Path("op-pitch.txt") }; break;
+                  case 'i': args = { list, scratch.Path("op-index2") }; op_frames *= 4; op_bytes *= 4; break;
+                  case 'l': args = { index_file, in1 }; break;
+                  case 'x': args = { regions_file, regions_prefix }; break;
+                  case 'g': args = { "tone:440:" + to_string(audio_seconds), scratch.Path("op-tone.wav") }; op_bytes = 0; break;
+                  default: args = { in1, result }; break;
+            }
+
+            unsigned rate = ops[i].mode == 'g' ? FmtChunk().sample_rate : sample_rate;
+            if (ops[i].mode == 'g') op_frames = audio_seconds * rate;
+            bench.Run(ops[i].name, "16-bit 1ch", op_frames, op_bytes, rate, [&]() {
+                  return run(ops[i].mode, args);
+            });
+      }
+
+      if (!json.empty() && !WriteJson(json, bench.results(), repetitions, warmup)) return 1;
+      return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+/*** Memory Budget ***/
+// Keeps a batch of jobs from needing more memory at once than the machine
+// has. Before a job starts, whoever hands out the work reserves the job's
+// (estimated) peak footprint, waiting until enough of the budget is free; the
+// job gives it back when it's done. So a run of big files queues up instead
+// of all loading at once and waking the OOM killer.
+//
+// A job bigger than the whole budget can't ever fit, so it's let in once
+// nothing else is running, and runs alone. (Better, if there's a way to do
+// the job in less memory, e.g. by streaming, is to reserve that instead.)
+//
+// Example usage:
+//      MemoryBudget budget(1ULL << 30);
+//      for (unsigned i = 0; i != jobs.size(); ++i) {
+//            unsigned long long bytes = jobs[i].Footprint();
+//            budget.Reserve(bytes);
+//            tasks.Run([&, i, bytes]() {
+//                  jobs[i].Run();
+//                  budget.Release(bytes);
+//            });
+//      }
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <unistd.h>
+
+class MemoryBudget {
+      public:
+            /*** Constructors ***/
+            // Zero means the default (see DefaultLimit()).
+            explicit MemoryBudget(unsigned long long limit = 0)
+                  : limit_(limit ? limit : DefaultLimit()), in_use_(0), peak_(0) { }
+
+            /*** Public Methods ***/
+            // Waits until "bytes" fit in what's left of the budget (or until
+            // nothing else is reserved), then reserves them.
+            void Reserve(unsigned long long bytes);
+
+            // Reserves "bytes" if Reserve() wouldn't have to wait, and says
+            // whether it did. For callers that can't block (e.g., an event
+            // loop), which then have to try again after a Release().
+            bool TryReserve(unsigned long long bytes);
+
+            // Gives back bytes reserved with Reserve().
+            void Release(unsigned long long bytes);
+
+            unsigned long long limit(void) const { return limit_; }
+
+            // The most that's been reserved at once.
+            unsigned long long peak(void) const;
+
+            // Half the machine's physical memory, leaving the rest for the
+            // kernel's cache and everything else that's running.
+            static unsigned long long DefaultLimit(void);
+
+      private:
+            MemoryBudget(MemoryBudget const&);
+            MemoryBudget& operator=(MemoryBudget const&);
+
+            bool Fits(unsigned long long bytes) const {
+                  return in_use_ == 0 || bytes <= limit_ - std::min(limit_, in_use_);
+            }
+
+            unsigned long long limit_;
+            unsigned long long in_use_;
+            unsigned long long peak_;
+            mutable std::mutex mutex_;
+            std::condition_variable released_;
+};
+
+void MemoryBudget::Reserve(unsigned long long bytes) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      released_.wait(lock, [&]() { return Fits(bytes); });
+      in_use_ += bytes;
+      peak_ = std::max(peak_, in_use_);
+}
+
+bool MemoryBudget::TryReserve(unsigned long long bytes) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!Fits(bytes)) return false;
+      in_use_ += bytes;
+      peak_ = std::max(peak_, in_use_);
+      return true;
+}
+
+void MemoryBudget::Release(unsigned long long bytes) {
+      {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_use_ -= std::min(in_use_, bytes);
+      }
+      released_.notify_all();
+}
+
+unsigned long long MemoryBudget::peak(void) const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return peak_;
+}
+
+unsigned long long MemoryBudget::DefaultLimit(void) {
+      long pages = sysconf(_SC_PHYS_PAGES);
+      long page_size = sysconf(_SC_PAGESIZE);
+      if (pages <= 0 || page_size <= 0) return 1ULL << 30;
+      return (unsigned long long)pages * page_size / 2;
+}
+
+#endif
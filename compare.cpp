@@ -0,0 +1,332 @@
+// Compares two result files from wavebench (see bench.cpp), say from the
+// build in production and a new one, benchmark by benchmark. Benchmarks are
+// matched up by name and parameters, and each pair's repetitions are put
+// through a Mann-Whitney U test, which doesn't assume the times are normally
+// distributed (they usually have a long tail) and doesn't care about a stray
+// outlier. A benchmark only counts as faster or slower if the test says the
+// difference is significant and the medians are at least a threshold apart,
+// so noise in a big suite doesn't show up as a handful of "regressions."
+//
+// With few repetitions the p-value is exact; with more, or with tied times,
+// it comes from the normal approximation. Five repetitions a side (the
+// benchmarks' default) can get down to p = 0.008.
+//
+// Usage: wavecompare [-a <significance level>] [-t <threshold, in percent>]
+//                    <baseline.json> <new.json>
+//
+// The exit status is 1 if anything got slower, so it can gate a release, and
+// 2 if the files can't be read.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*** JsonValue ***/
+// Just enough JSON for wavebench's results: objects, arrays, strings (with
+// simple escapes), numbers, true, false and null.
+struct JsonValue {
+      enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+      Type type;
+      double number;
+      string text;
+      vector<JsonValue> items;
+      vector<pair<string, JsonValue> > members;
+
+      JsonValue(void) : type(NUL), number(0) { }
+
+      // The member with this name, or a null if there isn't one.
+      JsonValue const& operator[](string const& name) const {
+            static JsonValue const none;
+            for (unsigned i = 0; i != members.size(); ++i) {
+                  if (members[i].first == name) return members[i].second;
+            }
+            return none;
+      }
+};
+
+class JsonParser {
+      public:
+            explicit JsonParser(string const& text) : text_(text), position_(0) { }
+
+            // Parses the whole text. Returns false if it isn't JSON.
+            bool Parse(JsonValue& value) {
+                  if (!ParseValue(value)) return false;
+                  SkipSpace();
+                  return position_ == text_.size();
+            }
+
+      private:
+            bool ParseValue(JsonValue& value);
+            bool ParseString(string& text);
+            bool ParseLiteral(char const* literal) {
+                  unsigned length = strlen(literal);
+                  if (text_.compare(position_, length, literal) != 0) return false;
+                  position_ += length;
+                  return true;
+            }
+            void SkipSpace(void) {
+                  while (position_ < text_.size() && isspace((unsigned char)text_[position_])) ++position_;
+            }
+            bool Next(char c) {
+                  SkipSpace();
+                  if (position_ == text_.size() || text_[position_] != c) return false;
+                  ++position_;
+                  return true;
+            }
+
+            string const& text_;
+            size_t position_;
+};
+
+bool JsonParser::ParseValue(JsonValue& value) {
+      SkipSpace();
+      if (position_ == text_.size()) return false;
+
+      char c = text_[position_];
+      if (c == '{') {
+            value.type = JsonValue::OBJECT;
+            ++position_;
+            if (Next('}')) return true;
+            do {
+                  string name;
+                  JsonValue member;
+                  SkipSpace();
+                  if (!ParseString(name) || !Next(':') || !ParseValue(member)) return false;
+                  value.members.push_back(make_pair(name, member));
+            } while (Next(','));
+            return Next('}');
+      } else if (c == '[') {
+            value.type = JsonValue::ARRAY;
+            ++position_;
+            if (Next(']')) return true;
+            do {
+                  value.items.push_back(JsonValue());
+                  if (!ParseValue(value.items.back())) return false;
+            } while (Next(','));
+            return Next(']');
+      } else if (c == '"') {
+            value.type = JsonValue::STRING;
+            return ParseString(value.text);
+      } else if (ParseLiteral("true") || ParseLiteral("false")) {
+            value.type = JsonValue::BOOLEAN;
+            value.number = c == 't';
+            return true;
+      } else if (ParseLiteral("null")) {
+            value.type = JsonValue::NUL;
+            return true;
+      }
+
+      char const* start = text_.c_str() + position_;
+      char* end;
+      value.type = JsonValue::NUMBER;
+      value.number = strtod(start, &end);
+      position_ += end - start;
+      return end != start;
+}
+
+bool JsonParser::ParseString(string& text) {
+      if (position_ == text_.size() || text_[position_] != '"') return false;
+      for (++position_; position_ < text_.size(); ++position_) {
+            char c = text_[position_];
+            if (c == '"') {
+                  ++position_;
+                  return true;
+            }
+            if (c == '\\' && ++position_ < text_.size()) {
+                  c = text_[position_];
+                  if (c == 'n') c = '\n';
+                  else if (c == 't') c = '\t';
+            }
+            text += c;
+      }
+      return false;
+}
+
+/*** Mann-Whitney U Test ***/
+// How many ways of ranking m + n distinct values give each U, for U from 0 to
+// m * n: the number of ways for (m, n) is the ways for (m - 1, n) with the
+// biggest value in the first sample (which adds n to U) plus the ways for
+// (m, n - 1) with it in the second.
+vector<double> UDistribution(unsigned m, unsigned n) {
+      // ways[j][u], for the current m and second samples of size j.
+      vector<vector<double> > ways(n + 1, vector<double>(1, 1));
+      for (unsigned i = 1; i <= m; ++i) {
+            vector<vector<double> > next(n + 1);
+            next[0].assign(1, 1);
+            for (unsigned j = 1; j <= n; ++j) {
+                  next[j].assign(i * j + 1, 0);
+                  for (unsigned u = 0; u != next[j].size(); ++u) {
+                        if (u >= j && u - j < ways[j].size()) next[j][u] += ways[j][u - j];
+                        if (u < next[j - 1].size()) next[j][u] += next[j - 1][u];
+                  }
+            }
+            ways.swap(next);
+      }
+      return ways[n];
+}
+
+// The two-sided p-value for the difference between two samples.
+double MannWhitney(vector<double> const& a, vector<double> const& b) {
+      unsigned m = a.size(), n = b.size();
+      if (!m || !n) return 1;
+
+      // Rank everything together, giving tied values their average rank.
+      vector<pair<double, unsigned> > all;
+      for (unsigned i = 0; i != m; ++i) all.push_back(make_pair(a[i], 0));
+      for (unsigned i = 0; i != n; ++i) all.push_back(make_pair(b[i], 1));
+      sort(all.begin(), all.end());
+
+      double rank_sum = 0, tie_term = 0;
+      bool ties = false;
+      for (unsigned i = 0; i != all.size(); ) {
+            unsigned j = i;
+            while (j != all.size() && all[j].first == all[i].first) ++j;
+            double rank = (i + 1 + j) / 2.0;
+            for (unsigned k = i; k != j; ++k) {
+                  if (all[k].second == 0) rank_sum += rank;
+            }
+            double t = j - i;
+            tie_term += t * t * t - t;
+            if (t > 1) ties = true;
+            i = j;
+      }
+      double u = rank_sum - m * (m + 1) / 2.0;
+
+      if (!ties && m <= 30 && n <= 30) {
+            vector<double> ways = UDistribution(m, n);
+            double total = 0, below = 0, above = 0;
+            for (unsigned k = 0; k != ways.size(); ++k) {
+                  total += ways[k];
+                  if (k <= u) below += ways[k];
+                  if (k >= u) above += ways[k];
+            }
+            return min(1.0, 2 * min(below, above) / total);
+      }
+
+      double mean = m * n / 2.0;
+      double N = m + n;
+      double variance = m * n / 12.0 * ((N + 1) - tie_term / (N * (N - 1)));
+      if (variance <= 0) return 1;
+      double z = max(0.0, fabs(u - mean) - 0.5) / sqrt(variance);
+      return erfc(z / sqrt(2.0));
+}
+
+/*** Results ***/
+struct Benchmark {
+      string name;
+      string params;
+      vector<double> seconds;
+      double median;
+};
+
+// Reads a wavebench results file, keyed by "<name> <params>". Fails (and
+// prints out some messages) if it can't.
+bool ReadResults(string const& filename, map<string, Benchmark>& results) {
+      ifstream file(filename.c_str());
+      if (!file.good()) {
+            cerr << "Error: I can't open " << filename << "!" << endl;
+            return false;
+      }
+      stringstream contents;
+      contents << file.rdbuf();
+      string text = contents.str();
+
+      JsonValue root;
+      if (!JsonParser(text).Parse(root) || root["benchmarks"].type != JsonValue::ARRAY) {
+            cerr << "Error: " << filename << " doesn't appear to be a wavebench results file!" << endl;
+            return false;
+      }
+
+      vector<JsonValue> const& benchmarks = root["benchmarks"].items;
+      for (unsigned i = 0; i != benchmarks.size(); ++i) {
+            Benchmark benchmark;
+            benchmark.name = benchmarks[i]["name"].text;
+            benchmark.params = benchmarks[i]["params"].text;
+            benchmark.median = benchmarks[i]["median"].number;
+            vector<JsonValue> const& seconds = benchmarks[i]["seconds"].items;
+            for (unsigned j = 0; j != seconds.size(); ++j) benchmark.seconds.push_back(seconds[j].number);
+            results[benchmark.name + " " + benchmark.params] = benchmark;
+      }
+      return true;
+}
+
+string Milliseconds(double seconds) {
+      ostringstream text;
+      text << fixed << setprecision(seconds < 0.01 ? 4 : 2) << seconds * 1e3 << " ms";
+      return text.str();
+}
+
+// Usage: see the top of the file.
+int main(int argc, char** argv) {
+      double alpha = 0.05, threshold = 2;
+      int arg = 1;
+      for (; arg + 2 < argc; arg += 2) {
+            string flag = argv[arg];
+            if (flag == "-a") {
+                  alpha = atof(argv[arg + 1]);
+            } else if (flag == "-t") {
+                  threshold = atof(argv[arg + 1]);
+            } else {
+                  break;
+            }
+      }
+      if (argc - arg != 2) {
+            cerr << "Usage: " << argv[0] << " [-a <significance level>] [-t <threshold, in percent>]"
+                 << " <baseline.json> <new.json>" << endl;
+            return 2;
+      }
+
+      map<string, Benchmark> baseline, current;
+      if (!ReadResults(argv[arg], baseline) || !ReadResults(argv[arg + 1], current)) return 2;
+
+      unsigned nfaster = 0, nslower = 0, nsame = 0, nmissing = 0, nadded = 0;
+      cout << left << setw(44) << "benchmark" << right << setw(12) << "baseline" << setw(12) << "new"
+           << setw(9) << "change" << setw(9) << "p" << endl;
+      for (map<string, Benchmark>::const_iterator it = baseline.begin(); it != baseline.end(); ++it) {
+            map<string, Benchmark>::const_iterator match = current.find(it->first);
+            if (match == current.end()) {
+                  ++nmissing;
+                  continue;
+            }
+
+            Benchmark const& before = it->second;
+            Benchmark const& after = match->second;
+            double change = before.median > 0 ? 100 * (after.median / before.median - 1) : 0;
+            double p = MannWhitney(before.seconds, after.seconds);
+
+            string verdict;
+            if (p < alpha && fabs(change) >= threshold) {
+                  verdict = change < 0 ? "faster" : "SLOWER";
+                  ++(change < 0 ? nfaster : nslower);
+            } else {
+                  ++nsame;
+            }
+
+            cout << left << setw(44) << it->first << right << setw(12) << Milliseconds(before.median)
+                 << setw(12) << Milliseconds(after.median) << setw(8) << showpos << fixed << setprecision(1)
+                 << change << "%" << noshowpos << setw(9) << setprecision(4) << p
+                 << (verdict.empty() ? "" : "  ") << verdict << endl;
+      }
+      for (map<string, Benchmark>::const_iterator it = current.begin(); it != current.end(); ++it) {
+            if (!baseline.count(it->first)) ++nadded;
+      }
+
+      cout << defaultfloat << endl << nfaster << " faster, " << nslower << " slower, " << nsame << " no significant change";
+      if (nmissing) cout << ", " << nmissing << " only in the baseline";
+      if (nadded) cout << ", " << nadded << " only in the new results";
+      cout << " (p < " << alpha << ", at least " << threshold << "% apart)." << endl;
+
+      return nslower ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+// Generates a corpus of .WAV files for benchmarking, the same every time for
+// the same seed:
+//      format-<kind>-<n>ch.wav     Every sample format the library handles
+//                                  (8, 16, 24 and 32-bit integer, 32 and
+//                                  64-bit float) with 1 to 8 channels.
+//      length-<seconds>s.wav       16-bit stereo, from a clip of a few
+//                                  milliseconds up to a few gigabytes (as far
+//                                  as -l allows).
+//      chunks-many.wav             Thousands of small chunks we don't know
+//      chunks-large.wav            about, or one big one, before the data.
+// Every channel gets its own signal (a couple of tones plus noise, picked by
+// the seed), so nothing's compressible or the same across channels. It's all
+// written through the library: WaveWriter for the format and length files,
+// so even the longest are never in memory, and Wave::Save() for the chunk
+// files.
+//
+// MANIFEST lists every file with its format, length and a checksum of its
+// bytes, so two machines (or two versions of the library) can check that
+// they're benchmarking the same data.
+//
+// Usage: wavecorpus [-s <seed>] [-l <largest file, in MB>] -o <directory>
+
+#include "wave.h"
+#include "generators.h"
+#include "stream.h"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// splitmix64: turns any 64-bit number (e.g., a seed plus a counter) into a
+// well-mixed one.
+unsigned long long Mix(unsigned long long x) {
+      x += 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return x ^ (x >> 31);
+}
+
+// 64-bit FNV-1a, for naming seeds and checksumming files.
+unsigned long long Fnv1a(char const* bytes, unsigned long long length, unsigned long long hash = 0xcbf29ce484222325ULL) {
+      for (unsigned long long i = 0; i != length; ++i) {
+            hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001b3ULL;
+      }
+      return hash;
+}
+
+/*** CorpusSignal ***/
+// Encoded, interleaved frames in any format, each channel with its own tones
+// and noise.
+class CorpusSignal {
+      public:
+            CorpusSignal(FmtChunk const& fmt, unsigned long long nframes, unsigned long long seed);
+
+            // Fills "frames" with up to "nframes" frames in the format, and
+            // returns how many.
+            unsigned ReadFrames(char* frames, unsigned nframes);
+
+      private:
+            FmtChunk mono_;
+            unsigned nchannels_;
+            vector<unique_ptr<Multitone> > tones_;
+            vector<unique_ptr<WhiteNoise> > noise_;
+            vector<double> tone_block_;
+            vector<double> noise_block_;
+            vector<char> encoded_;
+};
+
+CorpusSignal::CorpusSignal(FmtChunk const& fmt, unsigned long long nframes, unsigned long long seed)
+      : mono_(fmt), nchannels_(fmt.nchannels) {
+      mono_.nchannels = 1;
+      mono_.block_align = fmt.bits_per_sample / 8;
+
+      for (unsigned c = 0; c != nchannels_; ++c) {
+            unsigned long long channel_seed = Mix(seed + c);
+            vector<double> frequencies;
+            frequencies.push_back(40 + Mix(channel_seed + 1) % 2000);
+            frequencies.push_back(40 + Mix(channel_seed + 2) % 8000);
+            tones_.push_back(unique_ptr<Multitone>(new Multitone(fmt.sample_rate, frequencies, nframes, 0.6)));
+            noise_.push_back(unique_ptr<WhiteNoise>(new WhiteNoise(nframes, channel_seed, 0.2)));
+      }
+}
+
+unsigned CorpusSignal::ReadFrames(char* frames, unsigned nframes) {
+      unsigned width = mono_.block_align;
+      tone_block_.resize(nframes);
+      noise_block_.resize(nframes);
+      encoded_.resize((size_t)nframes * width);
+
+      unsigned n = 0;
+      for (unsigned c = 0; c != nchannels_; ++c) {
+            n = tones_[c]->Read(&tone_block_[0], nframes);
+            noise_[c]->Read(&noise_block_[0], n);
+            for (unsigned i = 0; i != n; ++i) tone_block_[i] += noise_block_[i];
+
+            // Encode the channel on its own, then put it in its place in
+            // every frame.
+            Wave::EncodeSamples(mono_, &tone_block_[0], n, &encoded_[0]);
+            for (unsigned i = 0; i != n; ++i) {
+                  memcpy(frames + ((size_t)i * nchannels_ + c) * width, &encoded_[(size_t)i * width], width);
+            }
+      }
+      return n;
+}
+
+/*** Corpus ***/
+// Writes the files and keeps the manifest.
+class Corpus {
+      public:
+            Corpus(string const& directory, unsigned long long seed)
+                  : directory_(directory), seed_(seed) { }
+
+            // Streams "nframes" frames of signal in the given format.
+            bool WriteSignal(string const& name, FmtChunk const& fmt, unsigned long long nframes);
+
+            // Saves a Wave with its data filled in from the signal.
+            bool WriteWave(string const& name, Wave& wave, unsigned long long nframes);
+
+            bool WriteManifest(void);
+
+            // The seed for one file: the corpus seed mixed with its name.
+            unsigned long long SeedFor(string const& name) const {
+                  return Mix(seed_ ^ Fnv1a(name.data(), name.size()));
+            }
+
+      private:
+            bool Record(string const& name, FmtChunk const& fmt, unsigned long long nframes);
+
+            string directory_;
+            unsigned long long seed_;
+            ostringstream manifest_;
+};
+
+bool Corpus::WriteSignal(string const& name, FmtChunk const& fmt, unsigned long long nframes) {
+      WaveWriter writer;
+      if (!writer.Open(directory_ + "/" + name, fmt)) return false;
+
+      CorpusSignal signal(writer.fmt(), nframes, SeedFor(name));
+      unsigned const block_frames = 1 << 16;
+      vector<char> frames((size_t)block_frames * writer.fmt().block_align);
+      while (unsigned n = signal.ReadFrames(&frames[0], block_frames)) {
+            if (!writer.WriteFrames(&frames[0], n)) return false;
+      }
+
+      return writer.Close() && Record(name, writer.fmt(), nframes);
+}
+
+bool Corpus::WriteWave(string const& name, Wave& wave, unsigned long long nframes) {
+      wave.Resize(nframes);
+      CorpusSignal signal(wave.fmt_chunk, nframes, SeedFor(name));
+      signal.ReadFrames(wave.data_chunk.data(), nframes);
+
+      return wave.Save(directory_ + "/" + name) && Record(name, wave.fmt_chunk, nframes);
+}
+
+// Checksums the file as written and adds its line to the manifest.
+bool Corpus::Record(string const& name, FmtChunk const& fmt, unsigned long long nframes) {
+      ifstream file((directory_ + "/" + name).c_str(), ios_base::binary);
+      unsigned long long hash = 0xcbf29ce484222325ULL, bytes = 0;
+      vector<char> buffer(1 << 20);
+      while (file.read(&buffer[0], buffer.size()) || file.gcount()) {
+            hash = Fnv1a(&buffer[0], file.gcount(), hash);
+            bytes += file.gcount();
+      }
+
+      manifest_ << name << " " << (fmt.compression == FmtChunk::COMPRESSION_FLOAT ? "float" : "int")
+                << " " << fmt.bits_per_sample << " " << fmt.nchannels << " " << fmt.sample_rate
+                << " " << nframes << " " << bytes << " " << hex << hash << dec << "\n";
+      cout << name << " (" << bytes << " bytes)" << endl;
+      return bytes != 0;
+}
+
+bool Corpus::WriteManifest(void) {
+      string filename = directory_ + "/MANIFEST";
+      ofstream file(filename.c_str());
+      file << "# seed " << seed_ << "\n"
+           << "# name kind bits channels sample_rate frames bytes fnv1a64\n"
+           << manifest_.str();
+      file.close();
+      if (file.fail()) {
+            cerr << "Error: I can't write " << filename << "!" << endl;
+            return false;
+      }
+      return true;
+}
+
+// Usage: see the top of the file.
+int main(int argc, char** argv) {
+      unsigned long long seed = 1, largest_mb = 128;
+      string directory;
+      for (int arg = 1; arg < argc; arg += 2) {
+            string flag = argv[arg];
+            if (arg + 1 == argc) flag = "";
+
+            if (flag == "-s") {
+                  seed = strtoull(argv[arg + 1], NULL, 10);
+            } else if (flag == "-l") {
+                  largest_mb = strtoull(argv[arg + 1], NULL, 10);
+            } else if (flag == "-o") {
+                  directory = argv[arg + 1];
+            } else {
+                  directory = "";
+                  break;
+            }
+      }
+      if (directory.empty()) {
+            cerr << "Usage: " << argv[0] << " [-s <seed>] [-l <largest file, in MB>] -o <directory>" << endl;
+            return 2;
+      }
+
+      Corpus corpus(directory, seed);
+      unsigned const sample_rate = 44100;
+
+      // Every format, one second each.
+      struct Kind {
+            char const* name;
+            uint16_t compression;
+            uint16_t bits;
+      };
+      Kind const kinds[] = {
+            { "i8", FmtChunk::COMPRESSION_NONE, 8 },
+            { "i16", FmtChunk::COMPRESSION_NONE, 16 },
+            { "i24", FmtChunk::COMPRESSION_NONE, 24 },
+            { "i32", FmtChunk::COMPRESSION_NONE, 32 },
+            { "f32", FmtChunk::COMPRESSION_FLOAT, 32 },
+            { "f64", FmtChunk::COMPRESSION_FLOAT, 64 },
+      };
+      for (unsigned k = 0; k != sizeof(kinds)/sizeof(kinds[0]); ++k) {
+            for (unsigned nchannels = 1; nchannels <= 8; ++nchannels) {
+                  FmtChunk fmt;
+                  fmt.compression = kinds[k].compression;
+                  fmt.bits_per_sample = kinds[k].bits;
+                  fmt.nchannels = nchannels;
+                  fmt.sample_rate = sample_rate;
+
+                  ostringstream name;
+                  name << "format-" << kinds[k].name << "-" << nchannels << "ch.wav";
+                  if (!corpus.WriteSignal(name.str(), fmt, sample_rate)) return 1;
+            }
+      }
+
+      // 16-bit stereo at every length that fits under the limit. The
+      // longest is just under the 4 GB a WAV file can hold.
+      char const* const lengths[] = { "0.01", "0.1", "1", "10", "60", "600", "3600", "12000", "24000" };
+      for (unsigned i = 0; i != sizeof(lengths)/sizeof(lengths[0]); ++i) {
+            FmtChunk fmt;
+            fmt.nchannels = 2;
+            fmt.sample_rate = sample_rate;
+
+            unsigned long long nframes = atof(lengths[i]) * sample_rate;
+            if (nframes * 4 > largest_mb << 20 || nframes * 4 > WaveWriter::MAX_DATA_BYTES) break;
+            if (!corpus.WriteSignal(string("length-") + lengths[i] + "s.wav", fmt, nframes)) return 1;
+      }
+
+      // Chunks we don't know about, with made-up IDs (a capital and three
+      // small letters, so never "fmt " or "data") and odd sizes as well as
+      // even ones, so there's padding.
+      {
+            Wave wave;
+            wave.fmt_chunk.nchannels = 2;
+            wave.fmt_chunk.sample_rate = sample_rate;
+
+            unsigned long long state = corpus.SeedFor("chunks-many.wav");
+            for (unsigned i = 0; i != 5000; ++i) {
+                  char id[4];
+                  for (unsigned j = 0; j != 4; ++j) id[j] = (j ? 'a' : 'A') + (state = Mix(state)) % 26;
+                  uint32_t type = (unsigned char)id[0] | (unsigned char)id[1] << 8
+                                | (unsigned char)id[2] << 16 | (unsigned)(unsigned char)id[3] << 24;
+
+                  DataChunk chunk(type);
+                  chunk.ReAllocData((state = Mix(state)) % 256);
+                  for (unsigned j = 0; j != chunk.chunk_size; ++j) chunk.data()[j] = (state = Mix(state));
+                  wave.other_chunks.push_back(chunk);
+            }
+            if (!corpus.WriteWave("chunks-many.wav", wave, sample_rate)) return 1;
+      }
+      {
+            Wave wave;
+            wave.fmt_chunk.nchannels = 2;
+            wave.fmt_chunk.sample_rate = sample_rate;
+
+            // A quarter of the size limit, up to 256 MB. (Filled in place,
+            // since copying it into the vector would need twice that.)
+            wave.other_chunks.push_back(DataChunk(0x6b6e756a)); // "junk"
+            DataChunk& chunk = wave.other_chunks.back();
+            chunk.ReAllocData(min(largest_mb << 18, 256ULL << 20));
+            unsigned long long state = corpus.SeedFor("chunks-large.wav");
+            for (unsigned j = 0; j != chunk.chunk_size; ++j) {
+                  if (j % 8 == 0) state = Mix(state);
+                  chunk.data()[j] = state >> 8 * (j % 8);
+            }
+            if (!corpus.WriteWave("chunks-large.wav", wave, sample_rate)) return 1;
+      }
+
+      return corpus.WriteManifest() ? 0 : 1;
+}
@@ -0,0 +1,503 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+/*** Job Daemon ***/
+// Starting a process per small file spends more time getting going (loading
+// the program, starting threads, designing windows and filters) than doing
+// the work. A JobServer stays up instead and takes jobs over a Unix domain
+// socket, so the thread pool, the kernel cache (see kernels.h) and the OS's
+// cache of the files it just read all stay warm between jobs.
+//
+// The protocol is a simple binary one. All integers are little-endian.
+//
+//      Request:  u32 magic ("WJOB"), u32 mode (e.g., 'e'), u32 nargs, then
+//                nargs times: u32 length, then that many bytes.
+//      Reply:    u32 magic ("WRES"), u32 status (JOB_OK, JOB_FAILED or
+//                JOB_BAD), u64 nanoseconds waiting (for memory, if there's
+//                a budget, and for a thread), u64 nanoseconds running.
+//
+// A connection can send any number of requests, one after another, and gets
+// one reply per request, in order. Separate connections run in parallel. A
+// request with mode 'q' (and no arguments) shuts the server down, as does
+// SIGINT or SIGTERM. Shutting down stops taking connections and requests,
+// but the jobs already running finish (and get their replies) first.
+//
+// The server runs on an EventLoop (see async.h): one thread waits on every
+// connection, and the jobs themselves run on the thread pool. Given a
+// MemoryBudget (see budget.h), it holds each job back until its memory fits;
+// the waiting happens on the loop, so a job that has to wait doesn't tie up
+// a thread that other jobs could use.
+//
+// Example usage:
+//      JobServer server("/tmp/wave.sock", [](char mode, std::vector<std::string> const& args) {
+//            return Run(mode, args);
+//      });
+//      server.Run();
+//
+//      // Elsewhere:
+//      JobReply reply;
+//      SendJob("/tmp/wave.sock", 'e', args, reply);
+
+#include "async.h"
+#include "budget.h"
+#include "threadpool.h"
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Job statuses.
+static unsigned const JOB_OK = 0;
+static unsigned const JOB_FAILED = 1;
+static unsigned const JOB_BAD = 2;
+
+struct JobReply {
+      unsigned status;
+      unsigned long long queued_ns;
+      unsigned long long run_ns;
+};
+
+// A job, sized up before it runs: how much of the budget it needs, and what
+// to run (returning the job's status) once that's reserved.
+struct JobPlan {
+      unsigned long long bytes;
+      std::function<unsigned()> run;
+};
+
+// Puts a little-endian value into a buffer (or takes one out).
+template <class T>
+static void PutLittleEndian(std::vector<char>& buffer, T value) {
+      for (unsigned i = 0; i != sizeof(T); ++i) buffer.push_back((value >> 8*i) & 0xff);
+}
+
+template <class T>
+static T GetLittleEndian(char const* bytes) {
+      T value = 0;
+      for (unsigned i = 0; i != sizeof(T); ++i) value |= (T)(unsigned char)bytes[i] << 8*i;
+      return value;
+}
+
+/*** JobServer ***/
+class JobServer {
+      public:
+            // Runs one job and returns its status. Called on the thread
+            // pool, from any number of threads at once.
+            typedef std::function<unsigned(char mode, std::vector<std::string> const& args)> Runner;
+
+            // Sizes up a job (e.g., from its files' headers) without running
+            // it. Also called on the thread pool, and should be quick.
+            typedef std::function<JobPlan(char mode, std::vector<std::string> const& args)> Planner;
+
+            /*** Constructors ***/
+            // Jobs run as soon as there's a thread for them.
+            JobServer(std::string const& socket_path, Runner const& runner,
+                      ThreadPool& pool = ThreadPool::Shared())
+                  : socket_path_(socket_path), runner_(runner), budget_(NULL), loop_(pool),
+                    listen_fd_(-1), signal_fd_(-1), backoff_fd_(-1), njobs_(0), stopping_(false) { }
+
+            // Jobs wait (in the order they came in) until what their plans
+            // need fits in "budget". Nothing but this server's jobs should
+            // reserve from it, since the waiting jobs are only looked at
+            // again when one of those finishes.
+            JobServer(std::string const& socket_path, Planner const& planner, MemoryBudget& budget,
+                      ThreadPool& pool = ThreadPool::Shared())
+                  : socket_path_(socket_path), planner_(planner), budget_(&budget), loop_(pool),
+                    listen_fd_(-1), signal_fd_(-1), backoff_fd_(-1), njobs_(0), stopping_(false) { }
+
+            /*** Public Methods ***/
+            // Serves jobs until it's told to stop, then waits for the jobs
+            // that are still running. Returns false (and prints out some
+            // messages) if the socket can't be set up.
+            bool Run(void);
+
+            // SIGINT and SIGTERM get handled on the loop, which only works if
+            // no other thread can take them. Call this before anything starts
+            // a thread (Run() does too, but by then the pool is running).
+            static void BlockShutdownSignals(void) {
+                  sigset_t signals = ShutdownSignals();
+                  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+            }
+
+            /*** Constants ***/
+            // "WJOB" and "WRES"
+            static unsigned const REQUEST_MAGIC = 0x424f4a57;
+            static unsigned const REPLY_MAGIC = 0x53455257;
+
+            static unsigned const SHUTDOWN = 'q';
+
+            // Anything bigger isn't a job we'd be able to run.
+            static unsigned const MAX_ARGS = 64;
+            static unsigned const MAX_ARG_LENGTH = 1 << 16;
+
+            // How long to wait before accepting again when we're out of file
+            // descriptors (or memory), in milliseconds.
+            static unsigned const ACCEPT_BACKOFF_MS = 100;
+
+      private:
+            JobServer(JobServer const&);
+            JobServer& operator=(JobServer const&);
+
+            static sigset_t ShutdownSignals(void) {
+                  sigset_t signals;
+                  sigemptyset(&signals);
+                  sigaddset(&signals, SIGINT);
+                  sigaddset(&signals, SIGTERM);
+                  return signals;
+            }
+
+            Task<void> Accept(void);
+            Task<void> Serve(int fd);
+            Task<void> WatchSignals(void);
+            Task<void> Backoff(void);
+            static bool SleepOnPool(void) {
+                  std::this_thread::sleep_for(std::chrono::microseconds(ACCEPT_BACKOFF_MS * 1000));
+                  return true;
+            }
+
+            // co_await Admit(bytes) waits until "bytes" are reserved from the
+            // budget, behind the jobs already waiting.
+            struct AdmitAwaiter {
+                  JobServer& server;
+                  unsigned long long bytes;
+
+                  bool await_ready(void) const {
+                        return server.admitting_.empty() && server.budget_->TryReserve(bytes);
+                  }
+                  void await_suspend(std::coroutine_handle<> handle) {
+                        server.admitting_.push_back(std::make_pair(bytes, handle));
+                  }
+                  void await_resume(void) const { }
+            };
+            AdmitAwaiter Admit(unsigned long long bytes) { return AdmitAwaiter{*this, bytes}; }
+
+            // Lets in the waiting jobs that fit now, after one's finished.
+            void AdmitWaiting(void);
+
+            // Stops taking connections and requests. Every coroutine then
+            // finishes (once its job, if it has one, is done), and Run()
+            // returns when the last one has.
+            void Shutdown(void);
+
+            std::string socket_path_;
+            Runner runner_;
+            Planner planner_;
+            MemoryBudget* budget_;
+            EventLoop loop_;
+
+            // Only the loop thread uses these.
+            int listen_fd_;
+            int signal_fd_;
+            int backoff_fd_;
+            std::set<int> clients_;
+            std::deque<std::pair<unsigned long long, std::coroutine_handle<> > > admitting_;
+            unsigned njobs_;
+            bool stopping_;
+};
+
+// Reads exactly "length" bytes from a non-blocking descriptor. Returns false
+// at EOF or on an error.
+Task<bool> ReadFully(EventLoop& loop, int fd, char* buffer, size_t length) {
+      while (length) {
+            ssize_t n = read(fd, buffer, length);
+            if (n > 0) {
+                  buffer += n;
+                  length -= n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                  co_await loop.WaitFor(fd, EPOLLIN);
+            } else if (n < 0 && errno == EINTR) {
+                  continue;
+            } else {
+                  co_return false;
+            }
+      }
+      co_return true;
+}
+
+Task<bool> WriteFully(EventLoop& loop, int fd, char const* buffer, size_t length) {
+      while (length) {
+            ssize_t n = send(fd, buffer, length, MSG_NOSIGNAL);
+            if (n > 0) {
+                  buffer += n;
+                  length -= n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                  co_await loop.WaitFor(fd, EPOLLOUT);
+            } else if (n < 0 && errno == EINTR) {
+                  continue;
+            } else {
+                  co_return false;
+            }
+      }
+      co_return true;
+}
+
+bool JobServer::Run(void) {
+      BlockShutdownSignals();
+      sigset_t signals = ShutdownSignals();
+      signal_fd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+      sockaddr_un address;
+      std::memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      if (socket_path_.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Error: " << socket_path_ << " is too long for a socket path!" << std::endl;
+            if (signal_fd_ >= 0) close(signal_fd_);
+            return false;
+      }
+      std::strcpy(address.sun_path, socket_path_.c_str());
+
+      listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      unlink(socket_path_.c_str());
+      if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr*)&address, sizeof(address)) != 0
+                  || listen(listen_fd_, 128) != 0) {
+            std::cerr << "Error: I can't listen on " << socket_path_ << "!" << std::endl;
+            if (listen_fd_ >= 0) close(listen_fd_);
+            if (signal_fd_ >= 0) close(signal_fd_);
+            return false;
+      }
+
+      // Nothing stops the loop from outside: it runs until every coroutine
+      // has finished, which (after a Shutdown()) is once the last job has.
+      stopping_ = false;
+      backoff_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      loop_.Spawn(Accept());
+      if (signal_fd_ >= 0) loop_.Spawn(WatchSignals());
+      loop_.Run();
+
+      close(listen_fd_);
+      unlink(socket_path_.c_str());
+      if (signal_fd_ >= 0) close(signal_fd_);
+      if (backoff_fd_ >= 0) close(backoff_fd_);
+      listen_fd_ = signal_fd_ = backoff_fd_ = -1;
+      return true;
+}
+
+void JobServer::Shutdown(void) {
+      if (stopping_) return;
+      stopping_ = true;
+      if (njobs_) std::cerr << "Waiting for " << njobs_ << " job(s) to finish." << std::endl;
+
+      loop_.Cancel(listen_fd_);
+      if (signal_fd_ >= 0) loop_.Cancel(signal_fd_);
+      if (backoff_fd_ >= 0) loop_.Cancel(backoff_fd_);
+
+      // A client waiting to send its next request reads an end of file
+      // instead, and one with a job running gets the reply, then the end of
+      // file.
+      for (std::set<int>::iterator it = clients_.begin(); it != clients_.end(); ++it) {
+            shutdown(*it, SHUT_RD);
+      }
+}
+
+void JobServer::AdmitWaiting(void) {
+      while (!admitting_.empty() && budget_->TryReserve(admitting_.front().first)) {
+            std::coroutine_handle<> handle = admitting_.front().second;
+            admitting_.pop_front();
+            loop_.Post(handle);
+      }
+}
+
+Task<void> JobServer::Accept(void) {
+      bool backing_off = false;
+      while (!stopping_) {
+            co_await loop_.WaitFor(listen_fd_, EPOLLIN);
+
+            int fd;
+            while (!stopping_ && (fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                  loop_.Spawn(Serve(fd));
+                  backing_off = false;
+            }
+            if (stopping_ || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                  // The connection stays in the backlog, so trying again
+                  // right away would just spin. The clients we have will
+                  // finish and free some up.
+                  if (!backing_off) {
+                        std::cerr << "Error: I can't accept a connection (" << strerror(errno)
+                                  << "); trying again every " << ACCEPT_BACKOFF_MS << " ms." << std::endl;
+                  }
+                  backing_off = true;
+                  co_await Backoff();
+            } else if (errno != ECONNABORTED && errno != EINTR && errno != EPROTO && errno != EPERM) {
+                  // Anything else means the socket itself is broken.
+                  std::cerr << "Error: I can't accept connections on " << socket_path_ << " ("
+                            << strerror(errno) << ")!" << std::endl;
+                  Shutdown();
+            }
+      }
+}
+
+// The timer's made up front, in Run(), since by the time we need it there
+// may not be a descriptor left for it.
+Task<void> JobServer::Backoff(void) {
+      itimerspec timeout = itimerspec();
+      timeout.it_value.tv_sec = ACCEPT_BACKOFF_MS / 1000;
+      timeout.it_value.tv_nsec = ACCEPT_BACKOFF_MS % 1000 * 1000000L;
+      if (backoff_fd_ < 0 || timerfd_settime(backoff_fd_, 0, &timeout, NULL) != 0) {
+            // No timer: a thread on the pool can wait instead.
+            co_await loop_.Offload(SleepOnPool);
+            co_return;
+      }
+
+      co_await loop_.WaitFor(backoff_fd_, EPOLLIN);
+      unsigned long long expirations;
+      if (read(backoff_fd_, &expirations, sizeof(expirations)) < 0) {
+            // It was cancelled before it went off.
+      }
+}
+
+Task<void> JobServer::WatchSignals(void) {
+      co_await loop_.WaitFor(signal_fd_, EPOLLIN);
+      Shutdown();
+}
+
+Task<void> JobServer::Serve(int fd) {
+      typedef std::chrono::steady_clock Clock;
+
+      clients_.insert(fd);
+      while (!stopping_) {
+            char header[12];
+            if (!co_await ReadFully(loop_, fd, header, sizeof(header))) break;
+
+            unsigned magic = GetLittleEndian<unsigned>(header);
+            unsigned mode = GetLittleEndian<unsigned>(header + 4);
+            unsigned nargs = GetLittleEndian<unsigned>(header + 8);
+
+            // If the request doesn't look right, we can't trust anything
+            // after it, so we reply and hang up.
+            bool bad = magic != REQUEST_MAGIC || nargs > MAX_ARGS || mode > 0xff;
+            std::vector<std::string> args;
+            for (unsigned i = 0; i != nargs && !bad; ++i) {
+                  char length_bytes[4];
+                  if (!co_await ReadFully(loop_, fd, length_bytes, sizeof(length_bytes))) break;
+                  unsigned length = GetLittleEndian<unsigned>(length_bytes);
+                  if (length > MAX_ARG_LENGTH) {
+                        bad = true;
+                        break;
+                  }
+
+                  std::string arg(length, '\0');
+                  if (length && !co_await ReadFully(loop_, fd, &arg[0], length)) break;
+                  args.push_back(arg);
+            }
+            if (!bad && args.size() != nargs) break;
+
+            JobReply reply = { JOB_BAD, 0, 0 };
+            bool shutdown = !bad && mode == SHUTDOWN && nargs == 0;
+            if (shutdown) {
+                  reply.status = JOB_OK;
+            } else if (!bad) {
+                  // Timestamps are taken on the pool thread, so the queue
+                  // time covers the wait for memory and a free worker.
+                  Clock::time_point submitted = Clock::now();
+                  ++njobs_;
+
+                  // The plan's made on the pool (it may read files), but the
+                  // waiting for memory is done here.
+                  JobPlan plan = { 0, std::function<unsigned()>() };
+                  if (budget_) {
+                        Planner& planner = planner_;
+                        std::function<JobPlan()> size_up = [&planner, &args, mode]() { return planner((char)mode, args); };
+                        plan = co_await loop_.Offload(size_up);
+                        co_await Admit(plan.bytes);
+                  } else {
+                        Runner& runner = runner_;
+                        plan.run = [&runner, &args, mode]() { return runner((char)mode, args); };
+                  }
+
+                  std::function<unsigned()>& run = plan.run;
+                  std::function<JobReply()> job = [&run, submitted]() {
+                        Clock::time_point start = Clock::now();
+                        JobReply result;
+                        result.status = run();
+                        result.queued_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - submitted).count();
+                        result.run_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+                        return result;
+                  };
+                  reply = co_await loop_.Offload(job);
+                  --njobs_;
+
+                  if (budget_) {
+                        budget_->Release(plan.bytes);
+                        AdmitWaiting();
+                  }
+            }
+
+            std::vector<char> bytes;
+            PutLittleEndian(bytes, REPLY_MAGIC);
+            PutLittleEndian(bytes, reply.status);
+            PutLittleEndian(bytes, reply.queued_ns);
+            PutLittleEndian(bytes, reply.run_ns);
+            if (!co_await WriteFully(loop_, fd, &bytes[0], bytes.size()) || bad) break;
+
+            if (shutdown) {
+                  Shutdown();
+                  break;
+            }
+      }
+
+      clients_.erase(fd);
+      close(fd);
+}
+
+// The client side: connects, sends one job, and waits for its reply. Returns
+// false (and prints out some messages) if the server can't be reached or
+// hangs up.
+bool SendJob(std::string const& socket_path, char mode, std::vector<std::string> const& args,
+             JobReply& reply) {
+      sockaddr_un address;
+      std::memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+            std::cerr << "Error: I can't connect to " << socket_path << "!" << std::endl;
+            if (fd >= 0) close(fd);
+            return false;
+      }
+
+      std::vector<char> request;
+      PutLittleEndian(request, JobServer::REQUEST_MAGIC);
+      PutLittleEndian(request, (unsigned)(unsigned char)mode);
+      PutLittleEndian(request, (unsigned)args.size());
+      for (unsigned i = 0; i != args.size(); ++i) {
+            PutLittleEndian(request, (unsigned)args[i].size());
+            request.insert(request.end(), args[i].begin(), args[i].end());
+      }
+
+      char bytes[24];
+      bool ok = send(fd, &request[0], request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+      size_t got = 0;
+      while (ok && got != sizeof(bytes)) {
+            ssize_t n = recv(fd, bytes + got, sizeof(bytes) - got, 0);
+            if (n <= 0) ok = false;
+            else got += n;
+      }
+      close(fd);
+
+      if (!ok || GetLittleEndian<unsigned>(bytes) != JobServer::REPLY_MAGIC) {
+            std::cerr << "Error: " << socket_path << " didn't answer!" << std::endl;
+            return false;
+      }
+
+      reply.status = GetLittleEndian<unsigned>(bytes + 4);
+      reply.queued_ns = GetLittleEndian<unsigned long long>(bytes + 8);
+      reply.run_ns = GetLittleEndian<unsigned long long>(bytes + 16);
+      return true;
+}
+
+#endif
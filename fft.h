@@ -0,0 +1,150 @@
+#ifndef FFT_H_
+#define FFT_H_
+
+/*** Fast Fourier Transform ***/
+// A small in-place radix-2 FFT over std::complex<double>, used by the
+// analysis code (e.g., the pitch tracker) to turn O(n^2) correlations into
+// O(n log n) ones. Sizes must be powers of two; use NextPow2() to pick one.
+//
+// Example usage:
+//      std::vector<std::complex<double> > bins(NextPow2(nsamples));
+//      for (unsigned i = 0; i != nsamples; ++i) bins[i] = samples[i];
+//      Fft(bins, false);
+//      // ... multiply, filter, etc. ...
+//      Fft(bins, true); // Inverse, scaled by 1/n.
+//
+// There's also a streaming short-time Fourier transform (Stft) that slides a
+// Hann window along the signal and hands each frame's magnitude spectrum to a
+// callback. Twiddle factors and windows come from the KernelCache (see
+// kernels.h), so they're only designed once per process.
+
+#include "kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+// Returns the smallest power of two that's >= n.
+static unsigned NextPow2(unsigned n) {
+      unsigned answer = 1;
+      while (answer < n) answer <<= 1;
+      return answer;
+}
+
+// Transforms "bins" in place. The inverse transform is scaled by 1/n, so a
+// forward transform followed by an inverse one gets back the original values.
+static void Fft(std::vector<std::complex<double> >& bins, bool inverse) {
+      unsigned n = bins.size();
+      if (n < 2) return;
+
+      // Bit-reversal permutation.
+      for (unsigned i = 1, j = 0; i != n; ++i) {
+            unsigned bit = n >> 1;
+            for (; j & bit; bit >>= 1) j ^= bit;
+            j ^= bit;
+            if (i < j) std::swap(bins[i], bins[j]);
+      }
+
+      // Twiddle factors for the largest butterfly stage. The smaller stages
+      // just stride through this table. Each thread remembers the last table
+      // it used, so back-to-back transforms of the same size don't even touch
+      // the cache's lock.
+      static thread_local KernelCache::Table table;
+      static thread_local unsigned table_n = 0;
+      static thread_local bool table_inverse = false;
+      if (!table || table_n != n || table_inverse != inverse) {
+            table = KernelCache::Instance().Twiddles(n, inverse);
+            table_n = n;
+            table_inverse = inverse;
+      }
+      std::complex<double> const* twiddles = (std::complex<double> const*)&(*table)[0];
+
+      for (unsigned len = 2; len <= n; len <<= 1) {
+            unsigned half = len / 2;
+            unsigned stride = n / len;
+            for (unsigned i = 0; i < n; i += len) {
+                  for (unsigned j = 0; j != half; ++j) {
+                        std::complex<double> u = bins[i + j];
+                        std::complex<double> v = bins[i + j + half] * twiddles[j * stride];
+                        bins[i + j] = u + v;
+                        bins[i + j + half] = u - v;
+                  }
+            }
+      }
+
+      if (inverse) {
+            double scale = 1.0 / n;
+            for (unsigned i = 0; i != n; ++i) bins[i] *= scale;
+      }
+}
+
+/*** Stft ***/
+// A streaming short-time Fourier transform. Push() samples in whatever sized
+// pieces are handy. Every "hop" samples, once a full frame is available, the
+// frame is windowed, transformed, and its magnitude spectrum (frame_length/2
+// bins, DC up to just below Nyquist) is passed to the visitor as
+//      visit(frame_index, magnitudes, nbins);
+// The magnitudes pointer is only valid for the duration of the call.
+class Stft {
+      public:
+            /*** Constructors ***/
+            // The frame length must be a power of two.
+            Stft(unsigned frame_length, unsigned hop);
+
+            /*** Public Methods ***/
+            template <class Visitor>
+            void Push(double const* samples, unsigned n, Visitor& visit);
+
+            unsigned frame_length(void) const { return window_->size(); }
+            unsigned hop(void) const { return hop_; }
+            unsigned nbins(void) const { return window_->size() / 2; }
+
+      private:
+            unsigned hop_;
+            unsigned nframes_;
+            KernelCache::Table window_;
+
+            std::vector<double> pending_;
+            unsigned pending_start_;
+
+            std::vector<std::complex<double> > bins_;
+            std::vector<double> magnitudes_;
+};
+
+Stft::Stft(unsigned frame_length, unsigned hop)
+      : hop_(hop ? hop : 1), nframes_(0),
+        window_(KernelCache::Instance().HannWindow(frame_length)), pending_start_(0),
+        bins_(frame_length), magnitudes_(frame_length / 2) { }
+
+template <class Visitor>
+void Stft::Push(double const* samples, unsigned n, Visitor& visit) {
+      pending_.insert(pending_.end(), samples, samples + n);
+
+      unsigned length = frame_length();
+      while (pending_start_ + length <= pending_.size()) {
+            double const* frame = &pending_[pending_start_];
+            double const* window = &(*window_)[0];
+            for (unsigned i = 0; i != length; ++i) {
+                  bins_[i] = std::complex<double>(frame[i] * window[i], 0);
+            }
+
+            Fft(bins_, false);
+
+            for (unsigned k = 0; k != magnitudes_.size(); ++k) {
+                  magnitudes_[k] = std::abs(bins_[k]);
+            }
+
+            visit(nframes_++, &magnitudes_[0], (unsigned)magnitudes_.size());
+            pending_start_ += hop_;
+      }
+
+      // Same trick as the pitch tracker: only compact once we've slid past a
+      // good chunk of the buffer.
+      if (pending_start_ >= pending_.size() / 2) {
+            unsigned consumed = std::min<size_t>(pending_start_, pending_.size());
+            pending_.erase(pending_.begin(), pending_.begin() + consumed);
+            pending_start_ -= consumed;
+      }
+}
+
+#endif
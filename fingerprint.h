@@ -0,0 +1,666 @@
+#ifndef FINGERPRINT_H_
+#define FINGERPRINT_H_
+
+/*** Acoustic Fingerprints ***/
+// Finds copies of the same audio even after it's been re-encoded or had its
+// level changed, which an exact hash of the data chunk can't do.
+//
+// A fingerprint is a list of "landmarks." We run the signal through the STFT
+// (see fft.h), keep the few strongest spectral peaks in each frame, and pair
+// each peak with a handful of the peaks that follow it. Each pair hashes its
+// two frequency bins and the time between them, which survives gain changes
+// (the peaks don't move) and most lossy re-encodes (the strong peaks survive).
+// Matching assumes both files have the same sample rate.
+//
+// A FingerprintIndex is an on-disk inverted index from landmark hash to the
+// (file, time) pairs where it occurs. A query clip is matched by looking up
+// each of its landmarks and voting for the (file, time offset) pairs they
+// line up with: a true copy piles up votes at one offset.
+//
+// Building an index takes bounded memory however big the archive is: the
+// postings are sorted in runs that fit in memory, written out next to the
+// index, then merged into it.
+//
+// Example usage:
+//      BuildFingerprintIndex(filenames, "archive.fpi");
+//
+//      FingerprintIndex index;
+//      index.Open("archive.fpi");
+//      Wave query;
+//      query.Load("clip.wav");
+//      std::vector<FingerprintMatch> matches = index.Lookup(Fingerprint(query));
+
+#include "fft.h"
+#include "threadpool.h"
+#include "wave.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A hashed pair of spectral peaks and the STFT frame of the first one.
+struct Landmark {
+      uint32_t hash;
+      uint32_t time;
+};
+
+// A file that matched a query. Frame 0 of the query lines up with frame
+// "offset" of the file, and "score" landmarks agree on that alignment.
+struct FingerprintMatch {
+      std::string filename;
+      unsigned score;
+      int offset;
+};
+
+/*** Fingerprinter ***/
+// Streams samples through the STFT and collects landmarks.
+class Fingerprinter {
+      public:
+            /*** Constructors ***/
+            Fingerprinter(void) : stft_(FRAME_LENGTH, HOP) { }
+
+            /*** Public Methods ***/
+            void Push(double const* samples, unsigned n) {
+                  stft_.Push(samples, n, *this);
+            }
+
+            // Pairs up the peaks seen so far into landmarks.
+            std::vector<Landmark> Finish(void) const;
+
+            // Called back by the Stft with each frame's magnitude spectrum.
+            void operator()(unsigned frame, double const* magnitudes, unsigned nbins);
+
+            /*** Constants ***/
+            static unsigned const FRAME_LENGTH = 1024;
+            static unsigned const HOP = 512;
+            // Peaks must be the loudest bin within this many bins either side.
+            static unsigned const PEAK_RADIUS = 3;
+            static unsigned const PEAKS_PER_FRAME = 5;
+            // Each peak gets paired with up to FAN_OUT later peaks, at most
+            // MAX_DT frames later.
+            static unsigned const FAN_OUT = 5;
+            static unsigned const MAX_DT = 63;
+            // Below this bin it's mostly DC and rumble.
+            static unsigned const MIN_BIN = 4;
+
+      private:
+            struct Peak {
+                  unsigned frame;
+                  unsigned bin;
+                  double magnitude;
+
+                  bool operator<(Peak const& other) const {
+                        return magnitude > other.magnitude;
+                  }
+            };
+
+            Stft stft_;
+            std::vector<Peak> peaks_;
+            std::vector<Peak> candidates_;
+};
+
+void Fingerprinter::operator()(unsigned frame, double const* magnitudes, unsigned nbins) {
+      // The threshold is relative to the frame's own level, so scaling the
+      // whole signal doesn't change which peaks we pick. The floor keeps us
+      // from fingerprinting dither in digital silence.
+      double total = 0;
+      for (unsigned k = 0; k != nbins; ++k) total += magnitudes[k];
+      double threshold = std::max(2.0 * total / nbins, 1e-6 * FRAME_LENGTH);
+
+      candidates_.clear();
+      for (unsigned k = std::max(MIN_BIN, PEAK_RADIUS); k + PEAK_RADIUS < nbins; ++k) {
+            double magnitude = magnitudes[k];
+            if (magnitude <= threshold) continue;
+
+            bool is_peak = true;
+            for (unsigned r = 1; r <= PEAK_RADIUS && is_peak; ++r) {
+                  is_peak = magnitude > magnitudes[k - r] && magnitude >= magnitudes[k + r];
+            }
+            if (is_peak) {
+                  Peak peak = { frame, k, magnitude };
+                  candidates_.push_back(peak);
+            }
+      }
+
+      unsigned keep = std::min<size_t>(PEAKS_PER_FRAME, candidates_.size());
+      std::partial_sort(candidates_.begin(), candidates_.begin() + keep, candidates_.end());
+      peaks_.insert(peaks_.end(), candidates_.begin(), candidates_.begin() + keep);
+}
+
+// Hash layout: 9 bits of anchor bin, 9 bits of target bin, 6 bits of frame
+// delta.
+std::vector<Landmark> Fingerprinter::Finish(void) const {
+      std::vector<Landmark> landmarks;
+
+      for (unsigned i = 0; i != peaks_.size(); ++i) {
+            unsigned fan_out = 0;
+            for (unsigned j = i + 1; j != peaks_.size() && fan_out != FAN_OUT; ++j) {
+                  unsigned dt = peaks_[j].frame - peaks_[i].frame;
+                  if (dt == 0) continue;
+                  if (dt > MAX_DT) break;
+
+                  Landmark landmark;
+                  landmark.hash = (peaks_[i].bin & 0x1ff) << 15
+                                | (peaks_[j].bin & 0x1ff) << 6
+                                | (dt & 0x3f);
+                  landmark.time = peaks_[i].frame;
+                  landmarks.push_back(landmark);
+                  ++fan_out;
+            }
+      }
+
+      return landmarks;
+}
+
+// Fingerprints a whole Wave file.
+std::vector<Landmark> Fingerprint(Wave const& wave) {
+      Fingerprinter fingerprinter;
+
+      unsigned const block_length = 4096;
+      std::vector<double> block(block_length);
+      unsigned nsamples = wave.nsamples();
+      for (unsigned offset = 0; offset < nsamples; offset += block_length) {
+            unsigned n = std::min(block_length, nsamples - offset);
+            wave.GetSamples(offset, n, &block[0]);
+            fingerprinter.Push(&block[0], n);
+      }
+
+      return fingerprinter.Finish();
+}
+
+/*** FingerprintIndex ***/
+// A read-only, memory-mapped inverted index built by BuildFingerprintIndex().
+// The file is written in the host's byte order. Layout:
+//      Header
+//      nfiles x { uint32 length, length bytes of filename }
+//      npostings x Posting, grouped by key   (8-byte aligned)
+//      nkeys x Key, sorted by hash
+// The postings come before the keys so they can be merged straight into the
+// file before we know how many keys there are.
+class FingerprintIndex {
+      public:
+            /*** Constructors ***/
+            FingerprintIndex(void)
+                  : map_(NULL), map_length_(0), keys_(NULL), nkeys_(0), postings_(NULL) { }
+
+            /*** Public Methods ***/
+            // Maps an index file into memory. Fails (and prints out some
+            // messages) if it doesn't exist or isn't an index, or if any of
+            // its tables run past the end of the file or point outside the
+            // others (as they would if it were truncated or corrupted).
+            bool Open(std::string const& filename);
+            void Close(void);
+
+            // The best matching files for the query, best first. Files with
+            // fewer than MIN_SCORE aligned landmarks don't count as matches.
+            std::vector<FingerprintMatch> Lookup(std::vector<Landmark> const& query,
+                                                 unsigned max_results = 10) const;
+
+            unsigned nfiles(void) const { return filenames_.size(); }
+
+            /*** Destructor ***/
+            ~FingerprintIndex(void) { Close(); }
+
+            /*** Structures ***/
+            struct Header {
+                  uint32_t magic;
+                  uint32_t version;
+                  uint32_t nfiles;
+                  uint32_t nkeys;
+                  unsigned long long npostings;
+                  unsigned long long keys_offset;
+                  unsigned long long postings_offset;
+            };
+
+            struct Key {
+                  uint32_t hash;
+                  uint32_t count;
+                  unsigned long long first;
+            };
+
+            struct Posting {
+                  uint32_t file;
+                  uint32_t time;
+            };
+
+            /*** Constants ***/
+            // "WFPI"
+            static uint32_t const MAGIC = 0x49504657;
+            static uint32_t const VERSION = 2;
+            static unsigned const MIN_SCORE = 5;
+
+            // How much memory BuildFingerprintIndex() sorts postings in, by
+            // default.
+            static unsigned long long const DEFAULT_BUILD_BYTES = 256ULL << 20;
+
+      private:
+            // Owns a mapping, so no copying.
+            FingerprintIndex(FingerprintIndex const&);
+            FingerprintIndex& operator=(FingerprintIndex const&);
+
+            void* map_;
+            size_t map_length_;
+            std::vector<std::string> filenames_;
+            Key const* keys_;
+            unsigned nkeys_;
+            Posting const* postings_;
+};
+
+bool FingerprintIndex::Open(std::string const& filename) {
+      Close();
+
+      int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+            std::cerr << "Error: I can't open " << filename << "!" << std::endl;
+            return false;
+      }
+
+      struct stat info;
+      if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+            std::cerr << "Error: " << filename << " doesn't appear to be a fingerprint index!"
+                      << std::endl;
+            close(fd);
+            return false;
+      }
+
+      map_length_ = info.st_size;
+      map_ = mmap(NULL, map_length_, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map_ == MAP_FAILED) {
+            std::cerr << "Error: I can't map " << filename << " into memory!" << std::endl;
+            map_ = NULL;
+            return false;
+      }
+
+      char const* base = (char const*)map_;
+      Header const* header = (Header const*)base;
+
+      // Every table has to fit in the file where the header says it is,
+      // checked without sums that could overflow.
+      unsigned long long const length = map_length_;
+      bool ok = header->magic == MAGIC && header->version == VERSION
+            && header->postings_offset >= sizeof(Header) && header->postings_offset <= length
+            && header->postings_offset % 8 == 0
+            && header->npostings <= (length - header->postings_offset) / sizeof(Posting)
+            && header->keys_offset == header->postings_offset + header->npostings * sizeof(Posting)
+            && header->nkeys <= (length - header->keys_offset) / sizeof(Key);
+
+      // The names fill the space between the header and the postings.
+      char const* name = base + sizeof(Header);
+      char const* names_end = base + (ok ? header->postings_offset : sizeof(Header));
+      for (unsigned i = 0; ok && i != header->nfiles; ++i) {
+            uint32_t name_length;
+            if ((size_t)(names_end - name) < sizeof(name_length)) {
+                  ok = false;
+                  break;
+            }
+            std::memcpy(&name_length, name, sizeof(name_length));
+            name += sizeof(name_length);
+            if ((size_t)(names_end - name) < name_length) {
+                  ok = false;
+                  break;
+            }
+            filenames_.push_back(std::string(name, name_length));
+            name += name_length;
+      }
+
+      // Each key's postings have to be in the postings table, and the keys
+      // have to be sorted for Lookup()'s binary search. (The postings
+      // themselves are checked as Lookup() reads them, rather than reading
+      // the whole file in here.)
+      Key const* keys = (Key const*)(base + (ok ? header->keys_offset : 0));
+      for (unsigned i = 0; ok && i != header->nkeys; ++i) {
+            ok = keys[i].first <= header->npostings && keys[i].count <= header->npostings - keys[i].first
+                  && (i == 0 || keys[i - 1].hash < keys[i].hash);
+      }
+
+      if (!ok) {
+            std::cerr << "Error: " << filename << " doesn't appear to be a fingerprint index"
+                      << " (or it's damaged)!" << std::endl;
+            Close();
+            return false;
+      }
+
+      keys_ = keys;
+      nkeys_ = header->nkeys;
+      postings_ = (Posting const*)(base + header->postings_offset);
+
+      // We'll be binary searching the keys and then jumping around the
+      // postings.
+      madvise(map_, map_length_, MADV_RANDOM);
+
+      return true;
+}
+
+void FingerprintIndex::Close(void) {
+      if (map_) munmap(map_, map_length_);
+      map_ = NULL;
+      map_length_ = 0;
+      filenames_.clear();
+      keys_ = NULL;
+      nkeys_ = 0;
+      postings_ = NULL;
+}
+
+std::vector<FingerprintMatch> FingerprintIndex::Lookup(std::vector<Landmark> const& query,
+                                                       unsigned max_results) const {
+      // Votes keyed on (file, file time - query time).
+      std::unordered_map<unsigned long long, unsigned> votes;
+
+      for (unsigned i = 0; i != query.size(); ++i) {
+            Key const* end = keys_ + nkeys_;
+            Key const* key = std::lower_bound(keys_, end, query[i].hash,
+                  [](Key const& k, uint32_t hash) { return k.hash < hash; });
+            if (key == end || key->hash != query[i].hash) continue;
+
+            Posting const* posting = postings_ + key->first;
+            for (unsigned j = 0; j != key->count; ++j, ++posting) {
+                  if (posting->file >= filenames_.size()) continue;  // Damaged.
+                  uint32_t offset = posting->time - query[i].time;
+                  ++votes[(unsigned long long)posting->file << 32 | offset];
+            }
+      }
+
+      // The best offset for each file.
+      std::unordered_map<uint32_t, FingerprintMatch> best;
+      for (std::unordered_map<unsigned long long, unsigned>::const_iterator it = votes.begin();
+                  it != votes.end(); ++it) {
+            uint32_t file = it->first >> 32;
+            FingerprintMatch& match = best[file];
+            if (it->second > match.score || match.filename.empty()) {
+                  match.filename = filenames_[file];
+                  match.score = it->second;
+                  match.offset = (int)(uint32_t)it->first;
+            }
+      }
+
+      std::vector<FingerprintMatch> matches;
+      for (std::unordered_map<uint32_t, FingerprintMatch>::const_iterator it = best.begin();
+                  it != best.end(); ++it) {
+            if (it->second.score >= MIN_SCORE) matches.push_back(it->second);
+      }
+
+      std::sort(matches.begin(), matches.end(),
+            [](FingerprintMatch const& a, FingerprintMatch const& b) { return a.score > b.score; });
+      if (matches.size() > max_results) matches.resize(max_results);
+
+      return matches;
+}
+
+/*** Building an Index ***/
+// A posting along with its hash, as it's sorted while an index is built.
+struct FingerprintRunEntry {
+      uint32_t hash;
+      uint32_t file;
+      uint32_t time;
+
+      bool operator<(FingerprintRunEntry const& other) const {
+            if (hash != other.hash) return hash < other.hash;
+            if (file != other.file) return file < other.file;
+            return time < other.time;
+      }
+};
+
+// Reads a sorted run back from its file, a buffer at a time.
+class FingerprintRunReader {
+      public:
+            /*** Constructors ***/
+            FingerprintRunReader(std::string const& filename, unsigned buffer_entries)
+                  : file_(filename.c_str(), std::ios_base::binary | std::ios_base::in),
+                    buffer_(std::max(1u, buffer_entries)), position_(0), nbuffered_(0) { }
+
+            /*** Public Methods ***/
+            // Gets the next entry. Returns false at the end of the run.
+            bool Next(FingerprintRunEntry& entry) {
+                  if (position_ == nbuffered_) {
+                        file_.read((char*)&buffer_[0], buffer_.size() * sizeof(FingerprintRunEntry));
+                        nbuffered_ = file_.gcount() / sizeof(FingerprintRunEntry);
+                        position_ = 0;
+                        if (!nbuffered_) return false;
+                  }
+                  entry = buffer_[position_++];
+                  return true;
+            }
+
+            // False if the file couldn't be opened or read (rather than just
+            // ending).
+            bool ok(void) const { return file_.is_open() && !file_.bad(); }
+
+      private:
+            FingerprintRunReader(FingerprintRunReader const&);
+            FingerprintRunReader& operator=(FingerprintRunReader const&);
+
+            std::ifstream file_;
+            std::vector<FingerprintRunEntry> buffer_;
+            unsigned position_;
+            unsigned nbuffered_;
+};
+
+// Merges sorted runs, handing every entry to "output" (which returns false to
+// give up) in order. The runs share "max_bytes" of read buffers.
+template <class Output>
+bool MergeFingerprintRuns(std::vector<std::string> const& runs, unsigned long long max_bytes, Output& output) {
+      unsigned buffer_entries = std::max(1024ULL, max_bytes / sizeof(FingerprintRunEntry) / std::max<size_t>(1, runs.size()));
+
+      typedef std::pair<FingerprintRunEntry, unsigned> Head;
+      auto later = [](Head const& a, Head const& b) { return b.first < a.first; };
+      std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+
+      std::vector<std::unique_ptr<FingerprintRunReader> > readers;
+      for (unsigned i = 0; i != runs.size(); ++i) {
+            readers.emplace_back(new FingerprintRunReader(runs[i], buffer_entries));
+            Head head;
+            head.second = i;
+            if (readers[i]->Next(head.first)) heads.push(head);
+      }
+
+      while (!heads.empty()) {
+            Head head = heads.top();
+            heads.pop();
+            if (!output(head.first)) return false;
+            if (readers[head.second]->Next(head.first)) heads.push(head);
+      }
+
+      for (unsigned i = 0; i != readers.size(); ++i) {
+            if (!readers[i]->ok()) return false;
+      }
+      return true;
+}
+
+// Fingerprints every file (in parallel, on "pool") and writes an index of them
+// all to "index_filename". Files that fail to load are indexed with no
+// landmarks. The postings are sorted in runs of up to "max_bytes" and merged
+// from temporary files next to the index, so memory doesn't grow with the
+// archive. Returns false (and prints out some messages) if the index can't
+// be written.
+bool BuildFingerprintIndex(std::vector<std::string> const& filenames,
+                           std::string const& index_filename,
+                           ThreadPool& pool = ThreadPool::Shared(),
+                           unsigned long long max_bytes = FingerprintIndex::DEFAULT_BUILD_BYTES) {
+      typedef FingerprintIndex::Header Header;
+      typedef FingerprintIndex::Key Key;
+      typedef FingerprintIndex::Posting Posting;
+
+      // Merging more runs than this at once would spread the read buffers
+      // too thin (and use a lot of descriptors), so bigger builds merge in
+      // more than one pass.
+      unsigned const max_fan_in = 64;
+
+      // The runs, and the keys while they wait to go after the postings.
+      struct Temporaries {
+            std::vector<std::string> names;
+            ~Temporaries(void) {
+                  for (unsigned i = 0; i != names.size(); ++i) std::remove(names[i].c_str());
+            }
+      } temporaries;
+      unsigned nruns = 0;
+      auto new_run = [&]() {
+            temporaries.names.push_back(index_filename + ".run" + std::to_string(nruns++));
+            return temporaries.names.back();
+      };
+
+      // Fingerprint a few files per thread at a time (one per task: they
+      // vary too much in length to batch up), and write out a sorted run
+      // whenever the postings fill the buffer.
+      max_bytes = std::max<unsigned long long>(max_bytes, 1 << 20);
+      unsigned long long const run_entries = max_bytes / sizeof(FingerprintRunEntry);
+      std::vector<FingerprintRunEntry> buffer;
+      std::vector<std::string> runs;
+      auto write_run = [&]() {
+            std::sort(buffer.begin(), buffer.end());
+            std::string name = new_run();
+            std::ofstream run(name.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+            run.write((char const*)buffer.data(), buffer.size() * sizeof(FingerprintRunEntry));
+            run.close();
+            buffer.clear();
+            runs.push_back(name);
+            return !run.fail();
+      };
+
+      unsigned const window = std::max(1u, 2 * pool.size());
+      for (unsigned first = 0; first < filenames.size(); first += window) {
+            unsigned n = std::min<size_t>(window, filenames.size() - first);
+            std::vector<std::vector<Landmark> > landmarks(n);
+            TaskGroup group(pool);
+            for (unsigned i = 0; i != n; ++i) {
+                  group.Run([&, i]() {
+                        Wave wave;
+                        wave.Load(filenames[first + i]);
+                        landmarks[i] = Fingerprint(wave);
+                  });
+            }
+            group.Wait();
+
+            for (unsigned i = 0; i != n; ++i) {
+                  for (unsigned j = 0; j != landmarks[i].size(); ++j) {
+                        FingerprintRunEntry entry = { landmarks[i][j].hash, first + i, landmarks[i][j].time };
+                        buffer.push_back(entry);
+                        if (buffer.size() == run_entries && !write_run()) {
+                              std::cerr << "Error: I can't write a temporary file next to "
+                                        << index_filename << "!" << std::endl;
+                              return false;
+                        }
+                  }
+                  std::vector<Landmark>().swap(landmarks[i]);
+            }
+      }
+      if (!buffer.empty() && !write_run()) {
+            std::cerr << "Error: I can't write a temporary file next to " << index_filename << "!" << std::endl;
+            return false;
+      }
+      std::vector<FingerprintRunEntry>().swap(buffer);
+
+      while (runs.size() > max_fan_in) {
+            std::vector<std::string> merged;
+            for (unsigned i = 0; i < runs.size(); i += max_fan_in) {
+                  std::vector<std::string> group(runs.begin() + i, runs.begin() + std::min<size_t>(runs.size(), i + max_fan_in));
+                  std::string name = new_run();
+                  std::ofstream run(name.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+                  auto append = [&run](FingerprintRunEntry const& entry) {
+                        return run.write((char const*)&entry, sizeof(entry)).good();
+                  };
+                  bool ok = MergeFingerprintRuns(group, max_bytes, append);
+                  run.close();
+                  if (!ok || run.fail()) {
+                        std::cerr << "Error: I can't merge the temporary files next to " << index_filename
+                                  << "!" << std::endl;
+                        return false;
+                  }
+                  for (unsigned j = 0; j != group.size(); ++j) std::remove(group[j].c_str());
+                  merged.push_back(name);
+            }
+            runs.swap(merged);
+      }
+
+      std::ofstream file(index_filename.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+      if (!file.good()) {
+            std::cerr << "Error: I can't open " << index_filename << " for writing!"
+                      << std::endl;
+            return false;
+      }
+
+      unsigned long long names_length = 0;
+      for (unsigned i = 0; i != filenames.size(); ++i) {
+            names_length += sizeof(uint32_t) + filenames[i].size();
+      }
+
+      // The counts and offsets get filled in once the postings are written.
+      Header header = Header();
+      header.magic = FingerprintIndex::MAGIC;
+      header.version = FingerprintIndex::VERSION;
+      header.nfiles = filenames.size();
+      header.postings_offset = (sizeof(Header) + names_length + 7) & ~(unsigned long long)7;
+      file.write((char const*)&header, sizeof(header));
+
+      for (unsigned i = 0; i != filenames.size(); ++i) {
+            uint32_t length = filenames[i].size();
+            file.write((char const*)&length, sizeof(length));
+            file.write(filenames[i].data(), length);
+      }
+
+      char const padding[8] = { 0 };
+      file.write(padding, header.postings_offset - sizeof(Header) - names_length);
+
+      // The final merge writes the postings straight into the index, and
+      // each hash's key (once all its postings are in) to a file of its own.
+      std::string keys_name = new_run();
+      std::ofstream keys(keys_name.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+      Key key = { 0, 0, 0 };
+      unsigned long long npostings = 0;
+      uint32_t nkeys = 0;
+      auto finish_key = [&]() {
+            if (key.count) {
+                  keys.write((char const*)&key, sizeof(key));
+                  ++nkeys;
+            }
+      };
+      auto add_posting = [&](FingerprintRunEntry const& entry) {
+            if (!key.count || entry.hash != key.hash || key.count == UINT32_MAX) {
+                  // (A hash with more postings than a count can hold only
+                  // keeps the first ones.)
+                  if (key.count && entry.hash == key.hash) return true;
+                  finish_key();
+                  key.hash = entry.hash;
+                  key.count = 0;
+                  key.first = npostings;
+            }
+            Posting posting = { entry.file, entry.time };
+            ++key.count;
+            ++npostings;
+            return file.write((char const*)&posting, sizeof(posting)).good();
+      };
+      bool ok = MergeFingerprintRuns(runs, max_bytes, add_posting);
+      finish_key();
+      keys.close();
+      for (unsigned i = 0; i != runs.size(); ++i) std::remove(runs[i].c_str());
+
+      if (ok && !keys.fail() && nkeys) {
+            std::ifstream keys_in(keys_name.c_str(), std::ios_base::binary | std::ios_base::in);
+            file << keys_in.rdbuf();
+      }
+
+      header.nkeys = nkeys;
+      header.npostings = npostings;
+      header.keys_offset = header.postings_offset + npostings * sizeof(Posting);
+      file.seekp(0);
+      file.write((char const*)&header, sizeof(header));
+
+      file.close();
+      if (!ok || keys.fail() || file.fail()) {
+            std::cerr << "Error: I can't write " << index_filename << "!" << std::endl;
+            std::remove(index_filename.c_str());
+            return false;
+      }
+      return true;
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef GENERATORS_H_
+#define GENERATORS_H_
+
+/*** Signal Generators ***/
+// BlockSources that synthesize test and calibration signals: pure and
+// multi-tones, linear and exponential sine sweeps, and white and pink noise.
+// They're meant to be pumped straight into a WaveWriter (see stream.h), so
+// they never hold more than a block of samples in memory.
+//
+// All of the inner loops are written to vectorize: the oscillators use a
+// polynomial sine on phases kept in turns (cycles) rather than calling sin(),
+// and the noise generator runs several independent xorshift streams side by
+// side. The output only depends on the parameters (and the seed), not on how
+// big the blocks you Read() are.
+//
+// Example usage:
+//      FmtChunk fmt;
+//      fmt.sample_rate = 48000;
+//      SineSweep sweep(fmt.sample_rate, 20.0, 20000.0, 60 * fmt.sample_rate);
+//      WaveWriter writer;
+//      writer.Open("sweep.wav", fmt);
+//      Pump(sweep, writer);
+//      writer.Close();
+
+#include "stream.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// sin(2 pi x) for |x| < 2^51. Adding and subtracting 1.5 * 2^52 rounds to the
+// nearest integer without a call to round() (which wouldn't vectorize), which
+// leaves r in [-0.5, 0.5]. Folding about +-0.25 gets us to [-pi/2, pi/2],
+// where a degree-13 Taylor polynomial is good to about 1e-9.
+static inline double SinTurns(double x) {
+      double const magic = 6755399441055744.0;
+      double r = x - ((x + magic) - magic);
+      double a = std::fabs(r);
+      double folded = a > 0.25 ? 0.5 - a : a;
+
+      double t = 2.0 * M_PI * folded;
+      double t2 = t * t;
+      double p = 1.0 / 6227020800.0;
+      p = p * t2 - 1.0 / 39916800.0;
+      p = p * t2 + 1.0 / 362880.0;
+      p = p * t2 - 1.0 / 5040.0;
+      p = p * t2 + 1.0 / 120.0;
+      p = p * t2 - 1.0 / 6.0;
+      p = p * t2 + 1.0;
+      p *= t;
+
+      return r < 0 ? -p : p;
+}
+
+/*** Generator ***/
+// Common plumbing: generators produce fixed-size blocks into a buffer, which
+// Read() hands out in whatever sized pieces are asked for.
+class Generator : public BlockSource {
+      public:
+            /*** Constructors ***/
+            // "nframes" is the length of the whole signal.
+            Generator(unsigned long long nframes)
+                  : remaining_(nframes), buffer_(BLOCK_FRAMES), buffered_(0), position_(0) { }
+
+            /*** Public Methods ***/
+            virtual unsigned Read(double* out, unsigned nframes);
+
+            /*** Constants ***/
+            // Must be a multiple of the noise generator's lane count.
+            static unsigned const BLOCK_FRAMES = 1024;
+
+      protected:
+            // Fills "out" with the next BLOCK_FRAMES samples.
+            virtual void Generate(double* out) = 0;
+
+      private:
+            unsigned long long remaining_;
+            std::vector<double> buffer_;
+            unsigned buffered_;
+            unsigned position_;
+};
+
+unsigned Generator::Read(double* out, unsigned nframes) {
+      unsigned total = 0;
+
+      while (total != nframes && remaining_) {
+            if (position_ == buffered_) {
+                  Generate(&buffer_[0]);
+                  buffered_ = BLOCK_FRAMES;
+                  position_ = 0;
+            }
+
+            unsigned n = std::min<unsigned long long>(std::min(nframes - total, buffered_ - position_),
+                                                      remaining_);
+            std::memcpy(out + total, &buffer_[position_], n * sizeof(double));
+            position_ += n;
+            total += n;
+            remaining_ -= n;
+      }
+
+      return total;
+}
+
+/*** Multitone ***/
+// A sum of equal-amplitude sine tones. The peak is at most "amplitude".
+class Multitone : public Generator {
+      public:
+            /*** Constructors ***/
+            Multitone(unsigned sample_rate, std::vector<double> const& frequencies,
+                      unsigned long long nframes, double amplitude = DEFAULT_AMPLITUDE);
+
+            /*** Constants ***/
+            static constexpr double DEFAULT_AMPLITUDE = 0.5;
+
+      protected:
+            virtual void Generate(double* out);
+
+      private:
+            // Per tone: the phase at the start of the next block (in turns,
+            // kept in [0, 1) so it never loses precision) and turns per sample.
+            std::vector<double> phases_;
+            std::vector<double> increments_;
+            double gain_;
+};
+
+Multitone::Multitone(unsigned sample_rate, std::vector<double> const& frequencies,
+                     unsigned long long nframes, double amplitude)
+      : Generator(nframes), phases_(frequencies.size(), 0.0),
+        gain_(frequencies.empty() ? 0 : amplitude / frequencies.size()) {
+      for (unsigned i = 0; i != frequencies.size(); ++i) {
+            increments_.push_back(frequencies[i] / sample_rate);
+      }
+}
+
+void Multitone::Generate(double* out) {
+      std::fill(out, out + BLOCK_FRAMES, 0.0);
+
+      for (unsigned t = 0; t != phases_.size(); ++t) {
+            double phase = phases_[t];
+            double increment = increments_[t];
+            for (unsigned i = 0; i != BLOCK_FRAMES; ++i) {
+                  out[i] += gain_ * SinTurns(phase + increment * i);
+            }
+
+            phase += increment * BLOCK_FRAMES;
+            phases_[t] = phase - std::floor(phase);
+      }
+}
+
+/*** SineSweep ***/
+// A sine sweep from "start" to "end" Hz over "nframes" samples. Exponential
+// (logarithmic) sweeps spend equal time per octave, which is what you want
+// for measuring impulse responses; linear sweeps spend equal time per Hz.
+class SineSweep : public Generator {
+      public:
+            /*** Constructors ***/
+            SineSweep(unsigned sample_rate, double start, double end,
+                      unsigned long long nframes, bool exponential = true,
+                      double amplitude = DEFAULT_AMPLITUDE);
+
+            /*** Constants ***/
+            static constexpr double DEFAULT_AMPLITUDE = 0.5;
+
+      protected:
+            virtual void Generate(double* out);
+
+      private:
+            double amplitude_;
+            bool exponential_;
+
+            // The phase (turns, in [0, 1)) and the instantaneous frequency
+            // (turns per sample) at the start of the next block.
+            double phase_;
+            double increment_;
+
+            // Linear sweeps: the increment grows by "chirp_" every sample.
+            // Exponential sweeps: it grows by a factor of e^rate_ every
+            // sample, so within a block the phase advances by
+            // increment * expm1(rate * i) / rate, which we tabulate once.
+            double chirp_;
+            double rate_;
+            std::vector<double> growth_;
+};
+
+SineSweep::SineSweep(unsigned sample_rate, double start, double end,
+                     unsigned long long nframes, bool exponential, double amplitude)
+      : Generator(nframes), amplitude_(amplitude), exponential_(exponential && start > 0 && end > 0),
+        phase_(0), increment_(start / sample_rate), chirp_(0), rate_(0) {
+      double length = std::max(1ULL, nframes);
+
+      if (exponential_) {
+            rate_ = std::log(end / start) / length;
+            growth_.resize(BLOCK_FRAMES + 1);
+            for (unsigned i = 0; i <= BLOCK_FRAMES; ++i) {
+                  growth_[i] = rate_ != 0 ? std::expm1(rate_ * i) / rate_ : i;
+            }
+      } else {
+            chirp_ = (end - start) / sample_rate / length;
+      }
+}
+
+void SineSweep::Generate(double* out) {
+      double phase = phase_;
+      double increment = increment_;
+
+      if (exponential_) {
+            double const* growth = &growth_[0];
+            for (unsigned i = 0; i != BLOCK_FRAMES; ++i) {
+                  out[i] = amplitude_ * SinTurns(phase + increment * growth[i]);
+            }
+            phase += increment * growth_[BLOCK_FRAMES];
+            increment_ = increment * std::exp(rate_ * BLOCK_FRAMES);
+      } else {
+            double half_chirp = 0.5 * chirp_;
+            for (unsigned i = 0; i != BLOCK_FRAMES; ++i) {
+                  double k = i;
+                  out[i] = amplitude_ * SinTurns(phase + k * (increment + half_chirp * k));
+            }
+            double k = BLOCK_FRAMES;
+            phase += k * (increment + half_chirp * k);
+            increment_ = increment + chirp_ * k;
+      }
+
+      phase_ = phase - std::floor(phase);
+}
+
+/*** WhiteNoise ***/
+// Uniform white noise in [-amplitude, +amplitude), from LANES interleaved
+// xorshift64 generators. Same seed, same noise.
+class WhiteNoise : public Generator {
+      public:
+            /*** Constructors ***/
+            WhiteNoise(unsigned long long nframes, unsigned long long seed = 1,
+                       double amplitude = DEFAULT_AMPLITUDE);
+
+            /*** Public Methods ***/
+            // Fills "out" directly, bypassing Read() and the frame count.
+            // PinkNoise uses this to get its white noise.
+            void Fill(double* out, unsigned nframes);
+
+            /*** Constants ***/
+            static unsigned const LANES = 8;
+            static constexpr double DEFAULT_AMPLITUDE = 0.5;
+
+      protected:
+            virtual void Generate(double* out) { Fill(out, BLOCK_FRAMES); }
+
+      private:
+            unsigned long long state_[LANES];
+            double amplitude_;
+};
+
+WhiteNoise::WhiteNoise(unsigned long long nframes, unsigned long long seed, double amplitude)
+      : Generator(nframes), amplitude_(amplitude) {
+      // Seed the lanes with splitmix64 so nearby seeds give unrelated
+      // streams (and no lane is ever all zeros).
+      for (unsigned l = 0; l != LANES; ++l) {
+            unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            state_[l] = (z ^ (z >> 31)) | 1;
+      }
+}
+
+// "nframes" must be a multiple of LANES. The top 52 bits of each random
+// number become the mantissa of a double in [1, 2), which avoids an
+// integer-to-double conversion (there isn't a vector one for 64-bit ints).
+void WhiteNoise::Fill(double* out, unsigned nframes) {
+      unsigned long long state[LANES];
+      std::memcpy(state, state_, sizeof(state));
+
+      for (unsigned i = 0; i != nframes; i += LANES) {
+            for (unsigned l = 0; l != LANES; ++l) {
+                  unsigned long long x = state[l];
+                  x ^= x << 13;
+                  x ^= x >> 7;
+                  x ^= x << 17;
+                  state[l] = x;
+
+                  unsigned long long bits = (x >> 12) | 0x3ff0000000000000ULL;
+                  double unit;
+                  std::memcpy(&unit, &bits, sizeof(unit));
+                  out[i + l] = (unit - 1.5) * 2.0 * amplitude_;
+            }
+      }
+
+      std::memcpy(state_, state, sizeof(state));
+}
+
+/*** PinkNoise ***/
+// Pink (1/f) noise: white noise through Paul Kellet's bank of one-pole
+// filters, which is flat to within about 0.05 dB of -3 dB/octave above
+// 9 Hz at 44.1 kHz. The filters are independent, so we run them side by side.
+class PinkNoise : public Generator {
+      public:
+            /*** Constructors ***/
+            PinkNoise(unsigned long long nframes, unsigned long long seed = 1,
+                      double amplitude = DEFAULT_AMPLITUDE);
+
+            /*** Constants ***/
+            static unsigned const NPOLES = 6;
+            static constexpr double DEFAULT_AMPLITUDE = 0.5;
+
+      protected:
+            virtual void Generate(double* out);
+
+      private:
+            WhiteNoise white_;
+            double state_[NPOLES];
+            double previous_;
+};
+
+PinkNoise::PinkNoise(unsigned long long nframes, unsigned long long seed, double amplitude)
+      // Kellet's filter has a gain of about 9 on uniform noise, so scale the
+      // white noise down to keep the peak near "amplitude".
+      : Generator(nframes), white_(0, seed, amplitude / 9.0), previous_(0) {
+      std::fill(state_, state_ + NPOLES, 0.0);
+}
+
+void PinkNoise::Generate(double* out) {
+      static double const poles[NPOLES] = { 0.99886, 0.99332, 0.96900, 0.86650, 0.55000, -0.7616 };
+      static double const gains[NPOLES] = { 0.0555179, 0.0750759, 0.1538520, 0.3104856, 0.5329522, -0.0168980 };
+
+      white_.Fill(out, BLOCK_FRAMES);
+
+      double state[NPOLES];
+      std::memcpy(state, state_, sizeof(state));
+      double previous = previous_;
+
+      for (unsigned i = 0; i != BLOCK_FRAMES; ++i) {
+            double white = out[i];
+            double total = white * 0.5362 + previous;
+            for (unsigned p = 0; p != NPOLES; ++p) {
+                  state[p] = poles[p] * state[p] + white * gains[p];
+                  total += state[p];
+            }
+            previous = white * 0.115926;
+            out[i] = total;
+      }
+
+      std::memcpy(state_, state, sizeof(state));
+      previous_ = previous;
+}
+
+#endif
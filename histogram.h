@@ -0,0 +1,178 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+/*** Latency Histogram ***/
+// Counts latencies (in nanoseconds) so that any percentile can be read back
+// to a fixed number of significant digits, however long the tail is. It's the
+// HDR histogram layout: values are split into power-of-two ranges, and each
+// range into the same number of linear steps, fine enough for the precision
+// asked for. So 3 digits means every value is counted within 0.1% of
+// itself, whether it's 20 microseconds or 20 seconds.
+//
+// All the memory is allocated up front (about 200 KB for 3 digits up to a
+// minute), and Record() is just an index calculation and an increment, so
+// it's safe to call from a real-time thread (see realtime.h). A histogram
+// isn't safe to record into from two threads at once; give each thread its
+// own and Add() them together afterwards.
+//
+// Example usage:
+//      LatencyHistogram histogram;
+//      for (...) histogram.Record(nanoseconds);
+//      std::cout << histogram.Percentile(99.9) << " ns" << std::endl;
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class LatencyHistogram {
+      public:
+            /*** Constructors ***/
+            // Values from 1 ns up to "highest" are counted to "digits"
+            // significant digits (1 to 5); longer ones are counted as
+            // "highest," but max() still has them right.
+            explicit LatencyHistogram(unsigned long long highest = DEFAULT_HIGHEST,
+                                      unsigned digits = DEFAULT_DIGITS);
+
+            /*** Public Methods ***/
+            void Record(unsigned long long nanoseconds) {
+                  ++counts_[Index(std::min(nanoseconds, highest_))];
+                  ++count_;
+                  sum_ += nanoseconds;
+                  min_ = std::min(min_, nanoseconds);
+                  max_ = std::max(max_, nanoseconds);
+            }
+
+            // Adds another histogram's counts to this one's.
+            void Add(LatencyHistogram const& other);
+
+            void Clear(void);
+
+            // The value that "percent" percent of the values are at or
+            // below (to the histogram's precision, rounded up), e.g. 50 for
+            // the median. Zero if nothing's been recorded.
+            unsigned long long Percentile(double percent) const;
+
+            unsigned long long count(void) const { return count_; }
+            unsigned long long min(void) const { return count_ ? min_ : 0; }
+            unsigned long long max(void) const { return max_; }
+            double mean(void) const { return count_ ? (double)sum_ / count_ : 0; }
+
+            // How many values were over "nanoseconds" (to the histogram's
+            // precision).
+            unsigned long long CountAbove(unsigned long long nanoseconds) const;
+
+            // Writes "<prefix>_count", then the 50th, 99th and 99.9th
+            // percentiles and the max, in seconds, one "<name> <value>" line
+            // each (like StatsSnapshot::WriteTo() in stats.h).
+            void WriteTo(std::ostream& stream, std::string const& prefix) const;
+
+            /*** Constants ***/
+            static unsigned long long const DEFAULT_HIGHEST = 60000000000ULL;
+            static unsigned const DEFAULT_DIGITS = 3;
+
+      private:
+            unsigned Index(unsigned long long value) const {
+                  unsigned bucket = 64 - __builtin_clzll(value | sub_bucket_mask_) - (half_magnitude_ + 1);
+                  unsigned sub_bucket = value >> bucket;
+                  return ((bucket + 1) << half_magnitude_) + sub_bucket - (1u << half_magnitude_);
+            }
+
+            // The biggest value that lands at "index".
+            unsigned long long HighestAt(unsigned index) const;
+
+            unsigned long long highest_;
+            unsigned half_magnitude_;
+            unsigned long long sub_bucket_mask_;
+            std::vector<unsigned long long> counts_;
+            unsigned long long count_;
+            unsigned long long sum_;
+            unsigned long long min_;
+            unsigned long long max_;
+};
+
+LatencyHistogram::LatencyHistogram(unsigned long long highest, unsigned digits)
+      : highest_(std::max(2ULL, highest)), count_(0), sum_(0), min_(~0ULL), max_(0) {
+      digits = std::max(1u, std::min(5u, digits));
+
+      // Enough linear steps in each range to tell apart values "digits"
+      // digits long, at the top of the range (where it's hardest).
+      unsigned long long resolution = 2 * (unsigned long long)std::pow(10.0, (double)digits);
+      unsigned sub_bucket_magnitude = (unsigned)std::ceil(std::log2((double)resolution));
+      half_magnitude_ = sub_bucket_magnitude - 1;
+      unsigned long long sub_bucket_count = 1ULL << sub_bucket_magnitude;
+      sub_bucket_mask_ = sub_bucket_count - 1;
+
+      // How many power-of-two ranges it takes to reach "highest."
+      unsigned nbuckets = 1;
+      for (unsigned long long reach = sub_bucket_count; reach <= highest_; reach <<= 1) {
+            ++nbuckets;
+            if (reach > (~0ULL >> 1)) break;
+      }
+      counts_.assign((nbuckets + 1) << half_magnitude_, 0);
+}
+
+void LatencyHistogram::Add(LatencyHistogram const& other) {
+      if (other.counts_.size() == counts_.size() && other.half_magnitude_ == half_magnitude_) {
+            for (unsigned i = 0; i != counts_.size(); ++i) counts_[i] += other.counts_[i];
+      } else {
+            for (unsigned i = 0; i != other.counts_.size(); ++i) {
+                  if (other.counts_[i]) counts_[Index(std::min(other.HighestAt(i), highest_))] += other.counts_[i];
+            }
+      }
+      count_ += other.count_;
+      sum_ += other.sum_;
+      min_ = std::min(min_, other.min_);
+      max_ = std::max(max_, other.max_);
+}
+
+void LatencyHistogram::Clear(void) {
+      std::fill(counts_.begin(), counts_.end(), 0);
+      count_ = sum_ = max_ = 0;
+      min_ = ~0ULL;
+}
+
+unsigned long long LatencyHistogram::HighestAt(unsigned index) const {
+      unsigned half_count = 1u << half_magnitude_;
+      unsigned bucket = index >> half_magnitude_;
+      unsigned long long sub_bucket = (index & (half_count - 1)) + half_count;
+      if (bucket == 0) {
+            // The first range starts at zero, with steps of one.
+            sub_bucket -= half_count;
+      } else {
+            --bucket;
+      }
+      return ((sub_bucket + 1) << bucket) - 1;
+}
+
+unsigned long long LatencyHistogram::Percentile(double percent) const {
+      if (!count_) return 0;
+
+      double fraction = std::max(0.0, std::min(100.0, percent)) / 100;
+      unsigned long long target = std::max(1ULL, (unsigned long long)std::ceil(fraction * count_));
+      unsigned long long seen = 0;
+      for (unsigned i = 0; i != counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= target) return std::min(HighestAt(i), max_);
+      }
+      return max_;
+}
+
+unsigned long long LatencyHistogram::CountAbove(unsigned long long nanoseconds) const {
+      if (nanoseconds >= max_) return 0;
+
+      unsigned long long above = 0;
+      for (unsigned i = Index(std::min(nanoseconds, highest_)) + 1; i < counts_.size(); ++i) above += counts_[i];
+      return above;
+}
+
+void LatencyHistogram::WriteTo(std::ostream& stream, std::string const& prefix) const {
+      stream << prefix << "_count " << count_ << std::endl
+             << prefix << "_p50_seconds " << Percentile(50) / 1e9 << std::endl
+             << prefix << "_p99_seconds " << Percentile(99) / 1e9 << std::endl
+             << prefix << "_p99.9_seconds " << Percentile(99.9) / 1e9 << std::endl
+             << prefix << "_max_seconds " << max_ / 1e9 << std::endl;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+/*** Kernel Cache ***/
+// Window functions, filter kernels and FFT twiddle factors only depend on a
+// few parameters, but designing them isn't free (lots of sin() and cos()).
+// When we process thousands of short files, rebuilding identical tables for
+// each one can cost more than the processing itself. The KernelCache designs
+// each table once per process and hands out shared, read-only copies. It's
+// safe to use from any number of threads.
+//
+// The cache can also be saved to and loaded from disk, so a batch run can
+// start warm.
+//
+// Example usage:
+//      std::shared_ptr<std::vector<double> const> window
+//            = KernelCache::Instance().HannWindow(1024);
+//      for (unsigned i = 0; i != 1024; ++i) frame[i] *= (*window)[i];
+
+#include "stats.h"
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class KernelCache {
+      public:
+            typedef std::shared_ptr<std::vector<double> const> Table;
+
+            /*** Public Methods ***/
+            // The one cache shared by the whole process.
+            static KernelCache& Instance(void) {
+                  static KernelCache cache;
+                  return cache;
+            }
+
+            // A periodic Hann window (the usual choice for the STFT).
+            Table HannWindow(unsigned length);
+
+            // A windowed-sinc (Blackman) lowpass FIR kernel with "ntaps" taps
+            // and unity gain at DC. The cutoff is a fraction of the sample
+            // rate, between 0 and 0.5.
+            Table SincLowpass(unsigned ntaps, double cutoff);
+
+            // The n/2 twiddle factors, e^(-+2 pi i k / n), for an n-point FFT,
+            // stored as interleaved real and imaginary parts.
+            Table Twiddles(unsigned n, bool inverse);
+
+            // Write every table in the cache to a file, or merge the tables
+            // from a file into the cache. Both fail (and print out some
+            // messages) if the file can't be opened or isn't a cache file.
+            // Load() checks the whole file before it merges anything, and
+            // rejects it if any table isn't the length its key calls for, or
+            // the file holds more or fewer tables than it says it does.
+            bool Save(std::string const& filename) const;
+            bool Load(std::string const& filename);
+
+            void Clear(void);
+
+            unsigned long long hits(void) const { return hits_; }
+            unsigned long long misses(void) const { return misses_; }
+
+            /*** Constants ***/
+            // "WKRN"
+            static unsigned const MAGIC = 0x4e524b57;
+            static unsigned const VERSION = 1;
+
+      private:
+            /*** Constructors ***/
+            KernelCache(void) : hits_(0), misses_(0) { }
+            KernelCache(KernelCache const&);
+            KernelCache& operator=(KernelCache const&);
+
+            enum Kind { KIND_HANN = 1, KIND_SINC = 2, KIND_TWIDDLES = 3 };
+
+            struct Key {
+                  unsigned kind;
+                  unsigned size;
+                  double param;
+
+                  bool operator<(Key const& other) const {
+                        if (kind != other.kind) return kind < other.kind;
+                        if (size != other.size) return size < other.size;
+                        return param < other.param;
+                  }
+            };
+
+            Table Find(Key const& key);
+            Table Insert(Key const& key, std::vector<double>* table);
+            static bool ValidKey(Key const& key);
+
+            mutable std::mutex mutex_;
+            std::map<Key, Table> tables_;
+            std::atomic<unsigned long long> hits_;
+            std::atomic<unsigned long long> misses_;
+};
+
+// Looks up a table, counting the hit or miss. We don't hold the lock while
+// designing a missing table, so two threads might both design the same one;
+// Insert() keeps whichever gets there first.
+KernelCache::Table KernelCache::Find(Key const& key) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::map<Key, Table>::const_iterator it = tables_.find(key);
+      if (it == tables_.end()) {
+            ++misses_;
+            Stats::Add(COUNTER_CACHE_MISSES, 1);
+            return Table();
+      }
+      ++hits_;
+      Stats::Add(COUNTER_CACHE_HITS, 1);
+      return it->second;
+}
+
+KernelCache::Table KernelCache::Insert(Key const& key, std::vector<double>* table) {
+      Table shared(table);
+      std::lock_guard<std::mutex> lock(mutex_);
+      return tables_.insert(std::make_pair(key, shared)).first->second;
+}
+
+KernelCache::Table KernelCache::HannWindow(unsigned length) {
+      Key key = { KIND_HANN, length, 0 };
+      Table table = Find(key);
+      if (table) return table;
+
+      std::vector<double>* window = new std::vector<double>(length);
+      for (unsigned i = 0; i != length; ++i) {
+            (*window)[i] = 0.5 - 0.5 * std::cos(2.0 * M_PI * i / length);
+      }
+      return Insert(key, window);
+}
+
+KernelCache::Table KernelCache::SincLowpass(unsigned ntaps, double cutoff) {
+      Key key = { KIND_SINC, ntaps, cutoff };
+      Table table = Find(key);
+      if (table) return table;
+
+      std::vector<double>* taps = new std::vector<double>(ntaps);
+      double center = (ntaps - 1) / 2.0;
+      double total = 0;
+      for (unsigned i = 0; i != ntaps; ++i) {
+            double x = i - center;
+            double sinc = x == 0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+            double phase = ntaps > 1 ? 2.0 * M_PI * i / (ntaps - 1) : 0;
+            double blackman = 0.42 - 0.5 * std::cos(phase) + 0.08 * std::cos(2.0 * phase);
+            (*taps)[i] = sinc * blackman;
+            total += (*taps)[i];
+      }
+      if (total != 0) {
+            for (unsigned i = 0; i != ntaps; ++i) (*taps)[i] /= total;
+      }
+      return Insert(key, taps);
+}
+
+KernelCache::Table KernelCache::Twiddles(unsigned n, bool inverse) {
+      Key key = { KIND_TWIDDLES, n, inverse ? 1.0 : -1.0 };
+      Table table = Find(key);
+      if (table) return table;
+
+      std::vector<double>* twiddles = new std::vector<double>(n);
+      for (unsigned i = 0; i != n / 2; ++i) {
+            double angle = key.param * 2.0 * M_PI * i / n;
+            (*twiddles)[2*i] = std::cos(angle);
+            (*twiddles)[2*i + 1] = std::sin(angle);
+      }
+      return Insert(key, twiddles);
+}
+
+void KernelCache::Clear(void) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tables_.clear();
+}
+
+// Whether a key is one that HannWindow(), SincLowpass() or Twiddles() could
+// have made. Every kind of table is "size" values long.
+bool KernelCache::ValidKey(Key const& key) {
+      switch (key.kind) {
+            case KIND_HANN: return key.param == 0;
+            case KIND_SINC: return key.param >= 0 && key.param <= 0.5;
+            case KIND_TWIDDLES: return key.param == 1.0 || key.param == -1.0;
+            default: return false;
+      }
+}
+
+// File layout (host byte order): magic, version, table count, then for each
+// table its key (kind, size, param), its length, and its values.
+bool KernelCache::Save(std::string const& filename) const {
+      std::ofstream file(filename.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+      if (!file.good()) {
+            std::cerr << "Error: I can't open " << filename << " for writing!" << std::endl;
+            return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      unsigned header[3] = { MAGIC, VERSION, (unsigned)tables_.size() };
+      file.write((char const*)header, sizeof(header));
+
+      for (std::map<Key, Table>::const_iterator it = tables_.begin(); it != tables_.end(); ++it) {
+            unsigned length = it->second->size();
+            file.write((char const*)&it->first.kind, sizeof(it->first.kind));
+            file.write((char const*)&it->first.size, sizeof(it->first.size));
+            file.write((char const*)&it->first.param, sizeof(it->first.param));
+            file.write((char const*)&length, sizeof(length));
+            if (length) file.write((char const*)&(*it->second)[0], length * sizeof(double));
+      }
+
+      file.close();
+      return !file.fail();
+}
+
+bool KernelCache::Load(std::string const& filename) {
+      std::ifstream file(filename.c_str(), std::ios_base::binary | std::ios_base::in);
+      if (!file.good()) {
+            std::cerr << "Error: I can't open " << filename << "!" << std::endl;
+            return false;
+      }
+
+      file.seekg(0, std::ios_base::end);
+      unsigned long long remaining = file.tellg();
+      file.seekg(0);
+
+      unsigned header[3];
+      file.read((char*)header, sizeof(header));
+      if (!file.good() || header[0] != MAGIC || header[1] != VERSION) {
+            std::cerr << "Error: " << filename << " doesn't appear to be a kernel cache!"
+                      << std::endl;
+            return false;
+      }
+      remaining -= sizeof(header);
+
+      // Read (and check) everything before merging any of it, so a bad file
+      // doesn't leave half of itself in the cache.
+      unsigned long long const entry_bytes = 2 * sizeof(unsigned) + sizeof(double) + sizeof(unsigned);
+      std::vector<std::pair<Key, Table> > loaded;
+      bool ok = header[2] <= remaining / entry_bytes;
+      for (unsigned i = 0; ok && i != header[2]; ++i) {
+            Key key;
+            unsigned length;
+            file.read((char*)&key.kind, sizeof(key.kind));
+            file.read((char*)&key.size, sizeof(key.size));
+            file.read((char*)&key.param, sizeof(key.param));
+            file.read((char*)&length, sizeof(length));
+            remaining -= entry_bytes;
+            ok = file.good() && ValidKey(key) && length == key.size
+                  && length <= remaining / sizeof(double)
+                  && (loaded.empty() || loaded.back().first < key);
+            if (!ok) break;
+
+            std::vector<double>* table = new std::vector<double>(length);
+            if (length) file.read((char*)&(*table)[0], length * sizeof(double));
+            remaining -= length * sizeof(double);
+            loaded.push_back(std::make_pair(key, Table(table)));
+            ok = file.good();
+      }
+
+      // Anything left over means the count was wrong.
+      if (!ok || remaining) {
+            std::cerr << "Error: " << filename << " appears to be truncated or damaged!" << std::endl;
+            return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (unsigned i = 0; i != loaded.size(); ++i) tables_.insert(loaded[i]);
+      return true;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef MIXER_H_
+#define MIXER_H_
+
+/*** Many-File Mixer ***/
+// Mixes any number of inputs (e.g., the stems of a song) into one, the same
+// way the two-file mix() example does: the result is the average of the
+// inputs, as long as the longest one, with the shorter ones looped.
+//
+// The inputs are split into groups, one group per task on the thread pool.
+// Each task streams its files (see stream.h) into its own accumulator, so the
+// tasks never share anything they write to. Then the accumulators are summed
+// pairwise, in a tree, with every level split across the pool by frame range.
+//
+// Example usage:
+//      WaveWriter writer;
+//      writer.Open("mix.wav", fmt);
+//      MixFiles(stems, writer);
+//      writer.Close();
+
+#include "stream.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Adds "count" samples into "total". Kept separate (and simple) so it
+// vectorizes.
+static inline void Accumulate(double* total, double const* samples, unsigned count) {
+      for (unsigned i = 0; i != count; ++i) total[i] += samples[i];
+}
+
+// Mixes the files into "sink". Fails (and prints out some messages) if any of
+// them can't be read. Each accumulator is as long as the longest input, so the
+// number of groups is capped to keep all of them under "max_bytes".
+bool MixFiles(std::vector<std::string> const& filenames, BlockSink& sink,
+              ThreadPool& pool = ThreadPool::Shared(),
+              unsigned long long max_bytes = 1ULL << 30) {
+      unsigned const block_frames = 1 << 16;
+      if (filenames.empty()) return false;
+
+      // Headers first, to find out how long the mix is.
+      unsigned nframes = 0;
+      for (unsigned i = 0; i != filenames.size(); ++i) {
+            WaveReader reader;
+            if (!reader.Open(filenames[i])) return false;
+            nframes = std::max(nframes, reader.nframes());
+      }
+
+      unsigned long long group_bytes = std::max(1ULL, (unsigned long long)nframes * sizeof(double));
+      unsigned ngroups = std::min<unsigned long long>(std::min<unsigned>(filenames.size(), pool.size()),
+                                                      std::max(1ULL, max_bytes / group_bytes));
+
+      // Group g gets files g, g + ngroups, g + 2 ngroups, ...
+      std::vector<std::vector<double> > totals(ngroups);
+      std::vector<char> failed(ngroups, 0);
+      TaskGroup tasks(pool);
+      for (unsigned g = 0; g != ngroups; ++g) {
+            tasks.Run([&, g]() {
+                  // Allocated (and first touched) by the thread that
+                  // fills it.
+                  std::vector<double>& total = totals[g];
+                  total.assign(nframes, 0.0);
+                  std::vector<double> block(block_frames);
+
+                  for (unsigned i = g; i < filenames.size(); i += ngroups) {
+                        WaveReader reader;
+                        if (!reader.Open(filenames[i])) {
+                              failed[g] = 1;
+                              return;
+                        }
+
+                        // A block at "position" lands at position,
+                        // position + length, position + 2 length, ...
+                        unsigned length = reader.nframes();
+                        unsigned position = 0;
+                        while (unsigned n = reader.Read(&block[0], block_frames)) {
+                              for (unsigned long long at = position; at < nframes; at += length) {
+                                    Accumulate(&total[at], &block[0], std::min<unsigned long long>(n, nframes - at));
+                              }
+                              position += n;
+                        }
+                  }
+            });
+      }
+      tasks.Wait();
+
+      for (unsigned g = 0; g != ngroups; ++g) {
+            if (failed[g]) return false;
+      }
+
+      // Tree reduction: at each level, total[g] += total[g + stride] for
+      // every g that's a multiple of 2 stride.
+      for (unsigned stride = 1; stride < ngroups; stride *= 2) {
+            ParallelFor(pool, 0, nframes, block_frames, [&](unsigned begin, unsigned end) {
+                  for (unsigned g = 0; g + stride < ngroups; g += 2 * stride) {
+                        Accumulate(&totals[g][begin], &totals[g + stride][begin], end - begin);
+                  }
+            });
+            for (unsigned g = 0; g + stride < ngroups; g += 2 * stride) {
+                  std::vector<double>().swap(totals[g + stride]);
+            }
+      }
+
+      std::vector<double>& mix = totals[0];
+      double const ninputs = filenames.size();
+      ParallelFor(pool, 0, nframes, block_frames, [&](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i != end; ++i) mix[i] /= ninputs;
+      });
+
+      for (unsigned i = 0; i < nframes; i += block_frames) {
+            if (!sink.Write(&mix[i], std::min(block_frames, nframes - i))) return false;
+      }
+      return true;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+/*** NUMA Placement ***/
+// On a machine with more than one memory node (e.g., two sockets), memory is
+// fastest from the CPUs on its own node, and the kernel puts a page on the
+// node of whichever thread touches it first. A buffer filled by one thread
+// and then processed by threads on every node leaves most of them reading
+// across the interconnect.
+//
+// This has what the rest of the library needs to avoid that, straight from
+// sysfs and the system calls (no libnuma):
+//      NumaTopology            Which CPUs we may run on, grouped by node.
+//      PinThread()             Keeps the calling thread on one CPU.
+//      InterleavePages()       Spreads a buffer's pages across the nodes,
+//                              for buffers that one thread fills but every
+//                              thread reads (like a loaded data chunk).
+// Buffers that the processing threads fill themselves (like the accumulators
+// in mixer.h, or WavLoad()'s samples) already land where they're used, by
+// first touch, as long as the threads stay put (see ThreadPool's "pin").
+//
+// On a machine with one node, all of this quietly does nothing.
+//
+// Example usage:
+//      NumaTopology const& topology = NumaTopology::Get();
+//      std::cout << topology.nnodes() << " node(s)" << std::endl;
+//      PinThread(topology.cpus(0)[0]);
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Parses a Linux CPU or node list, like "0-3,8,10-11".
+std::vector<unsigned> ParseIdList(std::string const& list) {
+      std::vector<unsigned> ids;
+      std::istringstream stream(list);
+      std::string range;
+      while (std::getline(stream, range, ',')) {
+            unsigned first, last;
+            char dash;
+            std::istringstream fields(range);
+            if (!(fields >> first)) continue;
+            if (!(fields >> dash >> last) || dash != '-') last = first;
+            for (unsigned id = first; id <= last; ++id) ids.push_back(id);
+      }
+      return ids;
+}
+
+/*** NumaTopology ***/
+class NumaTopology {
+      public:
+            /*** Public Methods ***/
+            // The machine's topology, read once.
+            static NumaTopology const& Get(void) {
+                  static NumaTopology topology;
+                  return topology;
+            }
+
+            // Nodes with at least one CPU we're allowed to run on.
+            unsigned nnodes(void) const { return nodes_.size(); }
+
+            // The kernel's number for a node (nodes don't have to be
+            // numbered 0, 1, ...).
+            unsigned node_id(unsigned node) const { return nodes_[node]; }
+
+            // The CPUs of a node that we're allowed to run on.
+            std::vector<unsigned> const& cpus(unsigned node) const { return cpus_[node]; }
+
+            // Every CPU we may run on, taking one from each node in turn, so
+            // the first few are spread as widely as they can be.
+            std::vector<unsigned> SpreadCpus(void) const;
+
+      private:
+            NumaTopology(void);
+            NumaTopology(NumaTopology const&);
+            NumaTopology& operator=(NumaTopology const&);
+
+            std::vector<unsigned> nodes_;
+            std::vector<std::vector<unsigned> > cpus_;
+};
+
+NumaTopology::NumaTopology(void) {
+      cpu_set_t allowed;
+      CPU_ZERO(&allowed);
+      bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+      std::string line;
+      std::ifstream online("/sys/devices/system/node/online");
+      std::vector<unsigned> node_ids;
+      if (std::getline(online, line)) node_ids = ParseIdList(line);
+
+      for (unsigned i = 0; i != node_ids.size(); ++i) {
+            std::ostringstream path;
+            path << "/sys/devices/system/node/node" << node_ids[i] << "/cpulist";
+            std::ifstream cpulist(path.str().c_str());
+            if (!std::getline(cpulist, line)) continue;
+
+            std::vector<unsigned> all = ParseIdList(line), usable;
+            for (unsigned j = 0; j != all.size(); ++j) {
+                  if (!restricted || (all[j] < CPU_SETSIZE && CPU_ISSET(all[j], &allowed))) {
+                        usable.push_back(all[j]);
+                  }
+            }
+            if (usable.empty()) continue;
+
+            nodes_.push_back(node_ids[i]);
+            cpus_.push_back(usable);
+      }
+
+      // No sysfs (or no NUMA in the kernel): one node with every CPU.
+      if (nodes_.empty()) {
+            std::vector<unsigned> usable;
+            unsigned ncpus = std::max(1L, sysconf(_SC_NPROCESSORS_CONF));
+            for (unsigned cpu = 0; cpu != ncpus && cpu < CPU_SETSIZE; ++cpu) {
+                  if (!restricted || CPU_ISSET(cpu, &allowed)) usable.push_back(cpu);
+            }
+            nodes_.push_back(0);
+            cpus_.push_back(usable);
+      }
+}
+
+std::vector<unsigned> NumaTopology::SpreadCpus(void) const {
+      std::vector<unsigned> spread;
+      for (unsigned round = 0; ; ++round) {
+            bool any = false;
+            for (unsigned node = 0; node != cpus_.size(); ++node) {
+                  if (round < cpus_[node].size()) {
+                        spread.push_back(cpus_[node][round]);
+                        any = true;
+                  }
+            }
+            if (!any) return spread;
+      }
+}
+
+// Keeps the calling thread on one CPU (and so on its node). Returns false if
+// the kernel says no.
+bool PinThread(unsigned cpu) {
+      if (cpu >= CPU_SETSIZE) return false;
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Asks the kernel to put the pages of a buffer round-robin across the nodes
+// as they're first touched (so call it before filling the buffer). Only whole
+// pages are affected; the ends of an unaligned buffer stay where they land.
+// The policy belongs to the pages, not the buffer, so the buffer should be a
+// mapping of its own (from mmap()), not heap memory other allocations share.
+// Returns false if the kernel says no, true if it said yes or there's only
+// one node.
+bool InterleavePages(void* buffer, unsigned long long length) {
+      NumaTopology const& topology = NumaTopology::Get();
+      if (topology.nnodes() < 2) return true;
+
+      unsigned long const page = sysconf(_SC_PAGESIZE);
+      unsigned long begin = ((unsigned long)buffer + page - 1) & ~(page - 1);
+      unsigned long end = ((unsigned long)buffer + length) & ~(page - 1);
+      if (begin >= end) return true;
+
+      unsigned const bits = 8 * sizeof(unsigned long);
+      std::vector<unsigned long> mask;
+      for (unsigned node = 0; node != topology.nnodes(); ++node) {
+            unsigned id = topology.node_id(node);
+            if (mask.size() <= id / bits) mask.resize(id / bits + 1, 0);
+            mask[id / bits] |= 1UL << (id % bits);
+      }
+
+      // The kernel reads one bit fewer than "maxnode" says.
+      return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE, &mask[0],
+                     mask.size() * bits + 1, 0) == 0;
+}
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/*** Pipeline ***/
+// Runs a per-block effect over a stream with reading, processing and writing
+// all happening at once, so a long job takes about as long as its slowest
+// stage instead of the sum of all three.
+//
+// A reader stage fills blocks from a BlockSource, one or more DSP stages apply
+// the effect, and a writer stage writes the results to a BlockSink. The stages
+// hand blocks to each other through bounded, lock-free
+// single-producer/single-consumer rings, and the blocks themselves are
+// allocated once up front and recycled from the writer back to the reader.
+//
+// The stages run as tasks on a thread pool (the shared one, by default) rather
+// than on threads of their own. A stage never waits on a ring: it does all it
+// can and returns, and whichever stage fills or drains a ring it was stuck on
+// starts it again. So a pipeline doesn't tie up any threads while it's
+// waiting on the disk, and several of them (or one inside a pool task) can't
+// starve each other of workers.
+//
+// With several DSP stages, the reader deals blocks out round-robin, each DSP
+// stage has its own pair of rings, and the writer collects round-robin in the
+// same order, so the output stays in order without any locking. That does mean
+// the effect must be able to process any block independently of the others
+// (it's told where the block starts, in case it cares).
+//
+// Each stage's work shows up in a trace (see trace.h), so the gaps show which
+// stage the others are waiting for.
+//
+// Example usage:
+//      WaveReader reader;
+//      reader.Open("in.wav");
+//      WaveWriter writer;
+//      writer.Open("out.wav", reader.fmt_chunk);
+//      Pipeline pipeline(2);
+//      pipeline.Run(reader, [](double* samples, unsigned n, unsigned long long) {
+//            for (unsigned i = 0; i != n; ++i) samples[i] *= 0.5;
+//      }, writer);
+//      writer.Close();
+
+#include "stream.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*** SpscRing ***/
+// A bounded, lock-free queue for exactly one producer and one consumer at a
+// time. The capacity is rounded up to a power of two.
+template <class T>
+class SpscRing {
+      public:
+            /*** Constructors ***/
+            explicit SpscRing(unsigned capacity);
+
+            /*** Public Methods ***/
+            // Both return false instead of waiting (if the ring is full or
+            // empty, respectively).
+            bool TryPush(T const& item);
+            bool TryPop(T& item);
+
+            bool empty(void) const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+            // Only meaningful to the producer: once it sees room, the room
+            // stays until it pushes.
+            bool full(void) const { return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) == items_.size(); }
+
+      private:
+            std::vector<T> items_;
+            unsigned mask_;
+
+            // The producer owns tail_ and the consumer owns head_. They live
+            // on separate cache lines so the two threads don't fight over
+            // one.
+            alignas(64) std::atomic<unsigned> head_;
+            alignas(64) std::atomic<unsigned> tail_;
+};
+
+template <class T>
+SpscRing<T>::SpscRing(unsigned capacity) : head_(0), tail_(0) {
+      unsigned size = 1;
+      while (size < capacity) size <<= 1;
+      items_.resize(size);
+      mask_ = size - 1;
+}
+
+template <class T>
+bool SpscRing<T>::TryPush(T const& item) {
+      unsigned tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) == items_.size()) return false;
+      items_[tail & mask_] = item;
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+}
+
+template <class T>
+bool SpscRing<T>::TryPop(T& item) {
+      unsigned head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire)) return false;
+      item = items_[head & mask_];
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+}
+
+/*** Pipeline ***/
+class Pipeline {
+      public:
+            typedef std::function<void(double* samples, unsigned nframes, unsigned long long first_frame)> Effect;
+
+            /*** Constructors ***/
+            // "depth" is how many blocks each DSP stage can have queued up
+            // on either side of it.
+            explicit Pipeline(unsigned nworkers = 1,
+                              unsigned block_frames = DEFAULT_BLOCK_FRAMES,
+                              unsigned depth = DEFAULT_DEPTH)
+                  : nworkers_(nworkers ? nworkers : 1), block_frames_(block_frames), depth_(depth) { }
+
+            /*** Public Methods ***/
+            // Streams everything from the source through the effect into the
+            // sink, running the stages on "pool" (and on the calling thread,
+            // if it's one of the pool's workers). Returns false if the sink
+            // failed partway.
+            bool Run(BlockSource& source, Effect const& effect, BlockSink& sink,
+                     ThreadPool& pool = ThreadPool::Shared());
+
+            /*** Constants ***/
+            static unsigned const DEFAULT_BLOCK_FRAMES = 16384;
+            static unsigned const DEFAULT_DEPTH = 4;
+
+      private:
+            struct Block {
+                  std::vector<double> samples;
+                  unsigned nframes;
+                  unsigned long long first_frame;
+            };
+
+            // A stage runs as a task whenever it's kicked (something it was
+            // stuck on changed), does everything it can, and returns. Kicks
+            // that come in while it's running send it around again, so none
+            // are lost, and only one task runs a stage at a time.
+            struct Stage {
+                  std::atomic<unsigned> kicks;
+                  std::function<void()> step;
+
+                  Stage(void) : kicks(0) { }
+            };
+
+            static void Kick(Stage& stage, TaskGroup& group);
+
+            unsigned nworkers_;
+            unsigned block_frames_;
+            unsigned depth_;
+};
+
+void Pipeline::Kick(Stage& stage, TaskGroup& group) {
+      if (stage.kicks.fetch_add(1) != 0) return;
+      group.Run([&stage]() {
+            unsigned kicks;
+            do {
+                  kicks = stage.kicks.load();
+                  stage.step();
+            } while (stage.kicks.fetch_sub(kicks) != kicks);
+      });
+}
+
+bool Pipeline::Run(BlockSource& source, Effect const& effect, BlockSink& sink, ThreadPool& pool) {
+      // Enough blocks for every ring to be full at once, plus one each for
+      // the reader and the writer to be working on.
+      unsigned nblocks = 2 * nworkers_ * depth_ + 2;
+      std::vector<Block> blocks(nblocks);
+      SpscRing<Block*> free_blocks(nblocks);
+      for (unsigned i = 0; i != nblocks; ++i) {
+            blocks[i].samples.resize(block_frames_);
+            free_blocks.TryPush(&blocks[i]);
+      }
+
+      std::vector<std::unique_ptr<SpscRing<Block*> > > to_dsp, to_writer;
+      for (unsigned w = 0; w != nworkers_; ++w) {
+            to_dsp.push_back(std::unique_ptr<SpscRing<Block*> >(new SpscRing<Block*>(depth_)));
+            to_writer.push_back(std::unique_ptr<SpscRing<Block*> >(new SpscRing<Block*>(depth_)));
+      }
+
+      // Set by the writer if the sink fails, to stop the others.
+      std::atomic<bool> aborted(false);
+      bool ok = true;
+
+      // The stages' tasks are charged to the caller's account, as tasks are
+      // (see threadpool.h).
+      Stage reader, writer;
+      std::vector<Stage> dsp(nworkers_);
+      TaskGroup group(pool);
+
+      // The reader: fill a free block for the next DSP stage, as long as
+      // there's one free and room in that stage's ring.
+      unsigned long long read_sequence = 0;
+      unsigned long long position = 0;
+      bool reader_done = false;
+      reader.step = [&]() {
+            while (!aborted && !reader_done) {
+                  unsigned w = read_sequence % nworkers_;
+                  Block* block;
+                  if (to_dsp[w]->full() || !free_blocks.TryPop(block)) return;
+
+                  {
+                        TraceSpan span("read block", "pipeline");
+                        block->nframes = source.Read(&block->samples[0], block_frames_);
+                  }
+                  block->first_frame = position;
+                  if (!block->nframes) {
+                        reader_done = true;
+                        return;
+                  }
+                  position += block->nframes;
+
+                  to_dsp[w]->TryPush(block);
+                  ++read_sequence;
+                  Kick(dsp[w], group);
+            }
+      };
+
+      // The DSP stages: apply the effect to whatever's in their rings, as
+      // long as there's room for the results.
+      for (unsigned w = 0; w != nworkers_; ++w) {
+            dsp[w].step = [&, w]() {
+                  SpscRing<Block*>& in = *to_dsp[w];
+                  SpscRing<Block*>& out = *to_writer[w];
+                  while (!aborted && !out.full()) {
+                        Block* block;
+                        if (!in.TryPop(block)) return;
+                        Kick(reader, group);
+
+                        {
+                              TraceSpan span("effect", "pipeline");
+                              effect(&block->samples[0], block->nframes, block->first_frame);
+                        }
+
+                        out.TryPush(block);
+                        Kick(writer, group);
+                  }
+            };
+      }
+
+      // The writer: collect blocks in the order they were read, and hand them
+      // back to the reader.
+      unsigned long long write_sequence = 0;
+      writer.step = [&]() {
+            while (!aborted) {
+                  unsigned w = write_sequence % nworkers_;
+                  Block* block;
+                  if (!to_writer[w]->TryPop(block)) return;
+                  Kick(dsp[w], group);
+
+                  {
+                        TraceSpan span("write block", "pipeline");
+                        if (!sink.Write(&block->samples[0], block->nframes)) {
+                              ok = false;
+                              aborted = true;
+                              return;
+                        }
+                  }
+
+                  free_blocks.TryPush(block);
+                  ++write_sequence;
+                  Kick(reader, group);
+            }
+      };
+
+      // Once the reader runs dry, the blocks drain through the others and
+      // then nothing is left to kick anybody.
+      Kick(reader, group);
+      group.Wait();
+
+      return ok;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef PITCH_H_
+#define PITCH_H_
+
+/*** Pitch Tracker ***/
+// Estimates the fundamental frequency (f0, the perceived pitch) of a signal
+// using the YIN algorithm. See de Cheveigne & Kawahara, "YIN, a fundamental
+// frequency estimator for speech and music" (2002) for the details.
+//
+// The tracker is streaming: feed it samples in whatever sized pieces are
+// handy and it emits one f0 estimate (in Hz) per hop once it has a full
+// analysis frame. Unvoiced frames (no clear periodicity) come out as 0.
+//
+// Example usage:
+//      Wave wave;
+//      wave.Load(filename);
+//      std::vector<double> f0s = TrackPitch(wave);
+//      // f0s[i] is the pitch of the frame starting at sample i * hop.
+
+#include "fft.h"
+#include "wave.h"
+#include <cmath>
+#include <complex>
+#include <vector>
+
+class PitchTracker {
+      public:
+            /*** Constructors ***/
+            // The window is the YIN integration window, in samples. Each
+            // analysis frame spans window + sample_rate/min_f0 samples.
+            PitchTracker(unsigned sample_rate,
+                         unsigned window = DEFAULT_WINDOW,
+                         unsigned hop = DEFAULT_HOP,
+                         double min_f0 = DEFAULT_MIN_F0,
+                         double max_f0 = DEFAULT_MAX_F0,
+                         double threshold = DEFAULT_THRESHOLD);
+
+            /*** Public Methods ***/
+            // Appends the next "n" samples of the stream, pushing an f0
+            // estimate onto "f0s" for every frame completed along the way.
+            void Push(double const* samples, unsigned n, std::vector<double>& f0s);
+
+            unsigned hop(void) const { return hop_; }
+            unsigned frame_length(void) const { return window_ + max_lag_; }
+
+            /*** Constants ***/
+            static unsigned const DEFAULT_WINDOW = 1024;
+            static unsigned const DEFAULT_HOP = 256;
+            static constexpr double DEFAULT_MIN_F0 = 60.0;
+            static constexpr double DEFAULT_MAX_F0 = 500.0;
+            static constexpr double DEFAULT_THRESHOLD = 0.1;
+
+      private:
+            double Estimate(double const* frame);
+            void DifferenceDirect(double const* frame);
+            void DifferenceFft(double const* frame);
+
+            unsigned sample_rate_;
+            unsigned window_;
+            unsigned hop_;
+            unsigned min_lag_;
+            unsigned max_lag_;
+            double threshold_;
+            bool use_fft_;
+
+            // Samples we've been given but haven't slid past yet.
+            std::vector<double> pending_;
+            unsigned pending_start_;
+
+            // Scratch space, allocated once so Push() doesn't allocate per
+            // frame.
+            std::vector<double> diff_;
+            std::vector<double> energy_;
+            std::vector<std::complex<double> > bins_;
+};
+
+PitchTracker::PitchTracker(unsigned sample_rate, unsigned window, unsigned hop,
+                           double min_f0, double max_f0, double threshold)
+      : sample_rate_(sample_rate), window_(window), hop_(hop ? hop : 1),
+        threshold_(threshold), pending_start_(0) {
+      min_lag_ = std::max(2u, (unsigned)(sample_rate / max_f0));
+      max_lag_ = std::max(min_lag_ + 2, (unsigned)std::ceil(sample_rate / min_f0));
+
+      diff_.resize(max_lag_ + 1);
+      energy_.resize(frame_length() + 1);
+
+      // The direct difference function costs about window * max_lag
+      // multiply-adds per frame. The FFT route costs two transforms of the
+      // padded frame. Pick whichever is cheaper for these parameters.
+      unsigned nbins = NextPow2(frame_length());
+      double log_nbins = std::log2((double)nbins);
+      use_fft_ = (double)window_ * max_lag_ > 8.0 * nbins * log_nbins;
+      if (use_fft_) bins_.resize(nbins);
+}
+
+void PitchTracker::Push(double const* samples, unsigned n, std::vector<double>& f0s) {
+      pending_.insert(pending_.end(), samples, samples + n);
+
+      while (pending_start_ + frame_length() <= pending_.size()) {
+            f0s.push_back(Estimate(&pending_[pending_start_]));
+            pending_start_ += hop_;
+      }
+
+      // Slide the leftovers down to the front, but only once they're a
+      // decent fraction of the buffer so we're not memmove()ing every call.
+      if (pending_start_ >= pending_.size() / 2) {
+            unsigned consumed = std::min<size_t>(pending_start_, pending_.size());
+            pending_.erase(pending_.begin(), pending_.begin() + consumed);
+            pending_start_ -= consumed;
+      }
+}
+
+// The YIN difference function, d(tau) = sum (x[j] - x[j+tau])^2, computed
+// directly. We keep four partial sums so the compiler can vectorize the inner
+// loop (a single running sum is a serial dependency chain).
+void PitchTracker::DifferenceDirect(double const* frame) {
+      diff_[0] = 0;
+      for (unsigned tau = 1; tau <= max_lag_; ++tau) {
+            double const* shifted = frame + tau;
+            double sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+            unsigned j = 0;
+            for (; j + 4 <= window_; j += 4) {
+                  double d0 = frame[j] - shifted[j];
+                  double d1 = frame[j+1] - shifted[j+1];
+                  double d2 = frame[j+2] - shifted[j+2];
+                  double d3 = frame[j+3] - shifted[j+3];
+                  sum0 += d0 * d0;
+                  sum1 += d1 * d1;
+                  sum2 += d2 * d2;
+                  sum3 += d3 * d3;
+            }
+            for (; j != window_; ++j) {
+                  double d = frame[j] - shifted[j];
+                  sum0 += d * d;
+            }
+            diff_[tau] = (sum0 + sum1) + (sum2 + sum3);
+      }
+}
+
+// The same difference function via the identity
+//      d(tau) = E(0) + E(tau) - 2 r(tau),
+// where E(tau) is the energy of the window starting at tau (from a running sum
+// of squares) and r(tau) is the cross-correlation of the first window with the
+// whole frame, which we get from one FFT round trip. Both real signals are
+// packed into a single complex transform (frame in the real part, window in
+// the imaginary part) and separated again in the frequency domain.
+void PitchTracker::DifferenceFft(double const* frame) {
+      unsigned nbins = bins_.size();
+      unsigned length = frame_length();
+
+      energy_[0] = 0;
+      for (unsigned j = 0; j != length; ++j) {
+            energy_[j + 1] = energy_[j] + frame[j] * frame[j];
+      }
+
+      for (unsigned j = 0; j != nbins; ++j) {
+            double re = j < length ? frame[j] : 0;
+            double im = j < window_ ? frame[j] : 0;
+            bins_[j] = std::complex<double>(re, im);
+      }
+
+      Fft(bins_, false);
+
+      // With Z = FFT(a + ib): A[k] = (Z[k] + conj(Z[-k]))/2 and
+      // B[k] = (Z[k] - conj(Z[-k]))/2i. We need A[k] * conj(B[k]). Both
+      // halves are computed from the same pair, so do them together.
+      for (unsigned k = 0; k <= nbins / 2; ++k) {
+            unsigned mirror = (nbins - k) % nbins;
+            std::complex<double> z = bins_[k];
+            std::complex<double> zm = std::conj(bins_[mirror]);
+            std::complex<double> a = (z + zm) * 0.5;
+            std::complex<double> b = (z - zm) * std::complex<double>(0, -0.5);
+            std::complex<double> product = a * std::conj(b);
+            bins_[k] = product;
+            bins_[mirror] = std::conj(product);
+      }
+
+      Fft(bins_, true);
+
+      for (unsigned tau = 0; tau <= max_lag_; ++tau) {
+            double e0 = energy_[window_];
+            double etau = energy_[tau + window_] - energy_[tau];
+            diff_[tau] = std::max(0.0, e0 + etau - 2.0 * bins_[tau].real());
+      }
+}
+
+// Returns the f0 estimate for the frame starting at "frame", or 0 if it's
+// unvoiced.
+double PitchTracker::Estimate(double const* frame) {
+      if (use_fft_) {
+            DifferenceFft(frame);
+      } else {
+            DifferenceDirect(frame);
+      }
+
+      // Cumulative mean normalized difference, in place.
+      double running_sum = 0;
+      diff_[0] = 1;
+      for (unsigned tau = 1; tau <= max_lag_; ++tau) {
+            running_sum += diff_[tau];
+            diff_[tau] = running_sum > 0 ? diff_[tau] * tau / running_sum : 1;
+      }
+
+      // The first dip below the threshold, followed down to its bottom.
+      unsigned tau = min_lag_;
+      while (tau < max_lag_ && diff_[tau] >= threshold_) ++tau;
+      if (tau >= max_lag_) return 0;
+      while (tau + 1 < max_lag_ && diff_[tau + 1] < diff_[tau]) ++tau;
+
+      // Parabolic interpolation for a sub-sample period.
+      double period = tau;
+      double left = diff_[tau - 1], center = diff_[tau], right = diff_[tau + 1];
+      double denominator = left - 2 * center + right;
+      if (denominator > 0) period += 0.5 * (left - right) / denominator;
+
+      return sample_rate_ / period;
+}
+
+// Tracks the pitch of a whole Wave file, returning one f0 estimate (in Hz, or
+// 0 if unvoiced) per hop. Samples are decoded a block at a time with
+// Wave::GetSamples().
+std::vector<double> TrackPitch(Wave const& wave,
+                               unsigned window = PitchTracker::DEFAULT_WINDOW,
+                               unsigned hop = PitchTracker::DEFAULT_HOP) {
+      PitchTracker tracker(wave.fmt_chunk.sample_rate, window, hop);
+      std::vector<double> f0s;
+
+      unsigned const block_length = 4096;
+      std::vector<double> block(block_length);
+      unsigned nsamples = wave.nsamples();
+      for (unsigned offset = 0; offset < nsamples; offset += block_length) {
+            unsigned n = std::min(block_length, nsamples - offset);
+            wave.GetSamples(offset, n, &block[0]);
+            tracker.Push(&block[0], n, f0s);
+      }
+
+      return f0s;
+}
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+/*** Real-Time Block Processing ***/
+// Runs effects on live audio: fixed, small blocks (typically 64 to 512
+// frames) go from a source to a sink, and each block has to be processed
+// before the next one is due, i.e. within one block's worth of audio time.
+//
+// To make that dependable, the processing thread never allocates, locks or
+// does I/O once it's running. Effects are BlockEffects, which do all of their
+// allocating in Prepare(), before the stream starts. The calling thread does
+// the reading and writing and trades blocks with the processing thread over
+// lock-free rings (see pipeline.h), from a pool of blocks allocated up front.
+// A thread with nothing to do spins for a little while (the other one is
+// usually just about to deliver) and then sleeps on an atomic until it does.
+// Every block's latency goes into a histogram (see histogram.h), for its
+// percentiles, and blocks that take too long are counted as deadline misses.
+// When the stream's done, both are added to the counters in stats.h too.
+//
+// For a live source, pass paced = false: the source itself sets the pace, and
+// a block's deadline is one block period after it arrived. To rehearse with a
+// file, pass paced = true, and the runner hands blocks out at the audio rate,
+// as if they were coming off a sound card.
+//
+// Example usage:
+//      Echo echo(4410, 0.5);
+//      RealtimeRunner runner(reader.fmt_chunk.sample_rate, 128);
+//      runner.Run(reader, echo, writer);
+//      std::cout << runner.stats().nmissed << " late blocks, p99 "
+//                << runner.stats().latency.Percentile(99) << " ns" << std::endl;
+
+#include "histogram.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "stream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*** BlockEffect ***/
+class BlockEffect {
+      public:
+            virtual ~BlockEffect(void) { }
+
+            // Called before the stream starts (and not on the processing
+            // thread), with the largest block Process() will ever see. Set up
+            // buffers and reset any state here.
+            virtual void Prepare(unsigned sample_rate, unsigned max_block_frames) { }
+
+            // Processes a block in place. Must not allocate, lock or do I/O.
+            virtual void Process(double* samples, unsigned nframes) = 0;
+};
+
+/*** Gain ***/
+class Gain : public BlockEffect {
+      public:
+            explicit Gain(double factor) : factor_(factor) { }
+
+            virtual void Process(double* samples, unsigned nframes) {
+                  for (unsigned i = 0; i != nframes; ++i) samples[i] *= factor_;
+            }
+
+      private:
+            double factor_;
+};
+
+/*** Echo ***/
+// The same echo as the echo() example in wave.cpp (the sample from "delay"
+// frames ago, scaled by "intensity," averaged in), on a stream with no end,
+// so there's no tail.
+class Echo : public BlockEffect {
+      public:
+            explicit Echo(unsigned delay = 10000, double intensity = 0.8)
+                  : delay_(std::max(1u, delay)), intensity_(intensity), position_(0), filled_(false) { }
+
+            virtual void Prepare(unsigned sample_rate, unsigned max_block_frames) {
+                  history_.assign(delay_, 0.0);
+                  position_ = 0;
+                  filled_ = false;
+            }
+
+            virtual void Process(double* samples, unsigned nframes);
+
+      private:
+            unsigned delay_;
+            double intensity_;
+
+            // The last "delay" input samples, as a ring.
+            std::vector<double> history_;
+            unsigned position_;
+            bool filled_;
+};
+
+void Echo::Process(double* samples, unsigned nframes) {
+      for (unsigned i = 0; i != nframes; ++i) {
+            double in = samples[i];
+            if (filled_) samples[i] = (in + intensity_ * history_[position_]) / 2;
+            history_[position_] = in;
+
+            if (++position_ == delay_) {
+                  position_ = 0;
+                  filled_ = true;
+            }
+      }
+}
+
+/*** EffectChain ***/
+// Runs several effects, in order, on each block. The chain doesn't own them.
+class EffectChain : public BlockEffect {
+      public:
+            // Only while setting up, not while a stream is running.
+            void Add(BlockEffect& effect) { effects_.push_back(&effect); }
+
+            virtual void Prepare(unsigned sample_rate, unsigned max_block_frames) {
+                  for (unsigned i = 0; i != effects_.size(); ++i) {
+                        effects_[i]->Prepare(sample_rate, max_block_frames);
+                  }
+            }
+
+            virtual void Process(double* samples, unsigned nframes) {
+                  for (unsigned i = 0; i != effects_.size(); ++i) {
+                        effects_[i]->Process(samples, nframes);
+                  }
+            }
+
+      private:
+            std::vector<BlockEffect*> effects_;
+};
+
+/*** RealtimeStats ***/
+struct RealtimeStats {
+      unsigned long long nblocks;
+      unsigned long long nmissed;
+
+      // One block period, in seconds.
+      double budget;
+
+      // Each block's time from arrival until it's done (which, when pacing,
+      // includes waiting to be picked up), in nanoseconds.
+      LatencyHistogram latency;
+
+      explicit RealtimeStats(unsigned latency_digits = LatencyHistogram::DEFAULT_DIGITS)
+            : nblocks(0), nmissed(0), budget(0),
+              latency(LatencyHistogram::DEFAULT_HIGHEST, latency_digits) { }
+
+      // In seconds.
+      double mean(void) const { return latency.mean() / 1e9; }
+      double worst(void) const { return latency.max() / 1e9; }
+};
+
+/*** RealtimeRunner ***/
+class RealtimeRunner {
+      public:
+            /*** Constructors ***/
+            // "depth" is how many blocks can be waiting on either side of the
+            // processing thread; more rides out hiccups in the I/O, at the
+            // cost of latency. "latency_digits" is the precision of the
+            // latency histogram (see histogram.h).
+            RealtimeRunner(unsigned sample_rate, unsigned block_frames = DEFAULT_BLOCK_FRAMES,
+                           bool paced = false, unsigned depth = DEFAULT_DEPTH,
+                           unsigned latency_digits = LatencyHistogram::DEFAULT_DIGITS)
+                  : sample_rate_(sample_rate), block_frames_(std::max(1u, block_frames)),
+                    paced_(paced), depth_(std::max(1u, depth)), latency_digits_(latency_digits),
+                    stats_(latency_digits) { }
+
+            /*** Public Methods ***/
+            // Streams the source through the effect into the sink, a block at
+            // a time, until the source runs out. Returns false if the sink
+            // failed.
+            bool Run(BlockSource& source, BlockEffect& effect, BlockSink& sink);
+
+            // How the last Run() went.
+            RealtimeStats const& stats(void) const { return stats_; }
+
+            /*** Constants ***/
+            static unsigned const DEFAULT_BLOCK_FRAMES = 256;
+            static unsigned const DEFAULT_DEPTH = 8;
+
+      private:
+            typedef std::chrono::steady_clock Clock;
+
+            // How many times a thread checks its ring before it sleeps.
+            static unsigned const SPINS = 256;
+
+            // Waits for "signal" to move on from "seen", which it does each
+            // time the other thread delivers a block: spinning at first, then
+            // asleep.
+            static void WaitForSignal(std::atomic<unsigned>& signal, unsigned seen, unsigned& attempts) {
+                  if (++attempts > SPINS) signal.wait(seen);
+            }
+
+            static void Signal(std::atomic<unsigned>& signal) {
+                  ++signal;
+                  signal.notify_one();
+            }
+
+            struct Block {
+                  std::vector<double> samples;
+                  unsigned nframes;
+                  Clock::time_point arrival;
+            };
+
+            unsigned sample_rate_;
+            unsigned block_frames_;
+            bool paced_;
+            unsigned depth_;
+            unsigned latency_digits_;
+            RealtimeStats stats_;
+};
+
+bool RealtimeRunner::Run(BlockSource& source, BlockEffect& effect, BlockSink& sink) {
+      // The histogram's allocated here, too.
+      stats_ = RealtimeStats(latency_digits_);
+      stats_.budget = block_frames_ / (double)std::max(1u, sample_rate_);
+      Clock::duration const budget = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(stats_.budget));
+
+      // Everything the processing thread touches gets allocated here.
+      effect.Prepare(sample_rate_, block_frames_);
+
+      unsigned nblocks = 2 * depth_ + 2;
+      std::vector<Block> blocks(nblocks);
+      SpscRing<Block*> free_blocks(nblocks);
+      SpscRing<Block*> to_dsp(depth_);
+      SpscRing<Block*> from_dsp(depth_);
+      for (unsigned i = 0; i != nblocks; ++i) {
+            blocks[i].samples.resize(block_frames_);
+            free_blocks.TryPush(&blocks[i]);
+      }
+
+      // Bumped by each side whenever it pushes a block (or, for the I/O
+      // side, runs out of them), to wake the other.
+      std::atomic<unsigned> to_dsp_signal(0);
+      std::atomic<unsigned> from_dsp_signal(0);
+      std::atomic<bool> source_done(false);
+
+      std::thread dsp([&]() {
+            unsigned attempts = 0;
+            for (;;) {
+                  unsigned seen = to_dsp_signal.load();
+                  Block* block;
+                  if (!to_dsp.TryPop(block)) {
+                        if (source_done && to_dsp.empty()) return;
+                        WaitForSignal(to_dsp_signal, seen, attempts);
+                        continue;
+                  }
+                  attempts = 0;
+
+                  effect.Process(&block->samples[0], block->nframes);
+
+                  Clock::duration latency = Clock::now() - block->arrival;
+                  ++stats_.nblocks;
+                  stats_.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+                  if (latency > budget) ++stats_.nmissed;
+
+                  // There's always room: there are never more blocks out
+                  // than the ring holds.
+                  from_dsp.TryPush(block);
+                  Signal(from_dsp_signal);
+            }
+      });
+
+      // The I/O side: read into free blocks, write out finished ones.
+      bool ok = true;
+      bool reading = true;
+      unsigned outstanding = 0;
+      Clock::time_point start = Clock::now();
+      unsigned long long nread = 0;
+      for (unsigned attempts = 0; reading || outstanding; ) {
+            unsigned seen = from_dsp_signal.load();
+            bool progress = false;
+
+            Block* block;
+            if (reading && outstanding < depth_ && free_blocks.TryPop(block)) {
+                  if (paced_) std::this_thread::sleep_until(start + nread * budget);
+
+                  block->nframes = ok ? source.Read(&block->samples[0], block_frames_) : 0;
+                  block->arrival = Clock::now();
+                  if (block->nframes) {
+                        // There's room, as above.
+                        to_dsp.TryPush(block);
+                        ++outstanding;
+                        ++nread;
+                  } else {
+                        free_blocks.TryPush(block);
+                        reading = false;
+                        source_done = true;
+                  }
+                  Signal(to_dsp_signal);
+                  progress = true;
+            }
+
+            if (from_dsp.TryPop(block)) {
+                  if (ok && !sink.Write(&block->samples[0], block->nframes)) ok = false;
+                  free_blocks.TryPush(block);
+                  --outstanding;
+                  progress = true;
+            }
+
+            // Nothing to do means we're waiting on the processing thread.
+            if (progress) {
+                  attempts = 0;
+            } else {
+                  WaitForSignal(from_dsp_signal, seen, attempts);
+            }
+      }
+
+      source_done = true;
+      Signal(to_dsp_signal);
+      dsp.join();
+
+      Stats::Add(COUNTER_BLOCKS, stats_.nblocks);
+      Stats::Add(COUNTER_DEADLINE_MISSES, stats_.nmissed);
+      Stats::AddBlockLatencies(stats_.latency);
+      return ok;
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef REGIONS_H_
+#define REGIONS_H_
+
+/*** Labeled Regions ***/
+// Editors mark up WAV files with a "cue " chunk (a list of numbered sample
+// positions) and a "LIST" chunk of type "adtl" (associated data), where "labl"
+// subchunks name cue points and "ltxt" subchunks give them a length. A cue
+// point with a label is a region: it runs for its ltxt length if it has one,
+// otherwise up to the next cue point (or the end of the data).
+//
+// ExtractRegions() writes every labeled region to its own WAV file in a
+// single sequential pass over the source's data chunk, however many regions
+// there are.
+//
+// Example usage:
+//      // Writes takes/intro.wav, takes/verse.wav, ...
+//      unsigned nwritten;
+//      ExtractRegions("session.wav", "takes/", nwritten);
+
+#include "stream.h"
+#include "wave.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Region {
+      std::string label;
+      unsigned start;
+      unsigned length;
+};
+
+// "cue "
+static uint32_t const CHUNK_TYPE_CUE = 0x20657563;
+// "LIST"
+static uint32_t const CHUNK_TYPE_LIST = 0x5453494c;
+// "adtl"
+static uint32_t const LIST_TYPE_ADTL = 0x6c746461;
+// "labl"
+static uint32_t const CHUNK_TYPE_LABL = 0x6c62616c;
+// "ltxt"
+static uint32_t const CHUNK_TYPE_LTXT = 0x7478746c;
+
+// Finds the labeled regions described by the cue and adtl chunks among
+// "chunks" (e.g., Wave::other_chunks), sorted by start. Regions are clipped to
+// "nframes".
+std::vector<Region> FindRegions(std::vector<DataChunk> const& chunks, unsigned nframes) {
+      std::map<uint32_t, unsigned> positions;
+      std::map<uint32_t, std::string> labels;
+      std::map<uint32_t, unsigned> lengths;
+
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+            DataChunk const& chunk = chunks[i];
+            if (!chunk.data()) continue;
+            std::istringstream stream(std::string(chunk.data(), chunk.chunk_size));
+
+            if (chunk.chunk_type == CHUNK_TYPE_CUE) {
+                  // Each cue point: id, position, data chunk id, chunk
+                  // start, block start, sample offset.
+                  uint32_t ncues;
+                  ReadLittleEndian(stream, ncues);
+                  for (uint32_t c = 0; c != ncues && stream.good(); ++c) {
+                        uint32_t fields[6];
+                        for (unsigned f = 0; f != 6; ++f) ReadLittleEndian(stream, fields[f]);
+                        if (stream.good()) positions[fields[0]] = fields[5];
+                  }
+            } else if (chunk.chunk_type == CHUNK_TYPE_LIST) {
+                  uint32_t list_type;
+                  ReadLittleEndian(stream, list_type);
+                  if (list_type != LIST_TYPE_ADTL) continue;
+
+                  while (stream.good()) {
+                        uint32_t type, size, id;
+                        ReadLittleEndian(stream, type);
+                        ReadLittleEndian(stream, size);
+                        if (!stream.good() || size < 4) break;
+
+                        std::string body(size, '\0');
+                        stream.read(&body[0], size);
+                        if (size % 2) stream.ignore(1);
+                        if (stream.fail()) break;
+
+                        std::istringstream fields(body);
+                        ReadLittleEndian(fields, id);
+                        if (type == CHUNK_TYPE_LABL) {
+                              std::string text = body.substr(4);
+                              labels[id] = text.substr(0, text.find('\0'));
+                        } else if (type == CHUNK_TYPE_LTXT && size >= 8) {
+                              uint32_t length;
+                              ReadLittleEndian(fields, length);
+                              lengths[id] = length;
+                        }
+                  }
+            }
+      }
+
+      std::vector<unsigned> starts;
+      for (std::map<uint32_t, unsigned>::const_iterator it = positions.begin(); it != positions.end(); ++it) {
+            starts.push_back(it->second);
+      }
+      std::sort(starts.begin(), starts.end());
+
+      std::vector<Region> regions;
+      for (std::map<uint32_t, std::string>::const_iterator it = labels.begin(); it != labels.end(); ++it) {
+            if (!positions.count(it->first)) continue;
+
+            Region region;
+            region.label = it->second;
+            region.start = std::min(positions[it->first], nframes);
+
+            unsigned end = nframes;
+            if (lengths.count(it->first)) {
+                  end = std::min<unsigned long long>(nframes, (unsigned long long)region.start + lengths[it->first]);
+            } else {
+                  std::vector<unsigned>::const_iterator next = std::upper_bound(starts.begin(), starts.end(), region.start);
+                  if (next != starts.end()) end = std::min(end, *next);
+            }
+            region.length = end - region.start;
+
+            if (region.length) regions.push_back(region);
+      }
+
+      std::stable_sort(regions.begin(), regions.end(),
+            [](Region const& a, Region const& b) { return a.start < b.start; });
+      return regions;
+}
+
+// Turns a label into something safe to use as a filename. Labels that come out
+// the same get numbered.
+static std::string RegionFilename(std::string const& label, std::map<std::string, unsigned>& used) {
+      std::string name;
+      for (unsigned i = 0; i != label.size(); ++i) {
+            char c = label[i];
+            bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                        || c == '-' || c == '_' || c == '.';
+            name += safe ? c : '_';
+      }
+      if (name.empty() || name[0] == '.') name = "region" + name;
+
+      unsigned count = ++used[name];
+      if (count > 1) {
+            std::ostringstream numbered;
+            numbered << name << "_" << count;
+            name = numbered.str();
+      }
+      return name;
+}
+
+// Writes each labeled region of "filename" to "<prefix><label>.wav", copying
+// the frames byte for byte. The source's data chunk is read once, front to
+// back; a region's output file is only open while the read is inside it.
+// Sets "written" to the number of regions written. Returns false (and prints
+// out some messages) if any region couldn't be written; the ones that could
+// still are, and the ones that couldn't are removed.
+bool ExtractRegions(std::string const& filename, std::string const& prefix, unsigned& written) {
+      written = 0;
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
+
+      std::vector<Region> regions = FindRegions(reader.other_chunks, reader.nframes());
+      if (regions.empty()) {
+            std::cerr << "Error: " << filename << " doesn't have any labeled regions!" << std::endl;
+            return false;
+      }
+
+      std::map<std::string, unsigned> used;
+      std::vector<std::string> outputs;
+      for (unsigned i = 0; i != regions.size(); ++i) {
+            outputs.push_back(prefix + RegionFilename(regions[i].label, used) + ".wav");
+      }
+
+      unsigned const block_frames = 65536;
+      std::vector<char> block((size_t)block_frames * reader.fmt_chunk.block_align);
+
+      // Regions are sorted by start. "next" is the first one we haven't
+      // opened yet; "active" are the ones we're in the middle of.
+      std::vector<std::unique_ptr<WaveWriter> > writers(regions.size());
+      std::vector<unsigned> active;
+      unsigned next = 0;
+      bool ok = true;
+
+      // Gives up on a region's file.
+      auto fail = [&](unsigned region) {
+            std::cerr << "Error: I can't write " << outputs[region] << "!" << std::endl;
+            writers[region].reset();
+            std::remove(outputs[region].c_str());
+            ok = false;
+      };
+
+      unsigned position = 0;
+      while (next != regions.size() || !active.empty()) {
+            // Don't bother reading the gap between regions.
+            if (active.empty() && regions[next].start > position) {
+                  position = regions[next].start;
+                  reader.Seek(position);
+            }
+
+            unsigned n = reader.ReadFrames(&block[0], block_frames);
+            if (!n) {
+                  std::cerr << "Error: " << filename << " appears to be truncated!" << std::endl;
+                  for (unsigned a = 0; a != active.size(); ++a) fail(active[a]);
+                  return false;
+            }
+            unsigned end = position + n;
+
+            for (; next != regions.size() && regions[next].start < end; ++next) {
+                  writers[next].reset(new WaveWriter);
+                  if (writers[next]->Open(outputs[next], reader.fmt_chunk)) {
+                        active.push_back(next);
+                  } else {
+                        writers[next].reset();
+                        ok = false;
+                  }
+            }
+
+            for (unsigned a = 0; a != active.size(); ) {
+                  Region const& region = regions[active[a]];
+                  unsigned from = std::max(position, region.start);
+                  unsigned to = std::min(end, region.start + region.length);
+
+                  WaveWriter& writer = *writers[active[a]];
+                  bool done = to == region.start + region.length;
+                  if (from < to && !writer.WriteFrames(&block[0] + (size_t)(from - position) * reader.fmt_chunk.block_align,
+                                                       to - from)) {
+                        fail(active[a]);
+                        done = true;
+                  } else if (done) {
+                        if (writer.Close()) {
+                              ++written;
+                              writers[active[a]].reset();
+                        } else {
+                              fail(active[a]);
+                        }
+                  }
+
+                  if (done) {
+                        active.erase(active.begin() + a);
+                  } else {
+                        ++a;
+                  }
+            }
+
+            position = end;
+      }
+
+      return ok;
+}
+
+#endif
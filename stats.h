@@ -0,0 +1,309 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/*** Instrumentation ***/
+// Counts where the time (and the bytes) go inside the library: how long each
+// stage took and how often it ran, how many bytes were read and written, how
+// many frames were converted, how many data buffers were allocated and how
+// often the kernel cache (see kernels.h) had what we asked for. Real-time
+// blocks (see realtime.h) add their count, their deadline misses and a
+// histogram of their latencies.
+//
+// Every thread counts into its own counters, so counting costs about as much
+// as an increment (and a clock read, for the stages) with no locking or
+// sharing between threads. Snapshot() adds up every thread's counters
+// (including those of threads that have since exited) for whoever wants to
+// export them, e.g. to a metrics system, and Reset() starts the count over.
+//
+// Stages nest: a Save() inside an operation counts towards both, and the
+// encoding inside the Save() counts towards all three.
+//
+// Defining WAVE_NO_STATS compiles all of this away; the counters then stay
+// at zero.
+//
+// Example usage:
+//      void Work(void) {
+//            StageTimer timer(STAGE_OPERATION);
+//            Stats::Add(COUNTER_BYTES_READ, nbytes);
+//      }
+//
+//      StatsSnapshot stats = Stats::Snapshot();
+//      stats.WriteTo(std::cerr);
+//      Stats::Reset();
+
+#include "histogram.h"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// The stages we time.
+enum Stage {
+      STAGE_LOAD,             // Wave::Load(), reading and parsing a file.
+      STAGE_SAVE,             // Wave::Save(), writing a file.
+      STAGE_DECODE,           // Converting samples to doubles.
+      STAGE_ENCODE,           // Converting doubles to samples.
+      STAGE_OPERATION,        // One of wave.cpp's operations, start to end.
+      NSTAGES
+};
+
+// The things we count.
+enum Counter {
+      COUNTER_BYTES_READ,             // Chunk data, to and from files.
+      COUNTER_BYTES_WRITTEN,
+      COUNTER_FRAMES_DECODED,
+      COUNTER_FRAMES_ENCODED,
+      COUNTER_ALLOCATIONS,            // Data chunk buffers.
+      COUNTER_ALLOCATED_BYTES,
+      COUNTER_CACHE_HITS,             // Kernel cache lookups.
+      COUNTER_CACHE_MISSES,
+      COUNTER_BLOCKS,                 // Real-time blocks processed.
+      COUNTER_DEADLINE_MISSES,
+      NCOUNTERS
+};
+
+/*** StatsSnapshot ***/
+// The counters added up at one point in time.
+struct StatsSnapshot {
+      unsigned long long counters[NCOUNTERS];
+      unsigned long long stage_nanoseconds[NSTAGES];
+      unsigned long long stage_calls[NSTAGES];
+
+      StatsSnapshot(void) { Clear(); }
+
+      void Clear(void);
+
+      double stage_seconds(Stage stage) const { return stage_nanoseconds[stage] / 1e9; }
+
+      // Writes one "<name> <value>" line per counter, then "<stage>_seconds"
+      // and "<stage>_calls" lines per stage, e.g. "bytes_read 1048620".
+      void WriteTo(std::ostream& stream) const;
+
+      static char const* StageName(Stage stage);
+      static char const* CounterName(Counter counter);
+
+      StatsSnapshot& operator+=(StatsSnapshot const& other);
+      StatsSnapshot& operator-=(StatsSnapshot const& other);
+};
+
+void StatsSnapshot::Clear(void) {
+      for (unsigned i = 0; i != NCOUNTERS; ++i) counters[i] = 0;
+      for (unsigned i = 0; i != NSTAGES; ++i) stage_nanoseconds[i] = stage_calls[i] = 0;
+}
+
+void StatsSnapshot::WriteTo(std::ostream& stream) const {
+      for (unsigned i = 0; i != NCOUNTERS; ++i) {
+            stream << CounterName((Counter)i) << " " << counters[i] << std::endl;
+      }
+      for (unsigned i = 0; i != NSTAGES; ++i) {
+            stream << StageName((Stage)i) << "_seconds " << stage_seconds((Stage)i) << std::endl
+                   << StageName((Stage)i) << "_calls " << stage_calls[i] << std::endl;
+      }
+}
+
+char const* StatsSnapshot::StageName(Stage stage) {
+      static char const* const names[NSTAGES] = { "load", "save", "decode", "encode", "operation" };
+      return stage < NSTAGES ? names[stage] : "unknown";
+}
+
+char const* StatsSnapshot::CounterName(Counter counter) {
+      static char const* const names[NCOUNTERS] = {
+            "bytes_read", "bytes_written", "frames_decoded", "frames_encoded",
+            "allocations", "allocated_bytes", "cache_hits", "cache_misses",
+            "blocks", "deadline_misses"
+      };
+      return counter < NCOUNTERS ? names[counter] : "unknown";
+}
+
+StatsSnapshot& StatsSnapshot::operator+=(StatsSnapshot const& other) {
+      for (unsigned i = 0; i != NCOUNTERS; ++i) counters[i] += other.counters[i];
+      for (unsigned i = 0; i != NSTAGES; ++i) {
+            stage_nanoseconds[i] += other.stage_nanoseconds[i];
+            stage_calls[i] += other.stage_calls[i];
+      }
+      return *this;
+}
+
+StatsSnapshot& StatsSnapshot::operator-=(StatsSnapshot const& other) {
+      for (unsigned i = 0; i != NCOUNTERS; ++i) counters[i] -= other.counters[i];
+      for (unsigned i = 0; i != NSTAGES; ++i) {
+            stage_nanoseconds[i] -= other.stage_nanoseconds[i];
+            stage_calls[i] -= other.stage_calls[i];
+      }
+      return *this;
+}
+
+/*** Stats ***/
+class Stats {
+      public:
+            /*** Public Methods ***/
+            static void Add(Counter counter, unsigned long long n) {
+#ifndef WAVE_NO_STATS
+                  Local().Add(counter, n);
+#endif
+            }
+
+            static void AddStage(Stage stage, unsigned long long nanoseconds) {
+#ifndef WAVE_NO_STATS
+                  ThreadCounters& local = Local();
+                  local.Add(FIRST_NANOSECONDS + stage, nanoseconds);
+                  local.Add(FIRST_CALLS + stage, 1);
+#endif
+            }
+
+            // Every thread's counters, added up, since the last Reset().
+            static StatsSnapshot Snapshot(void);
+
+            // Adds a stream's block latencies (see realtime.h) to the
+            // process's, and gives back a copy of those (since the last
+            // Reset()). Not for a real-time thread: it locks.
+            static void AddBlockLatencies(LatencyHistogram const& latencies);
+            static LatencyHistogram BlockLatencies(void);
+
+            // Starts the count over, for every thread.
+            static void Reset(void);
+
+      private:
+            // Where each kind of value goes in a thread's counters.
+            static unsigned const FIRST_NANOSECONDS = NCOUNTERS;
+            static unsigned const FIRST_CALLS = FIRST_NANOSECONDS + NSTAGES;
+            static unsigned const NVALUES = FIRST_CALLS + NSTAGES;
+
+            // One thread's counters. Only the thread itself writes them, so
+            // it doesn't need an atomic add; they're atomic so Snapshot() can
+            // read them while the thread's still counting.
+            struct ThreadCounters {
+                  std::atomic<unsigned long long> values[NVALUES];
+
+                  ThreadCounters(void);
+                  ~ThreadCounters(void);
+
+                  void Add(unsigned index, unsigned long long n) {
+                        values[index].store(values[index].load(std::memory_order_relaxed) + n,
+                                            std::memory_order_relaxed);
+                  }
+                  void AddTo(StatsSnapshot& total) const;
+            };
+
+            // Every thread's counters, plus what the threads that have exited
+            // counted, plus the totals as of the last Reset() (which are
+            // subtracted, rather than zeroing counters other threads are
+            // writing).
+            struct Registry {
+                  std::mutex mutex;
+                  std::vector<ThreadCounters*> threads;
+                  StatsSnapshot exited;
+                  StatsSnapshot baseline;
+                  LatencyHistogram block_latencies;
+            };
+
+            static ThreadCounters& Local(void) {
+                  static thread_local ThreadCounters counters;
+                  return counters;
+            }
+
+            // Never destroyed, since threads (e.g., a static thread pool's)
+            // can exit after the static objects are gone.
+            static Registry& GetRegistry(void) {
+                  static Registry* registry = new Registry;
+                  return *registry;
+            }
+
+            static StatsSnapshot Total(Registry& registry);
+};
+
+Stats::ThreadCounters::ThreadCounters(void) {
+      for (unsigned i = 0; i != NVALUES; ++i) values[i].store(0, std::memory_order_relaxed);
+
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.threads.push_back(this);
+}
+
+Stats::ThreadCounters::~ThreadCounters(void) {
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      AddTo(registry.exited);
+      for (unsigned i = 0; i != registry.threads.size(); ++i) {
+            if (registry.threads[i] == this) {
+                  registry.threads.erase(registry.threads.begin() + i);
+                  break;
+            }
+      }
+}
+
+void Stats::ThreadCounters::AddTo(StatsSnapshot& total) const {
+      for (unsigned i = 0; i != NCOUNTERS; ++i) {
+            total.counters[i] += values[i].load(std::memory_order_relaxed);
+      }
+      for (unsigned i = 0; i != NSTAGES; ++i) {
+            total.stage_nanoseconds[i] += values[FIRST_NANOSECONDS + i].load(std::memory_order_relaxed);
+            total.stage_calls[i] += values[FIRST_CALLS + i].load(std::memory_order_relaxed);
+      }
+}
+
+// Call with the registry locked.
+StatsSnapshot Stats::Total(Registry& registry) {
+      StatsSnapshot total = registry.exited;
+      for (unsigned i = 0; i != registry.threads.size(); ++i) registry.threads[i]->AddTo(total);
+      return total;
+}
+
+StatsSnapshot Stats::Snapshot(void) {
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      StatsSnapshot total = Total(registry);
+      total -= registry.baseline;
+      return total;
+}
+
+void Stats::AddBlockLatencies(LatencyHistogram const& latencies) {
+#ifndef WAVE_NO_STATS
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.block_latencies.Add(latencies);
+#endif
+}
+
+LatencyHistogram Stats::BlockLatencies(void) {
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      return registry.block_latencies;
+}
+
+void Stats::Reset(void) {
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.baseline = Total(registry);
+      registry.block_latencies.Clear();
+}
+
+/*** StageTimer ***/
+// Times a stage from construction to destruction.
+class StageTimer {
+      public:
+            /*** Constructors ***/
+            explicit StageTimer(Stage stage) : stage_(stage) {
+#ifndef WAVE_NO_STATS
+                  start_ = std::chrono::steady_clock::now();
+#endif
+            }
+
+            /*** Destructor ***/
+            ~StageTimer(void) {
+#ifndef WAVE_NO_STATS
+                  Stats::AddStage(stage_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start_).count());
+#endif
+            }
+
+      private:
+            StageTimer(StageTimer const&);
+            StageTimer& operator=(StageTimer const&);
+
+            Stage stage_;
+            std::chrono::steady_clock::time_point start_;
+};
+
+#endif
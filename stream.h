@@ -0,0 +1,315 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+/*** Block Streams ***/
+// The Wave class holds a whole file in memory. For long files, or for audio
+// that doesn't come from a file at all, it's better to move samples around a
+// block at a time. A BlockSource produces blocks of sample values (between
+// -1.0 and +1.0, one per frame, like Wave::GetSample()) and a BlockSink
+// consumes them. Pump() connects the two.
+//
+// WaveReader is a BlockSource that reads a .WAV file's data chunk a block at
+// a time, and WaveWriter is a BlockSink that streams straight into a .WAV
+// file, patching up the chunk sizes in the header when it's closed.
+//
+// Example usage:
+//      FmtChunk fmt;
+//      fmt.sample_rate = 44100;
+//      WaveWriter writer;
+//      writer.Open("tone.wav", fmt);
+//      Pump(source, writer);
+//      writer.Close();
+//
+//      WaveReader reader;
+//      reader.Open("in.wav");
+//      writer.Open("copy.wav", reader.fmt_chunk);
+//      Pump(reader, writer);
+
+#include "wave.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class BlockSource {
+      public:
+            virtual ~BlockSource(void) { }
+
+            // Fills "out" with up to "nframes" sample values and returns how
+            // many it filled. Returns 0 once the stream is exhausted.
+            virtual unsigned Read(double* out, unsigned nframes) = 0;
+};
+
+class BlockSink {
+      public:
+            virtual ~BlockSink(void) { }
+
+            // Consumes "nframes" sample values. Returns false if something
+            // went wrong (e.g., the disk filled up).
+            virtual bool Write(double const* samples, unsigned nframes) = 0;
+};
+
+// Moves every block from the source to the sink. Returns the number of frames
+// moved; stops early if the sink fails.
+unsigned long long Pump(BlockSource& source, BlockSink& sink, unsigned block_frames = 4096) {
+      std::vector<double> block(block_frames);
+      unsigned long long total = 0;
+
+      for (;;) {
+            unsigned n = source.Read(&block[0], block_frames);
+            if (!n || !sink.Write(&block[0], n)) break;
+            total += n;
+      }
+
+      return total;
+}
+
+/*** WaveWriter ***/
+class WaveWriter : public BlockSink {
+      public:
+            /*** Constructors ***/
+            WaveWriter(void) : nframes_(0), open_(false) { }
+
+            /*** Public Methods ***/
+            // Creates (or overwrites) the file and writes a header for the
+            // given format. The derived fields (block_align, bytes_per_sec)
+            // are filled in for you.
+            bool Open(std::string const& filename, FmtChunk const& fmt);
+
+            // Encodes and appends sample values, writing the same value to
+            // every channel (like Wave::SetSample()).
+            virtual bool Write(double const* samples, unsigned nframes);
+
+            // Appends frames that are already encoded in this file's format.
+            bool WriteFrames(char const* frames, unsigned nframes);
+
+            // Fills in the chunk sizes and closes the file. Returns false if
+            // anything failed along the way.
+            bool Close(void);
+
+            FmtChunk const& fmt(void) const { return fmt_; }
+            unsigned long long nframes(void) const { return nframes_; }
+
+            /*** Destructor ***/
+            ~WaveWriter(void) { if (open_) Close(); }
+
+            /*** Constants ***/
+            // The data chunk size is 32 bits.
+            static unsigned long long const MAX_DATA_BYTES = 0xfffffffeULL;
+
+      private:
+            WaveWriter(WaveWriter const&);
+            WaveWriter& operator=(WaveWriter const&);
+
+            std::ofstream file_;
+            std::string filename_;
+            FmtChunk fmt_;
+            std::vector<char> encoded_;
+            unsigned long long nframes_;
+            bool open_;
+};
+
+bool WaveWriter::Open(std::string const& filename, FmtChunk const& fmt) {
+      if (open_) Close();
+
+      fmt_ = fmt;
+      fmt_.block_align = fmt_.nchannels * (fmt_.bits_per_sample/8);
+      fmt_.bytes_per_sec = fmt_.sample_rate * fmt_.block_align;
+      filename_ = filename;
+      nframes_ = 0;
+
+      file_.clear();
+      file_.open(filename.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+      if (!file_.good()) {
+            std::cerr << "Error: I can't open " << filename << " for writing!" << std::endl;
+            return false;
+      }
+      open_ = true;
+
+      // The sizes get patched up in Close().
+      RiffChunk riff_chunk;
+      DataChunk data_chunk;
+      riff_chunk.WriteTo(file_);
+      fmt_.WriteTo(file_);
+      data_chunk.WriteTo(file_);
+
+      return file_.good();
+}
+
+bool WaveWriter::Write(double const* samples, unsigned nframes) {
+      if (!nframes) return open_;
+      if (encoded_.size() < (size_t)nframes * fmt_.block_align) {
+            encoded_.resize((size_t)nframes * fmt_.block_align);
+      }
+      Wave::EncodeSamples(fmt_, samples, nframes, &encoded_[0]);
+      return WriteFrames(&encoded_[0], nframes);
+}
+
+bool WaveWriter::WriteFrames(char const* frames, unsigned nframes) {
+      if (!open_) return false;
+      TraceSpan span("write", "io");
+
+      if ((nframes_ + nframes) * fmt_.block_align > MAX_DATA_BYTES) {
+            std::cerr << "Error: " << filename_ << " is too big for a WAV file!" << std::endl;
+            return false;
+      }
+
+      file_.write(frames, (std::streamsize)nframes * fmt_.block_align);
+      nframes_ += nframes;
+      if (!file_.good()) return false;
+      Stats::Add(COUNTER_BYTES_WRITTEN, (unsigned long long)nframes * fmt_.block_align);
+      return true;
+}
+
+bool WaveWriter::Close(void) {
+      if (!open_) return false;
+      open_ = false;
+
+      unsigned data_size = nframes_ * fmt_.block_align;
+      if (data_size % 2) file_.put(0);
+
+      // RIFF size: the "WAVE" type, plus the fmt and data chunks with their
+      // 8-byte headers (and the data chunk's pad byte).
+      uint32_t riff_size = 4 + (8 + fmt_.chunk_size) + (8 + data_size + data_size % 2);
+      uint32_t data_size_offset = 12 + 8 + fmt_.chunk_size + 4;
+
+      file_.seekp(4);
+      WriteLittleEndian(file_, riff_size);
+      file_.seekp(data_size_offset);
+      WriteLittleEndian(file_, data_size);
+
+      file_.close();
+      return !file_.fail();
+}
+
+/*** WaveReader ***/
+class WaveReader : public BlockSource {
+      public:
+            /*** Public Data ***/
+            // Everything but the data chunk, just like Wave::LoadMetadata().
+            FmtChunk fmt_chunk;
+            std::vector<DataChunk> other_chunks;
+
+            /*** Constructors ***/
+            WaveReader(void) : data_offset_(0), nframes_(0), position_(0) { }
+
+            /*** Public Methods ***/
+            // Reads the headers and every chunk but the data chunk, leaving
+            // us at the first frame. Fails (and prints out some messages) if
+            // the file doesn't exist or isn't a WAV file.
+            bool Open(std::string const& filename);
+
+            // Decodes up to "nframes" frames, averaging the channels (like
+            // Wave::GetSample()).
+            virtual unsigned Read(double* out, unsigned nframes);
+
+            // Reads up to "nframes" raw frames in the file's own format.
+            unsigned ReadFrames(char* frames, unsigned nframes);
+
+            // Jumps to a frame. Sequential reads are faster.
+            bool Seek(unsigned frame);
+
+            unsigned nframes(void) const { return nframes_; }
+            unsigned position(void) const { return position_; }
+
+      private:
+            WaveReader(WaveReader const&);
+            WaveReader& operator=(WaveReader const&);
+
+            std::ifstream file_;
+            unsigned long long data_offset_;
+            unsigned nframes_;
+            unsigned position_;
+            std::vector<char> raw_;
+};
+
+bool WaveReader::Open(std::string const& filename) {
+      file_.close();
+      file_.clear();
+      other_chunks.clear();
+      data_offset_ = 0;
+      nframes_ = position_ = 0;
+
+      file_.open(filename.c_str(), std::ios_base::binary | std::ios_base::in);
+      if (!file_.good()) {
+            std::cerr << "Error: I can't open " << filename << "!" << std::endl;
+            return false;
+      }
+
+      uint32_t chunk_type;
+      RiffChunk riff_chunk;
+      ReadLittleEndian(file_, chunk_type);
+      if (chunk_type == Chunk::CHUNK_TYPE_RIFF) riff_chunk.ReadFrom(file_);
+
+      if (chunk_type != Chunk::CHUNK_TYPE_RIFF 
+                  || riff_chunk.riff_type != RiffChunk::RIFF_TYPE_WAVE || !file_.good()) {
+            std::cerr << "Error: " << filename << " doesn't appear to be a WAV file!" 
+                      << std::endl;
+            return false;
+      }
+
+      // Same walk as Wave::Load(), except we remember where the data chunk
+      // is instead of reading it.
+      uint32_t data_size = 0;
+      bool found_data = false;
+      while (file_.good()) {
+            ReadLittleEndian(file_, chunk_type);
+            if (!file_.good()) break;
+
+            if (chunk_type == Chunk::CHUNK_TYPE_FMT) {
+                  fmt_chunk.ReadFrom(file_);
+                  if (!fmt_chunk.Check(filename)) return false;
+            } else if (chunk_type == Chunk::CHUNK_TYPE_DATA && !found_data) {
+                  ReadLittleEndian(file_, data_size);
+                  data_offset_ = file_.tellg();
+                  found_data = true;
+                  file_.seekg(data_size + data_size % 2, std::ios_base::cur);
+            } else {
+                  DataChunk chunk(chunk_type);
+                  chunk.ReadFrom(file_);
+                  other_chunks.push_back(chunk);
+            }
+      }
+
+      if (!found_data) {
+            std::cerr << "Error: " << filename << " doesn't have any data!" << std::endl;
+            return false;
+      }
+
+      if (fmt_chunk.block_align) nframes_ = data_size / fmt_chunk.block_align;
+
+      file_.clear();
+      return Seek(0);
+}
+
+unsigned WaveReader::Read(double* out, unsigned nframes) {
+      if (!nframes) return 0;
+      if (raw_.size() < (size_t)nframes * fmt_chunk.block_align) {
+            raw_.resize((size_t)nframes * fmt_chunk.block_align);
+      }
+      unsigned n = ReadFrames(&raw_[0], nframes);
+      Wave::DecodeSamples(fmt_chunk, &raw_[0], n, out);
+      return n;
+}
+
+unsigned WaveReader::ReadFrames(char* frames, unsigned nframes) {
+      nframes = std::min(nframes, nframes_ - position_);
+      if (!nframes) return 0;
+      TraceSpan span("read", "io");
+
+      file_.read(frames, (std::streamsize)nframes * fmt_chunk.block_align);
+      Stats::Add(COUNTER_BYTES_READ, file_.gcount());
+      unsigned n = file_.gcount() / fmt_chunk.block_align;
+      position_ += n;
+      return n;
+}
+
+bool WaveReader::Seek(unsigned frame) {
+      if (frame > nframes_) return false;
+      file_.clear();
+      file_.seekg(data_offset_ + (unsigned long long)frame * fmt_chunk.block_align);
+      position_ = frame;
+      return file_.good();
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+/*** Thread Pool ***/
+// A fixed set of worker threads that everything parallel in the library
+// shares. By default there's one worker per core.
+//
+// Each worker has its own deque of tasks. A task submitted from inside
+// another task goes on the front of the submitting worker's deque, and the
+// worker takes its own tasks newest first (so nested work stays hot in its
+// cache). A worker that runs out steals the oldest task from another
+// worker's deque, which tends to be the biggest piece left. Tasks submitted
+// from outside the pool go on a shared queue.
+//
+// A task is charged for its allocations to whichever account (see alloc.h)
+// was current where it was submitted.
+//
+// Nesting is what makes one pool enough: a batch of files runs as tasks, and
+// each file can split its own work into more tasks (with a TaskGroup or
+// ParallelFor()) on the same workers instead of starting more threads. A
+// worker waiting on a TaskGroup runs other tasks in the meantime rather than
+// blocking, so nesting can't deadlock the pool.
+//
+// Example usage:
+//      ThreadPool& pool = ThreadPool::Shared();
+//      TaskGroup files(pool);
+//      for (unsigned i = 0; i != filenames.size(); ++i) {
+//            files.Run([&, i]() { Process(filenames[i]); });
+//      }
+//      files.Wait();
+//
+//      // Inside Process(), say:
+//      ParallelFor(pool, 0, nframes, 65536, [&](unsigned begin, unsigned end) {
+//            for (unsigned i = begin; i != end; ++i) samples[i] *= 0.5;
+//      });
+
+#include "alloc.h"
+#include "numa.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+class ThreadPool {
+      public:
+            /*** Constructors ***/
+            // Zero threads means one per core. With "pin," each worker stays
+            // on one CPU, taking CPUs from each NUMA node in turn (see
+            // numa.h), so the memory a worker first touches stays on its
+            // node, and the workers share out every node's bandwidth.
+            explicit ThreadPool(unsigned nthreads = 0, bool pin = false);
+
+            /*** Public Methods ***/
+            // The pool shared by the whole process. The first call creates it
+            // with "nthreads" workers (zero means one per core), pinned or
+            // not; after that the arguments are ignored.
+            static ThreadPool& Shared(unsigned nthreads = 0, bool pin = false) {
+                  static ThreadPool pool(nthreads, pin);
+                  return pool;
+            }
+
+            void Submit(std::function<void()> const& task) { Submit(task, NULL); }
+
+            // Blocks until every task submitted so far has finished. Don't
+            // call this from inside a task (it would wait for itself); use a
+            // TaskGroup instead.
+            void Wait(void);
+
+            // Runs one queued task on the calling thread, if there is one.
+            // Returns false if there wasn't.
+            bool RunPendingTask(void);
+
+            unsigned size(void) const { return threads_.size(); }
+
+            // True if the calling thread is one of this pool's workers.
+            bool InWorker(void) const { return current_pool_ == this; }
+
+            /*** Destructor ***/
+            // Finishes the queued tasks, then stops the workers.
+            ~ThreadPool(void);
+
+      private:
+            friend class TaskGroup;
+
+            ThreadPool(ThreadPool const&);
+            ThreadPool& operator=(ThreadPool const&);
+
+            struct Task {
+                  std::function<void()> run;
+                  TaskGroup* group;
+                  AllocationAccount* account;
+            };
+
+            // One per worker, plus the shared queue for tasks from outside.
+            // The locks are only ever held for a push or a pop.
+            struct Queue {
+                  std::mutex mutex;
+                  std::deque<Task> tasks;
+            };
+
+            void Submit(std::function<void()> const& task, TaskGroup* group);
+            bool RunTask(bool from_outside);
+            bool TakeTask(Task& task, bool from_outside);
+            void Finish(Task const& task);
+            void Work(unsigned index);
+
+            std::vector<std::thread> threads_;
+            std::vector<std::unique_ptr<Queue> > queues_;
+
+            // Worker i's CPU is cpus_[i % cpus_.size()], if pinned.
+            std::vector<unsigned> cpus_;
+            Queue injected_;
+
+            // Tasks waiting in a queue, tasks not finished yet and workers
+            // asleep (in Work() or TaskGroup::Wait()). "queued_" and
+            // "sleeping_" are how a submitter knows whether it has to wake
+            // anybody up. "submitted_" counts every task ever submitted, so a
+            // TaskGroup waiting in a worker can tell whether there might be
+            // something new for it to help with.
+            std::atomic<unsigned> queued_;
+            std::atomic<unsigned> unfinished_;
+            std::atomic<unsigned> sleeping_;
+            std::atomic<unsigned> submitted_;
+
+            std::mutex mutex_;
+            std::condition_variable task_ready_;
+            std::condition_variable task_done_;
+            bool stopping_;
+
+            // Which pool (and which worker of it) the calling thread is.
+            static thread_local ThreadPool* current_pool_;
+            static thread_local unsigned current_index_;
+};
+
+thread_local ThreadPool* ThreadPool::current_pool_ = NULL;
+thread_local unsigned ThreadPool::current_index_ = 0;
+
+/*** TaskGroup ***/
+// A set of tasks that can be waited on together, from anywhere (including
+// from inside another task).
+class TaskGroup {
+      public:
+            /*** Constructors ***/
+            explicit TaskGroup(ThreadPool& pool) : pool_(pool), unfinished_(0) { }
+
+            /*** Public Methods ***/
+            void Run(std::function<void()> const& task) {
+                  ++unfinished_;
+                  pool_.Submit(task, this);
+            }
+
+            // Blocks until every task run in this group has finished. A
+            // worker thread keeps running other tasks while it waits.
+            void Wait(void);
+
+            /*** Destructor ***/
+            ~TaskGroup(void) { Wait(); }
+
+      private:
+            friend class ThreadPool;
+
+            TaskGroup(TaskGroup const&);
+            TaskGroup& operator=(TaskGroup const&);
+
+            ThreadPool& pool_;
+            std::atomic<unsigned> unfinished_;
+};
+
+ThreadPool::ThreadPool(unsigned nthreads, bool pin)
+      : queued_(0), unfinished_(0), sleeping_(0), submitted_(0), stopping_(false) {
+      if (!nthreads) nthreads = std::max(1u, std::thread::hardware_concurrency());
+      if (pin) cpus_ = NumaTopology::Get().SpreadCpus();
+      for (unsigned i = 0; i != nthreads; ++i) {
+            queues_.push_back(std::unique_ptr<Queue>(new Queue));
+      }
+      for (unsigned i = 0; i != nthreads; ++i) {
+            threads_.push_back(std::thread(&ThreadPool::Work, this, i));
+      }
+}
+
+ThreadPool::~ThreadPool(void) {
+      Wait();
+      {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+      }
+      task_ready_.notify_all();
+      for (unsigned i = 0; i != threads_.size(); ++i) threads_[i].join();
+}
+
+void ThreadPool::Submit(std::function<void()> const& run, TaskGroup* group) {
+      Task task = { run, group, AllocationAccount::Current() };
+      if (task.account) task.account->Retain();
+      ++unfinished_;
+
+      // The worker side bumps "sleeping_" before it checks "queued_", and we
+      // bump "queued_" before we check "sleeping_", so one of us always sees
+      // the other.
+      ++queued_;
+
+      Queue& queue = InWorker() ? *queues_[current_index_] : injected_;
+      {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_front(task);
+      }
+      ++submitted_;
+
+      // A worker waiting on a TaskGroup sleeps on "task_done_" rather than
+      // "task_ready_", and might be able to run this.
+      if (sleeping_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ready_.notify_one();
+            task_done_.notify_all();
+      }
+}
+
+void ThreadPool::Wait(void) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_done_.wait(lock, [this]() { return unfinished_ == 0; });
+}
+
+bool ThreadPool::RunPendingTask(void) {
+      return RunTask(true);
+}
+
+bool ThreadPool::RunTask(bool from_outside) {
+      Task task;
+      if (!TakeTask(task, from_outside)) return false;
+      {
+            TraceSpan span("task", "pool");
+            AllocationScope scope(task.account);
+            task.run();
+      }
+      if (task.account) task.account->Release();
+      Finish(task);
+      return true;
+}
+
+// Our own newest task first, then the oldest task from outside (unless
+// "from_outside" is false), then the oldest task of whichever other worker has
+// one.
+bool ThreadPool::TakeTask(Task& task, bool from_outside) {
+      unsigned nqueues = queues_.size();
+      unsigned self = InWorker() ? current_index_ : nqueues;
+
+      if (self != nqueues) {
+            Queue& queue = *queues_[self];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                  task = queue.tasks.front();
+                  queue.tasks.pop_front();
+                  --queued_;
+                  return true;
+            }
+      }
+
+      if (from_outside) {
+            std::lock_guard<std::mutex> lock(injected_.mutex);
+            if (!injected_.tasks.empty()) {
+                  task = injected_.tasks.back();
+                  injected_.tasks.pop_back();
+                  --queued_;
+                  return true;
+            }
+      }
+
+      for (unsigned i = 1; i <= nqueues; ++i) {
+            unsigned victim = (self + i) % nqueues;
+            if (victim == self) continue;
+
+            Queue& queue = *queues_[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                  task = queue.tasks.back();
+                  queue.tasks.pop_back();
+                  --queued_;
+                  return true;
+            }
+      }
+
+      return false;
+}
+
+void ThreadPool::Finish(Task const& task) {
+      bool group_done = task.group && --task.group->unfinished_ == 0;
+      bool all_done = --unfinished_ == 0;
+      if (group_done || all_done) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_done_.notify_all();
+      }
+}
+
+void ThreadPool::Work(unsigned index) {
+      current_pool_ = this;
+      current_index_ = index;
+      if (!cpus_.empty()) PinThread(cpus_[index % cpus_.size()]);
+      Trace::NameThread("pool worker " + std::to_string(index));
+
+      for (;;) {
+            if (RunPendingTask()) continue;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            ++sleeping_;
+            task_ready_.wait(lock, [this]() { return stopping_ || queued_ != 0; });
+            --sleeping_;
+            if (stopping_ && queued_ == 0) return;
+      }
+}
+
+void TaskGroup::Wait(void) {
+      if (!pool_.InWorker()) {
+            TraceSpan span("wait for tasks", "wait");
+            std::unique_lock<std::mutex> lock(pool_.mutex_);
+            pool_.task_done_.wait(lock, [this]() { return unfinished_ == 0; });
+            return;
+      }
+
+      // Help out until our tasks are done. If there's nothing to run, the
+      // rest of them are already running on other workers. We only help with
+      // nested tasks: starting a whole new job from the outside queue could
+      // keep this one waiting for as long as that takes. After a few tries
+      // with nothing to steal, sleep until either our tasks are done or
+      // somebody submits another task (which might be one we can run).
+      unsigned const spins = 64;
+      for (unsigned misses = 0; unfinished_ != 0; ) {
+            unsigned submitted = pool_.submitted_;
+            if (pool_.RunTask(false)) {
+                  misses = 0;
+            } else if (++misses < spins) {
+                  std::this_thread::yield();
+            } else {
+                  TraceSpan span("wait for tasks", "wait");
+                  std::unique_lock<std::mutex> lock(pool_.mutex_);
+                  ++pool_.sleeping_;
+                  pool_.task_done_.wait(lock, [&]() { return unfinished_ == 0 || pool_.submitted_ != submitted; });
+                  --pool_.sleeping_;
+                  misses = 0;
+            }
+      }
+}
+
+// Calls body(begin, end) on consecutive ranges covering [first, last), in
+// parallel on "pool". Ranges are at least "grain" long (except the last), and
+// there are never many more of them than workers. The calling thread does a
+// share of the work itself.
+template <class Body>
+void ParallelFor(ThreadPool& pool, unsigned first, unsigned last, unsigned grain, Body const& body) {
+      if (first >= last) return;
+      unsigned length = last - first;
+      grain = std::max(1u, grain);
+
+      unsigned nranges = std::min((length + grain - 1) / grain, 4 * pool.size());
+      if (nranges <= 1) {
+            body(first, last);
+            return;
+      }
+
+      unsigned range_length = (length + nranges - 1) / nranges;
+      TaskGroup group(pool);
+      for (unsigned begin = first + range_length; begin < last; begin += range_length) {
+            unsigned end = std::min(last, begin + range_length);
+            group.Run([&body, begin, end]() { body(begin, end); });
+      }
+      body(first, std::min(last, first + range_length));
+      group.Wait();
+}
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*** Trace Recorder ***/
+// Records what each thread was doing and when (reading a block, decoding,
+// running an effect, encoding, writing, waiting on a queue...) and writes it
+// out in the Chrome trace event format, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) can both show as a timeline per thread. Where the
+// counters in stats.h say how much time went where, a trace shows when: a
+// pipeline stage starved for blocks, or a pool worker with nothing to do.
+//
+// Nothing's recorded until Trace::Start() is called. After that, each span
+// costs two clock reads and a store into the calling thread's own buffer,
+// with no locking: a thread's buffer is a list of fixed-size pieces that
+// only that thread appends to, publishing each event with a release store,
+// so Trace::Write() can read every buffer while the threads keep going. A
+// thread keeps at most MAX_EVENTS events; after that, its spans are dropped
+// (and counted).
+//
+// Defining WAVE_NO_TRACE compiles all of this away.
+//
+// Example usage:
+//      Trace::Start();
+//      {
+//            TraceSpan span("decode", "convert");
+//            Decode();
+//      }
+//      Trace::Write("trace.json");
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class Trace {
+      public:
+            /*** Public Methods ***/
+            // Starts (or restarts) recording. Timestamps count from the first
+            // Start().
+            static void Start(void);
+
+            // Stops recording. What's been recorded is kept for Write().
+            static void Stop(void) { Enabled().store(false, std::memory_order_relaxed); }
+
+            static bool recording(void) {
+#ifndef WAVE_NO_TRACE
+                  return Enabled().load(std::memory_order_acquire);
+#else
+                  return false;
+#endif
+            }
+
+            // Nanoseconds since the first Start().
+            static unsigned long long Now(void);
+
+            // Records a span that's already over (for spans that might not
+            // be worth keeping until they're done, like a wait that didn't
+            // have to wait). "name" and "category" must be string literals
+            // (or otherwise outlive the recorder).
+            static void Record(char const* name, char const* category,
+                               unsigned long long start, unsigned long long end);
+
+            // Names the calling thread in the trace (e.g., "reader").
+            static void NameThread(std::string const& name);
+
+            // Writes every thread's events (so far) as Chrome trace JSON.
+            // Fails (and prints out some messages) if the file can't be
+            // written.
+            static bool Write(std::string const& filename);
+
+            /*** Constants ***/
+            static unsigned const EVENTS_PER_PIECE = 4096;
+            static unsigned const MAX_EVENTS = 1 << 20;
+
+      private:
+            struct Event {
+                  char const* name;
+                  char const* category;
+                  unsigned long long start;
+                  unsigned long long end;
+            };
+
+            struct Piece {
+                  Event events[EVENTS_PER_PIECE];
+                  std::atomic<unsigned> nevents;
+                  std::atomic<Piece*> next;
+
+                  Piece(void) : nevents(0), next(NULL) { }
+            };
+
+            // One thread's events. Owned by the registry, not the thread, so
+            // they're still there to write after the thread exits.
+            struct Buffer {
+                  long tid;
+                  std::string name;
+                  Piece* first;
+                  Piece* last;
+                  unsigned nevents;
+                  std::atomic<unsigned long long> ndropped;
+
+                  Buffer(void) : tid(syscall(SYS_gettid)), first(new Piece), last(first), nevents(0), ndropped(0) { }
+            };
+
+            struct Registry {
+                  std::mutex mutex;
+                  std::vector<Buffer*> buffers;
+                  std::chrono::steady_clock::time_point epoch;
+                  bool started;
+
+                  Registry(void) : started(false) { }
+            };
+
+            static std::atomic<bool>& Enabled(void) {
+                  static std::atomic<bool> enabled(false);
+                  return enabled;
+            }
+
+            // Never destroyed, since threads can still be recording while
+            // the static objects go away.
+            static Registry& GetRegistry(void) {
+                  static Registry* registry = new Registry;
+                  return *registry;
+            }
+
+            static Buffer& Local(void);
+            static void WriteString(std::ostream& stream, std::string const& text);
+            static void WriteMicroseconds(std::ostream& stream, unsigned long long nanoseconds);
+};
+
+void Trace::Start(void) {
+      Registry& registry = GetRegistry();
+      {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            if (!registry.started) {
+                  registry.epoch = std::chrono::steady_clock::now();
+                  registry.started = true;
+            }
+      }
+      // Release, so a thread that sees we're recording sees the epoch too.
+      Enabled().store(true, std::memory_order_release);
+}
+
+unsigned long long Trace::Now(void) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - GetRegistry().epoch).count();
+}
+
+Trace::Buffer& Trace::Local(void) {
+      static thread_local Buffer* buffer = NULL;
+      if (!buffer) {
+            buffer = new Buffer;
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.buffers.push_back(buffer);
+      }
+      return *buffer;
+}
+
+void Trace::Record(char const* name, char const* category,
+                   unsigned long long start, unsigned long long end) {
+#ifndef WAVE_NO_TRACE
+      if (!recording()) return;
+
+      Buffer& buffer = Local();
+      if (buffer.nevents == MAX_EVENTS) {
+            buffer.ndropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+      }
+
+      Piece* piece = buffer.last;
+      unsigned n = piece->nevents.load(std::memory_order_relaxed);
+      if (n == EVENTS_PER_PIECE) {
+            piece = new Piece;
+            buffer.last->next.store(piece, std::memory_order_release);
+            buffer.last = piece;
+            n = 0;
+      }
+
+      Event& event = piece->events[n];
+      event.name = name;
+      event.category = category;
+      event.start = start;
+      event.end = end;
+      piece->nevents.store(n + 1, std::memory_order_release);
+      ++buffer.nevents;
+#endif
+}
+
+void Trace::NameThread(std::string const& name) {
+#ifndef WAVE_NO_TRACE
+      Buffer& buffer = Local();
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      buffer.name = name;
+#endif
+}
+
+bool Trace::Write(std::string const& filename) {
+      std::ofstream file(filename.c_str());
+      if (!file.good()) {
+            std::cerr << "Error: I can't open " << filename << " for writing!" << std::endl;
+            return false;
+      }
+
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      long pid = getpid();
+      unsigned long long ndropped = 0;
+
+      file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+      char const* separator = "\n";
+      for (unsigned i = 0; i != registry.buffers.size(); ++i) {
+            Buffer const& buffer = *registry.buffers[i];
+            ndropped += buffer.ndropped.load(std::memory_order_relaxed);
+
+            if (!buffer.name.empty()) {
+                  file << separator << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+                       << ",\"tid\":" << buffer.tid << ",\"args\":{\"name\":";
+                  WriteString(file, buffer.name);
+                  file << "}}";
+                  separator = ",\n";
+            }
+
+            for (Piece const* piece = buffer.first; piece; piece = piece->next.load(std::memory_order_acquire)) {
+                  unsigned n = piece->nevents.load(std::memory_order_acquire);
+                  for (unsigned j = 0; j != n; ++j) {
+                        Event const& event = piece->events[j];
+                        file << separator << "{\"ph\":\"X\",\"name\":";
+                        WriteString(file, event.name);
+                        file << ",\"cat\":";
+                        WriteString(file, event.category);
+                        file << ",\"pid\":" << pid << ",\"tid\":" << buffer.tid
+                             << ",\"ts\":";
+                        WriteMicroseconds(file, event.start);
+                        file << ",\"dur\":";
+                        WriteMicroseconds(file, event.end - event.start);
+                        file << "}";
+                        separator = ",\n";
+                  }
+            }
+      }
+      file << "\n]}" << std::endl;
+
+      if (ndropped) {
+            std::cerr << "Warning: the trace is missing " << ndropped
+                      << " spans (a thread filled its buffer)." << std::endl;
+      }
+      if (!file.good()) {
+            std::cerr << "Error: I can't write the trace to " << filename << "!" << std::endl;
+            return false;
+      }
+      return true;
+}
+
+void Trace::WriteString(std::ostream& stream, std::string const& text) {
+      stream << '"';
+      for (unsigned i = 0; i != text.size(); ++i) {
+            if (text[i] == '"' || text[i] == '\\') stream << '\\';
+            if ((unsigned char)text[i] >= 0x20) stream << text[i];
+      }
+      stream << '"';
+}
+
+// Chrome wants microseconds; the fraction keeps the nanoseconds.
+void Trace::WriteMicroseconds(std::ostream& stream, unsigned long long nanoseconds) {
+      unsigned fraction = nanoseconds % 1000;
+      stream << nanoseconds / 1000 << "." << fraction / 100 << fraction / 10 % 10 << fraction % 10;
+}
+
+/*** TraceSpan ***/
+// Records a span from construction to destruction, if the recorder's on.
+class TraceSpan {
+      public:
+            /*** Constructors ***/
+            TraceSpan(char const* name, char const* category)
+                  : name_(name), category_(category), recording_(Trace::recording()),
+                    start_(recording_ ? Trace::Now() : 0) { }
+
+            /*** Destructor ***/
+            ~TraceSpan(void) {
+                  if (recording_) Trace::Record(name_, category_, start_, Trace::Now());
+            }
+
+      private:
+            TraceSpan(TraceSpan const&);
+            TraceSpan& operator=(TraceSpan const&);
+
+            char const* name_;
+            char const* category_;
+            bool recording_;
+            unsigned long long start_;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+/*** Directory Watcher ***/
+// Tells you when new .WAV files show up in a directory, as soon as they're
+// complete, without rescanning it. It's built on inotify: a file counts as
+// new when whoever was writing it closes it, or when it's renamed (or moved)
+// into the directory, which is how careful writers publish a finished file.
+// Hidden files (starting with '.') are ignored, since that's where writers
+// tend to keep their partial ones.
+//
+// Example usage:
+//      DirectoryWatcher watcher;
+//      watcher.Open("incoming");
+//      std::vector<std::string> names;
+//      while (watcher.Next(names)) {
+//            for (unsigned i = 0; i != names.size(); ++i) Process("incoming/" + names[i]);
+//      }
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class DirectoryWatcher {
+      public:
+            /*** Constructors ***/
+            DirectoryWatcher(void) : fd_(-1) { }
+
+            /*** Public Methods ***/
+            // Starts watching. Fails (and prints out some messages) if the
+            // directory can't be watched.
+            bool Open(std::string const& directory);
+
+            // Waits for at least one new .WAV file and gives back the names
+            // (not paths) of every one that's turned up. If so many turn up
+            // at once that the kernel drops some of the news, we give back
+            // everything in the directory instead. Returns false if the
+            // watch stops working (e.g., the directory went away).
+            bool Next(std::vector<std::string>& names);
+
+            // The .WAV files already in the directory, for catching up on
+            // what arrived while nobody was watching.
+            std::vector<std::string> Existing(void) const;
+
+            // True for "something.wav" (any case), but not hidden files.
+            static bool IsWavName(std::string const& name);
+
+            // True if "output" doesn't exist or is older than "input" (like
+            // make decides what to rebuild).
+            static bool IsOutOfDate(std::string const& input, std::string const& output);
+
+            /*** Destructor ***/
+            ~DirectoryWatcher(void) { if (fd_ >= 0) close(fd_); }
+
+      private:
+            DirectoryWatcher(DirectoryWatcher const&);
+            DirectoryWatcher& operator=(DirectoryWatcher const&);
+
+            std::string directory_;
+            int fd_;
+};
+
+bool DirectoryWatcher::Open(std::string const& directory) {
+      if (fd_ >= 0) close(fd_);
+      directory_ = directory;
+
+      fd_ = inotify_init1(IN_CLOEXEC);
+      if (fd_ < 0 || inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+            std::cerr << "Error: I can't watch " << directory << "!" << std::endl;
+            return false;
+      }
+      return true;
+}
+
+bool DirectoryWatcher::Next(std::vector<std::string>& names) {
+      names.clear();
+
+      // Big enough for plenty of events at once (each is a header plus a
+      // name of up to NAME_MAX bytes).
+      alignas(inotify_event) char buffer[64 * (sizeof(inotify_event) + 256)];
+      while (names.empty()) {
+            ssize_t length = read(fd_, buffer, sizeof(buffer));
+            if (length < 0 && errno == EINTR) continue;
+            if (length <= 0) return false;
+
+            for (ssize_t offset = 0; offset < length; ) {
+                  inotify_event const* event = (inotify_event const*)(buffer + offset);
+                  offset += sizeof(inotify_event) + event->len;
+
+                  if (event->mask & IN_IGNORED) return false;
+                  if (event->mask & IN_Q_OVERFLOW) {
+                        std::vector<std::string> existing = Existing();
+                        names.insert(names.end(), existing.begin(), existing.end());
+                  }
+                  if (event->len && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                              && IsWavName(event->name)) {
+                        names.push_back(event->name);
+                  }
+            }
+      }
+      return true;
+}
+
+std::vector<std::string> DirectoryWatcher::Existing(void) const {
+      std::vector<std::string> names;
+      DIR* dir = opendir(directory_.c_str());
+      if (!dir) return names;
+
+      while (dirent* entry = readdir(dir)) {
+            if (IsWavName(entry->d_name)) names.push_back(entry->d_name);
+      }
+      closedir(dir);
+      return names;
+}
+
+bool DirectoryWatcher::IsWavName(std::string const& name) {
+      if (name.size() <= 4 || name[0] == '.') return false;
+      return strcasecmp(name.c_str() + name.size() - 4, ".wav") == 0;
+}
+
+bool DirectoryWatcher::IsOutOfDate(std::string const& input, std::string const& output) {
+      struct stat in, out;
+      if (stat(input.c_str(), &in) != 0) return false;
+      if (stat(output.c_str(), &out) != 0) return true;
+
+      if (in.st_mtim.tv_sec != out.st_mtim.tv_sec) return in.st_mtim.tv_sec > out.st_mtim.tv_sec;
+      return in.st_mtim.tv_nsec > out.st_mtim.tv_nsec;
+}
+
+#endif
@@ -1,21 +1,58 @@
 // This file contains various example Wave-file manipulation functions using
-// the wave.h API with a simple, interactive user interface.
+// the wave.h API with a simple, interactive user interface. The same
+// operations can be run straight from the command line, or in bulk from a job
+// list (see main() below).
+
+// Jobs report their memory (see alloc.h).
+#define WAVE_ALLOC_STATS
 
 #include "wave.h"
+#include "alloc.h"
+#include "budget.h"
+#include "daemon.h"
+#include "fingerprint.h"
+#include "generators.h"
+#include "kernels.h"
+#include "mixer.h"
+#include "pipeline.h"
+#include "pitch.h"
+#include "realtime.h"
+#include "regions.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "watch.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <string>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
 
 using namespace std;
 
 // Functions for manipulating .WAV files. See below for more details.
 double* WavLoad(string const& filename);
 int WavLength(string const& filename);
-void WavSave(string const& filename, double const* samples, int nsamples);
+bool WavSave(string const& filename, double const* samples, int nsamples);
+FmtChunk WavFormat(string const& filename);
 
 // Speed it up by dropping every other sample.
-void faster(string const& filename, string const& result) {
+bool faster(string const& filename, string const& result) {
       int old_samples_length = WavLength(filename);
       double* old_samples = WavLoad(filename);
+      if (!old_samples) return false;
 
       int new_samples_length = old_samples_length / 2;
       double* new_samples = new double[new_samples_length];
@@ -24,16 +61,19 @@ void faster(string const& filename, string const& result) {
             new_samples[i] = old_samples[i*2];
       }
 
-      WavSave(result, new_samples, new_samples_length);
+      bool saved = WavSave(result, new_samples, new_samples_length);
 
       delete[] new_samples;
       delete[] old_samples;
+
+      return saved;
 }
 
 // Slow it down by duplicating every other sample.
-void slower(string const& filename, string const& result) {
+bool slower(string const& filename, string const& result) {
       int old_samples_length = WavLength(filename);
       double* old_samples = WavLoad(filename);
+      if (!old_samples) return false;
 
       int new_samples_length = old_samples_length * 2;
       double* new_samples = new double[new_samples_length];
@@ -42,16 +82,19 @@ void slower(string const& filename, string const& result) {
             new_samples[i] = old_samples[i/2];
       }
 
-      WavSave(result, new_samples, new_samples_length);
+      bool saved = WavSave(result, new_samples, new_samples_length);
 
       delete[] new_samples;
       delete[] old_samples;
+
+      return saved;
 }
 
 // Create an echo effect by adding samples back in after a delay.
-void echo(string const& filename, string const& result) {
+bool echo(string const& filename, string const& result) {
       int old_samples_length = WavLength(filename);
       double* old_samples = WavLoad(filename);
+      if (!old_samples) return false;
 
       // Number of samples before the echo.
       int echo_delay = 10000;
@@ -87,48 +130,192 @@ void echo(string const& filename, string const& result) {
             }
       }
 
-      WavSave(result, new_samples, new_samples_length);
+      bool saved = WavSave(result, new_samples, new_samples_length);
 
       delete[] new_samples;
       delete[] old_samples;
+
+      return saved;
+}
+
+// The streaming examples write "<result>.part" and rename it into place at the
+// end, so it's safe for "result" to be the input file. Closes the writer and
+// does the rename, or cleans up if anything ("ok" included) failed.
+bool finish_partial(WaveWriter& writer, bool ok, string const& result) {
+      string partial = result + ".part";
+      if (!writer.Close() || !ok || rename(partial.c_str(), result.c_str()) != 0) {
+            cerr << "Error: I can't write " << result << "!" << endl;
+            remove(partial.c_str());
+            return false;
+      }
+      return true;
+}
+
+// Scale every sample by "factor". Unlike the other examples, this streams the
+// file through a read/scale/write pipeline (see pipeline.h) instead of
+// loading it all, so the reading, scaling and writing overlap.
+bool amplify(string const& filename, string const& result, double factor) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
+
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      Pipeline pipeline;
+      bool ok = pipeline.Run(reader, [factor](double* samples, unsigned nframes, unsigned long long) {
+            for (unsigned i = 0; i != nframes; ++i) samples[i] *= factor;
+      }, writer);
+
+      return finish_partial(writer, ok, result);
 }
 
 // Increase the volume (amplitude) by 20%.
-void amp_up(string const& filename, string const& result) {
-      int old_samples_length = WavLength(filename);
-      double* old_samples = WavLoad(filename);
+bool amp_up(string const& filename, string const& result) {
+      return amplify(filename, result, 1.2);
+}
 
-      double factor = 1.2;
+// Decrease the volume (amplitude) by 20%.
+bool amp_down(string const& filename, string const& result) {
+      return amplify(filename, result, 0.8);
+}
+
+// Run the echo the way it would run on live input: in small fixed blocks on
+// a thread that never allocates, locks or touches the disk (see realtime.h),
+// then report how close each block came to its deadline. Unlike echo(), the
+// result is the same length as the input.
+bool realtime_echo(string const& filename, string const& result) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
+
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      Echo effect;
+      RealtimeRunner runner(reader.fmt_chunk.sample_rate);
+      bool ok = runner.Run(reader, effect, writer);
+
+      RealtimeStats const& stats = runner.stats();
+      cout << stats.nblocks << " block(s) of " << RealtimeRunner::DEFAULT_BLOCK_FRAMES << " frames, "
+           << stats.budget * 1000 << " ms each. Mean " << stats.mean() * 1000 << " ms, p50 "
+           << stats.latency.Percentile(50) / 1e6 << " ms, p99 " << stats.latency.Percentile(99) / 1e6
+           << " ms, p99.9 " << stats.latency.Percentile(99.9) / 1e6 << " ms, worst "
+           << stats.worst() * 1000 << " ms, " << stats.nmissed << " missed the deadline." << endl;
+
+      return finish_partial(writer, ok, result);
+}
+
+// Streaming versions of faster(), slower(), echo() and reverse(), for files
+// too big to load (see admit()). They only hold a block (or, for the echo, the
+// last echo_delay samples) at a time, and they write the same samples the
+// in-memory versions do.
+bool faster_streamed(string const& filename, string const& result) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
 
-      for (int i = 0; i != old_samples_length; ++i) {
-            old_samples[i] = factor * old_samples[i];
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      // Keep the even-numbered samples, except a last unpaired one.
+      unsigned const block_frames = 1 << 16;
+      vector<double> block(block_frames);
+      unsigned long long position = 0;
+      unsigned long long const length = reader.nframes();
+      bool ok = true;
+      while (unsigned n = reader.Read(&block[0], block_frames)) {
+            unsigned kept = 0;
+            for (unsigned i = 0; i != n; ++i) {
+                  unsigned long long at = position + i;
+                  if (at % 2 == 0 && at + 1 < length) block[kept++] = block[i];
+            }
+            position += n;
+            if (kept && !(ok = writer.Write(&block[0], kept))) break;
       }
 
-      WavSave(result, old_samples, old_samples_length);
+      return finish_partial(writer, ok, result);
+}
 
-      delete[] old_samples;
+bool slower_streamed(string const& filename, string const& result) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
+
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      unsigned const block_frames = 1 << 16;
+      vector<double> block(block_frames), doubled(2 * block_frames);
+      bool ok = true;
+      while (unsigned n = reader.Read(&block[0], block_frames)) {
+            for (unsigned i = 0; i != n; ++i) doubled[2*i] = doubled[2*i + 1] = block[i];
+            if (!(ok = writer.Write(&doubled[0], 2 * n))) break;
+      }
+
+      return finish_partial(writer, ok, result);
 }
 
-// Decrease the volume (amplitude) by 20%.
-void amp_down(string const& filename, string const& result) {
-      int old_samples_length = WavLength(filename);
-      double* old_samples = WavLoad(filename);
+bool echo_streamed(string const& filename, string const& result) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
 
-      double factor = 0.8;
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
 
-      for (int i = 0; i != old_samples_length; ++i) {
-            old_samples[i] = factor * old_samples[i];
+      // The same delay and intensity as echo().
+      unsigned const echo_delay = 10000;
+      double const echo_intensity = 0.8;
+
+      // The last echo_delay input samples, as a ring indexed by position.
+      vector<double> history(echo_delay, 0.0);
+      unsigned long long position = 0;
+
+      unsigned const block_frames = 1 << 16;
+      vector<double> block(block_frames);
+      bool ok = true;
+      while (unsigned n = reader.Read(&block[0], block_frames)) {
+            for (unsigned i = 0; i != n; ++i, ++position) {
+                  double& past = history[position % echo_delay];
+                  double in = block[i];
+                  if (position >= echo_delay) block[i] = (in + echo_intensity * past)/2;
+                  past = in;
+            }
+            if (!(ok = writer.Write(&block[0], n))) break;
       }
 
-      WavSave(result, old_samples, old_samples_length);
+      // Then the tail: just the echo of the last echo_delay samples.
+      for (unsigned i = 0; i != echo_delay; ++i, ++position) {
+            block[i] = position >= echo_delay ? echo_intensity * history[position % echo_delay] : 0.0;
+      }
+      ok = ok && writer.Write(&block[0], echo_delay);
 
-      delete[] old_samples;
+      return finish_partial(writer, ok, result);
+}
+
+bool reverse_streamed(string const& filename, string const& result) {
+      WaveReader reader;
+      if (!reader.Open(filename)) return false;
+
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      // Read the blocks back to front, and each block back to front.
+      unsigned const block_frames = 1 << 16;
+      vector<double> block(block_frames);
+      bool ok = true;
+      for (unsigned end = reader.nframes(); ok && end; ) {
+            unsigned begin = end - min(end, block_frames);
+            ok = reader.Seek(begin) && reader.Read(&block[0], end - begin) == end - begin;
+            std::reverse(block.begin(), block.begin() + (end - begin));
+            ok = ok && writer.Write(&block[0], end - begin);
+            end = begin;
+      }
+
+      return finish_partial(writer, ok, result);
 }
 
 // Reverse.
-void reverse(string const& filename, string const& result) {
+bool reverse(string const& filename, string const& result) {
       int old_samples_length = WavLength(filename);
       double* old_samples = WavLoad(filename);
+      if (!old_samples) return false;
 
       int new_samples_length = old_samples_length;
       double* new_samples = new double[new_samples_length];
@@ -137,20 +324,27 @@ void reverse(string const& filename, string const& result) {
             new_samples[i] = old_samples[old_samples_length - 1 - i];
       }
 
-      WavSave(result, new_samples, new_samples_length);
+      bool saved = WavSave(result, new_samples, new_samples_length);
 
       delete[] new_samples;
       delete[] old_samples;
+
+      return saved;
 }
 
 // Mix two WAVs together. The new file should be as long as the longest operand
 // file. The shorter file gets looped.
-void mix(string const& file1, string const& file2, string const& result) {
+bool mix(string const& file1, string const& file2, string const& result) {
       int file1_length = WavLength(file1);
       int file2_length = WavLength(file2);
 
       double* file1_samples = WavLoad(file1);
       double* file2_samples = WavLoad(file2);
+      if (!file1_samples || !file2_samples) {
+            delete[] file1_samples;
+            delete[] file2_samples;
+            return false;
+      }
 
       int longest_length;
       int shortest_length;
@@ -180,79 +374,936 @@ void mix(string const& file1, string const& file2, string const& result) {
             longest_samples[i] = (longest_samples[i] + shortest_samples[i%shortest_length]) / 2;
       }
 
-      WavSave(result, longest_samples, longest_length);
+      bool saved = WavSave(result, longest_samples, longest_length);
 
       delete[] file1_samples;
       delete[] file2_samples;
+
+      return saved;
+}
+
+// Track the pitch and write it out as a text file, one "<seconds> <Hz>" line
+// per hop. Unvoiced stretches come out as 0 Hz.
+bool pitch(string const& filename, string const& result) {
+      Wave wave;
+      if (!wave.Load(filename)) return false;
+
+      vector<double> f0s = TrackPitch(wave);
+
+      ofstream file(result.c_str());
+      if (!file.good()) {
+            cerr << "Error: I can't open " << result << " for writing!" << endl;
+            return false;
+      }
+
+      double seconds_per_hop = PitchTracker::DEFAULT_HOP / (double)wave.fmt_chunk.sample_rate;
+      for (unsigned i = 0; i != f0s.size(); ++i) {
+            file << i * seconds_per_hop << " " << f0s[i] << "\n";
+      }
+
+      file.close();
+      return !file.fail();
+}
+
+// Reads a text file listing filenames, one per line.
+bool read_list(string const& list, vector<string>& filenames) {
+      ifstream file(list.c_str());
+      if (!file.good()) {
+            cerr << "Error: I can't open " << list << "!" << endl;
+            return false;
+      }
+
+      string filename;
+      while (getline(file, filename)) {
+            if (!filename.empty()) filenames.push_back(filename);
+      }
+      return true;
+}
+
+// Mix every WAV listed (one filename per line) in a text file together, like
+// mix() does with two. The files are decoded and summed in parallel (see
+// mixer.h).
+bool mix_all(string const& list, string const& result) {
+      vector<string> filenames;
+      if (!read_list(list, filenames)) return false;
+      if (filenames.empty()) {
+            cerr << "Error: " << list << " doesn't list any files!" << endl;
+            return false;
+      }
+
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", WavFormat(result))) return false;
+
+      bool ok = MixFiles(filenames, writer);
+      return finish_partial(writer, ok, result);
+}
+
+// Fingerprint every WAV listed (one filename per line) in a text file and
+// write an index of them.
+bool index(string const& list, string const& result) {
+      vector<string> filenames;
+      if (!read_list(list, filenames)) return false;
+
+      return BuildFingerprintIndex(filenames, result);
+}
+
+// Look up a clip in an index built by index() and print the files it
+// matches, best first.
+bool lookup(string const& index_file, string const& query_file) {
+      FingerprintIndex index;
+      if (!index.Open(index_file)) return false;
+
+      Wave query;
+      if (!query.Load(query_file)) return false;
+
+      vector<FingerprintMatch> matches = index.Lookup(Fingerprint(query));
+      if (matches.empty()) cout << "No matches." << endl;
+
+      double seconds_per_frame = Fingerprinter::HOP / (double)query.fmt_chunk.sample_rate;
+      for (unsigned i = 0; i != matches.size(); ++i) {
+            cout << matches[i].filename << " (score " << matches[i].score
+                 << ", at " << matches[i].offset * seconds_per_frame << "s)" << endl;
+      }
+
+      return true;
+}
+
+// Synthesize a test signal straight to a WAV file (at the default sample rate
+// and bit depth), without holding it in memory. The spec is one of:
+//      tone:<Hz>[,<Hz>...]:<seconds>
+//      sweep:<start Hz>:<end Hz>:<seconds>     (exponential)
+//      linsweep:<start Hz>:<end Hz>:<seconds>
+//      white:<seconds>
+//      pink:<seconds>
+bool generate(string const& spec, string const& result) {
+      string fields = spec;
+      replace(fields.begin(), fields.end(), ':', ' ');
+      replace(fields.begin(), fields.end(), ',', ' ');
+
+      vector<double> numbers;
+      istringstream stream(fields);
+      string kind;
+      stream >> kind;
+      for (double number; stream >> number; ) numbers.push_back(number);
+
+      FmtChunk fmt;
+      if (numbers.empty()) {
+            cerr << "Error: " << spec << " doesn't say how long to make it!" << endl;
+            return false;
+      }
+      // It has to fit in one data chunk.
+      double frames = numbers.back() * fmt.sample_rate;
+      unsigned long long max_frames = WaveWriter::MAX_DATA_BYTES / fmt.block_align;
+      if (!isfinite(frames) || frames <= 0 || frames > max_frames) {
+            cerr << "Error: " << spec << " has to be longer than 0s and no longer than "
+                 << (double)max_frames / fmt.sample_rate << "s!" << endl;
+            return false;
+      }
+      unsigned long long nframes = frames;
+      numbers.pop_back();
+
+      unique_ptr<BlockSource> source;
+      if (kind == "tone" && !numbers.empty()) {
+            source.reset(new Multitone(fmt.sample_rate, numbers, nframes));
+      } else if ((kind == "sweep" || kind == "linsweep") && numbers.size() == 2) {
+            source.reset(new SineSweep(fmt.sample_rate, numbers[0], numbers[1], nframes, kind == "sweep"));
+      } else if (kind == "white" && numbers.empty()) {
+            source.reset(new WhiteNoise(nframes));
+      } else if (kind == "pink" && numbers.empty()) {
+            source.reset(new PinkNoise(nframes));
+      } else {
+            cerr << "Error: I don't know how to generate " << spec << "!" << endl;
+            return false;
+      }
+
+      // A short count means the sink failed partway (e.g., the disk filled
+      // up).
+      WaveWriter writer;
+      if (!writer.Open(result + ".part", fmt)) return false;
+      bool ok = Pump(*source, writer) == nframes;
+      return finish_partial(writer, ok, result);
+}
+
+// Write every labeled region (cue points named in a LIST adtl chunk) out to
+// its own file, named "<prefix><label>.wav".
+bool extract(string const& filename, string const& prefix) {
+      unsigned nregions;
+      bool ok = ExtractRegions(filename, prefix, nregions);
+      cout << "Wrote " << nregions << " region(s)." << endl;
+      return ok;
+}
+
+// The modes, how many filename (or other) arguments each one takes, and what
+// the interactive program says when it runs one.
+struct Mode {
+      char mode;
+      unsigned nargs;
+      char const* message;
+};
+
+Mode const modes[] = {
+      { 'f', 2, "Faster!" },
+      { 's', 2, "Slower!" },
+      { 'e', 2, "Echo!" },
+      { 'r', 2, "Reverse!" },
+      { '+', 2, "Increase volume!" },
+      { '-', 2, "Decrease volume!" },
+      { 'm', 3, "Mix!" },
+      { 'M', 2, "Mix them all!" },
+      { 'g', 2, "Generate!" },
+      { 'i', 2, "Index!" },
+      { 'l', 2, "Look up!" },
+      { 'p', 2, "Pitch!" },
+      { 'x', 2, "Extract!" },
+      { 'R', 2, "Real-time echo!" },
+};
+
+Mode const* find_mode(char mode) {
+      for (unsigned i = 0; i != sizeof(modes)/sizeof(modes[0]); ++i) {
+            if (modes[i].mode == mode) return &modes[i];
+      }
+      return NULL;
+}
+
+// Runs one operation. The arguments have already been checked against the
+// mode's nargs. Returns false if the operation failed.
+bool run(char mode, vector<string> const& args) {
+      StageTimer timer(STAGE_OPERATION);
+      TraceSpan span("operation", "operation");
+      switch (mode) {
+            case 'f': return faster(args[0], args[1]);
+            case 's': return slower(args[0], args[1]);
+            case 'e': return echo(args[0], args[1]);
+            case 'r': return reverse(args[0], args[1]);
+            case '+': return amp_up(args[0], args[1]);
+            case '-': return amp_down(args[0], args[1]);
+            case 'm': return mix(args[0], args[1], args[2]);
+            case 'M': return mix_all(args[0], args[1]);
+            case 'g': return generate(args[0], args[1]);
+            case 'i': return index(args[0], args[1]);
+            case 'l': return lookup(args[0], args[1]);
+            case 'p': return pitch(args[0], args[1]);
+            case 'x': return extract(args[0], args[1]);
+            case 'R': return realtime_echo(args[0], args[1]);
+            default: return false;
+      }
+}
+
+void usage(ostream& stream) {
+      stream << "Usage: <mode> <input WAV(s)> <output WAV>" << endl
+             << "Where mode can be one of the following:" << endl
+             << "\t f : Faster." << endl
+             << "\t s : Slower." << endl
+             << "\t e : Echo." << endl
+             << "\t r : Reverse." << endl
+             << "\t + : Plus volume." << endl
+             << "\t - : Minus volume." << endl
+             << "\t m : Mix two .WAV files together. Takes an extra filename argument." << endl
+             << "\t M : Mix all the .WAV files listed in a text file together." << endl
+             << "\t g : Generate. Takes a signal spec (e.g., tone:440:5, sweep:20:10000:10, pink:5)" << endl
+             << "\t     instead of an input WAV." << endl
+             << "\t i : Index. Fingerprints the WAVs listed in a text file into an index file." << endl
+             << "\t l : Look up. Takes an index file and a WAV, and lists matching files." << endl
+             << "\t p : Pitch contour. The output is a text file of <seconds> <Hz> lines." << endl
+             << "\t x : Extract labeled regions. Takes an output filename prefix instead of an output WAV." << endl
+             << "\t R : Real-time echo. Echo in small blocks, reporting missed deadlines." << endl;
+}
+
+// Runs a job's streaming version (see faster_streamed()). Only for modes
+// where streamable() says there is one.
+bool run_streamed(char mode, vector<string> const& args) {
+      StageTimer timer(STAGE_OPERATION);
+      TraceSpan span("operation (streamed)", "operation");
+      switch (mode) {
+            case 'f': return faster_streamed(args[0], args[1]);
+            case 's': return slower_streamed(args[0], args[1]);
+            case 'e': return echo_streamed(args[0], args[1]);
+            case 'r': return reverse_streamed(args[0], args[1]);
+            default: return false;
+      }
+}
+
+bool streamable(char mode) {
+      return mode && strchr("fser", mode);
+}
+
+// What a job needs when it streams: a few blocks in flight.
+unsigned long long const STREAMED_FOOTPRINT = 4 << 20;
+
+// What the headers say about a .WAV file: how many samples WavLoad() would
+// give back and how many bytes of sample data it takes in the file. Both are
+// zero if it can't be read.
+void wav_size(string const& filename, unsigned long long& nsamples, unsigned long long& nbytes) {
+      Wave wave;
+      wave.LoadMetadata(filename);
+      nsamples = wave.nsamples();
+      nbytes = wave.data_chunk.chunk_size;
+}
+
+// Peak memory for a WavLoad(), some processing into "nout" new samples, and
+// a WavSave() of those in a format with "out_bytes" bytes per sample: first
+// the file's bytes and its samples, then both sets of samples and the bytes
+// being saved.
+unsigned long long load_and_save(unsigned long long nsamples, unsigned long long nbytes,
+                                 unsigned long long nout, unsigned out_bytes) {
+      return max(nbytes + 8 * nsamples, 8 * nsamples + 8 * nout + out_bytes * nout);
+}
+
+// Roughly how much memory a job needs at its peak, worked out from the
+// headers of its input files (and, for the list modes, of the files listed).
+// Files that can't be read count as empty; the job will fail soon enough.
+unsigned long long footprint(char mode, vector<string> const& args) {
+      unsigned long long n, bytes, n2, bytes2;
+      unsigned out_bytes = 0;
+      n = bytes = 0;
+      if (strchr("fsermp", mode)) wav_size(args[0], n, bytes);
+      if (mode == 'l') wav_size(args[1], n, bytes);
+      if (strchr("fserm", mode)) out_bytes = WavFormat(args.back()).bits_per_sample / 8;
+
+      switch (mode) {
+            case 'f': return load_and_save(n, bytes, n / 2, out_bytes);
+            case 's': return load_and_save(n, bytes, 2 * n, out_bytes);
+            case 'e': return load_and_save(n, bytes, n + 10000, out_bytes);
+            case 'r': return load_and_save(n, bytes, n, out_bytes);
+            case 'm':
+                  // Both files' samples, while loading the second, or
+                  // while saving the longer one.
+                  wav_size(args[1], n2, bytes2);
+                  return max(8 * n + bytes2 + 8 * n2, 8 * n + 8 * n2 + out_bytes * max(n, n2));
+            case 'p':
+            case 'l':
+                  // A whole Wave (the query, for a lookup), plus its
+                  // samples.
+                  return bytes + 8 * n;
+            case 'M':
+            case 'i': {
+                  // Up to one file per thread at once, loaded (for the
+                  // index, plus the postings it sorts before writing them
+                  // out), or summed into an accumulator as long as the
+                  // longest file (for the mix, which caps them; see
+                  // MixFiles()).
+                  vector<string> filenames;
+                  read_list(args[0], filenames);
+                  unsigned long long largest = 0;
+                  for (unsigned i = 0; i != filenames.size(); ++i) {
+                        wav_size(filenames[i], n, bytes);
+                        largest = max(largest, mode == 'M' ? 8 * n : bytes + 8 * n);
+                  }
+                  unsigned long long at_once = min<unsigned long long>(filenames.size(), ThreadPool::Shared().size());
+                  return mode == 'M' ? max(largest, min(at_once * largest, 1ULL << 30))
+                                    : at_once * largest + FingerprintIndex::DEFAULT_BUILD_BYTES;
+            }
+            default:
+                  return STREAMED_FOOTPRINT;
+      }
+}
+
+// Decides how a job runs under a memory budget: as usual if its footprint
+// fits in the budget at all, or streamed if it doesn't and it can be.
+// Reserves the memory (waiting until there's room) and returns how much to
+// release when the job's done.
+unsigned long long admit(MemoryBudget& budget, char mode, vector<string> const& args, bool& streamed) {
+      unsigned long long bytes = footprint(mode, args);
+      streamed = bytes > budget.limit() && streamable(mode);
+      if (streamed) bytes = STREAMED_FOOTPRINT;
+
+      budget.Reserve(bytes);
+      return bytes;
+}
+
+// Runs a job the way admit() said to.
+bool run_admitted(char mode, vector<string> const& args, bool streamed) {
+      return streamed ? run_streamed(mode, args) : run(mode, args);
 }
 
+// What a job read and wrote (in .WAV files), and how long it took. "in" and
+// "out" frames, bytes (of sample data) and seconds (of audio) come from the
+// headers of the job's WAV inputs (including the files a list names) and
+// output. CPU time is the whole process's, so for jobs that overlap (in a job
+// list) it includes the others' too. Memory is the job's own (see alloc.h),
+// including what the pool's workers allocated for it.
+struct Report {
+      char mode;
+      vector<string> args;
+      bool ok;
+      bool streamed;
+      unsigned long long in_frames, in_bytes, out_frames, out_bytes;
+      double in_seconds, out_seconds;
+      double wall_seconds, cpu_seconds;
+      unsigned long long allocations, allocated_bytes, peak_bytes;
+
+      // Sample data in per second (or out, for jobs with no WAV input).
+      double megabytes_per_second(void) const {
+            return (in_bytes ? in_bytes : out_bytes) / 1e6 / max(wall_seconds, 1e-9);
+      }
+
+      // Seconds of audio (in, or out, as above) per second of processing.
+      double realtime_factor(void) const {
+            return (in_bytes ? in_seconds : out_seconds) / max(wall_seconds, 1e-9);
+      }
+};
+
+// Adds what a .WAV file's headers say to the frames, bytes and seconds so
+// far. Files that can't be read add nothing.
+void add_wav(string const& filename, unsigned long long& frames, unsigned long long& bytes, double& seconds) {
+      Wave wave;
+      if (!wave.LoadMetadata(filename) || !wave.fmt_chunk.block_align) return;
+      unsigned long long n = wave.data_chunk.chunk_size / wave.fmt_chunk.block_align;
+      frames += n;
+      bytes += wave.data_chunk.chunk_size;
+      if (wave.fmt_chunk.sample_rate) seconds += (double)n / wave.fmt_chunk.sample_rate;
+}
+
+double cpu_seconds(void) {
+      timespec now;
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+      return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs a job the way admit() said to, and reports on it.
+Report measure(char mode, vector<string> const& args, bool streamed) {
+      Report report;
+      report.mode = mode;
+      report.args = args;
+      report.streamed = streamed;
+      report.in_frames = report.in_bytes = report.out_frames = report.out_bytes = 0;
+      report.in_seconds = report.out_seconds = 0;
+
+      // Before the job, since the output can be one of the inputs.
+      if (strchr("fser+-Rpxm", mode)) add_wav(args[0], report.in_frames, report.in_bytes, report.in_seconds);
+      if (strchr("ml", mode)) add_wav(args[1], report.in_frames, report.in_bytes, report.in_seconds);
+      if (strchr("Mi", mode)) {
+            vector<string> filenames;
+            read_list(args[0], filenames);
+            for (unsigned i = 0; i != filenames.size(); ++i) {
+                  add_wav(filenames[i], report.in_frames, report.in_bytes, report.in_seconds);
+            }
+      }
+
+      AllocationAccount* account = AllocationAccount::Open();
+      double cpu_start = cpu_seconds();
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      {
+            AllocationScope scope(account);
+            report.ok = run_admitted(mode, args, streamed);
+      }
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      report.wall_seconds = elapsed.count();
+      report.cpu_seconds = cpu_seconds() - cpu_start;
+      report.allocations = account->allocations();
+      report.allocated_bytes = account->allocated_bytes();
+      report.peak_bytes = account->peak_bytes();
+      account->Release();
+
+      if (report.ok && strchr("fser+-RmMg", mode)) {
+            add_wav(args.back(), report.out_frames, report.out_bytes, report.out_seconds);
+      }
+      return report;
+}
+
+// One line, e.g.: "44100 frames (1s, 88200 bytes) in, 54100 frames (1.22676s,
+// 108200 bytes) out, 0.0031s (0.003s CPU), 28.4 MB/s, 322x real time, 1.06 MB
+// peak (1.50 MB in 7 allocations)".
+void print_report(ostream& stream, Report const& report) {
+      stream << report.in_frames << " frames (" << report.in_seconds << "s, " << report.in_bytes << " bytes) in, "
+             << report.out_frames << " frames (" << report.out_seconds << "s, " << report.out_bytes << " bytes) out, "
+             << report.wall_seconds << "s (" << report.cpu_seconds << "s CPU), "
+             << report.megabytes_per_second() << " MB/s, " << report.realtime_factor() << "x real time, "
+             << report.peak_bytes / 1e6 << " MB peak (" << report.allocated_bytes / 1e6 << " MB in "
+             << report.allocations << " allocations)";
+}
+
+void write_json_string(ostream& stream, string const& text) {
+      stream << '"';
+      for (unsigned i = 0; i != text.size(); ++i) {
+            if (text[i] == '"' || text[i] == '\\') stream << '\\';
+            if ((unsigned char)text[i] >= 0x20) stream << text[i];
+      }
+      stream << '"';
+}
+
+// Writes reports as JSON: one object per job (in the order they finished),
+// plus the totals. Fails (and prints out some messages) if the file can't be
+// written.
+bool write_reports(string const& filename, vector<Report> const& reports, double wall_seconds, double cpu_seconds) {
+      ofstream file(filename.c_str());
+      if (!file.good()) {
+            cerr << "Error: I can't open " << filename << " for writing!" << endl;
+            return false;
+      }
+
+      Report total = Report();
+      file.precision(9);
+      file << "{\n  \"operations\": [\n";
+      for (unsigned i = 0; i != reports.size(); ++i) {
+            Report const& report = reports[i];
+            file << "    {\"mode\": ";
+            write_json_string(file, string(1, report.mode));
+            file << ", \"args\": [";
+            for (unsigned j = 0; j != report.args.size(); ++j) {
+                  if (j) file << ", ";
+                  write_json_string(file, report.args[j]);
+            }
+            file << "], \"ok\": " << (report.ok ? "true" : "false")
+                 << ", \"streamed\": " << (report.streamed ? "true" : "false")
+                 << ", \"in_frames\": " << report.in_frames << ", \"in_bytes\": " << report.in_bytes
+                 << ", \"in_seconds\": " << report.in_seconds
+                 << ", \"out_frames\": " << report.out_frames << ", \"out_bytes\": " << report.out_bytes
+                 << ", \"out_seconds\": " << report.out_seconds
+                 << ", \"wall_seconds\": " << report.wall_seconds << ", \"cpu_seconds\": " << report.cpu_seconds
+                 << ", \"mb_per_second\": " << report.megabytes_per_second()
+                 << ", \"realtime_factor\": " << report.realtime_factor()
+                 << ", \"allocations\": " << report.allocations << ", \"allocated_bytes\": " << report.allocated_bytes
+                 << ", \"peak_bytes\": " << report.peak_bytes << "}"
+                 << (i + 1 != reports.size() ? "," : "") << "\n";
+
+            total.in_frames += report.in_frames;
+            total.in_bytes += report.in_bytes;
+            total.in_seconds += report.in_seconds;
+            total.out_frames += report.out_frames;
+            total.out_bytes += report.out_bytes;
+            total.out_seconds += report.out_seconds;
+            total.allocations += report.allocations;
+            total.allocated_bytes += report.allocated_bytes;
+            total.peak_bytes = max(total.peak_bytes, report.peak_bytes);
+      }
+      total.wall_seconds = wall_seconds;
+      total.cpu_seconds = cpu_seconds;
+
+      file << "  ],\n  \"total\": {\"operations\": " << reports.size()
+           << ", \"in_frames\": " << total.in_frames << ", \"in_bytes\": " << total.in_bytes
+           << ", \"in_seconds\": " << total.in_seconds
+           << ", \"out_frames\": " << total.out_frames << ", \"out_bytes\": " << total.out_bytes
+           << ", \"out_seconds\": " << total.out_seconds
+           << ", \"wall_seconds\": " << total.wall_seconds << ", \"cpu_seconds\": " << total.cpu_seconds
+           << ", \"mb_per_second\": " << total.megabytes_per_second()
+           << ", \"realtime_factor\": " << total.realtime_factor()
+           << ", \"allocations\": " << total.allocations << ", \"allocated_bytes\": " << total.allocated_bytes
+           << ", \"largest_peak_bytes\": " << total.peak_bytes << "}\n}\n";
+
+      file.close();
+      return !file.fail();
+}
+
+// Runs every job in a job list (or standard input, for "-"), one job per line
+// in the same "<mode> <arguments>" form the interactive program takes. Blank
+// lines and lines starting with '#' are skipped. Jobs run in parallel across
+// "nthreads" threads (zero means one per core), and each one gets a status
+// line when it finishes, with its throughput (see Report). A job starts once
+// its memory fits in "budget" (see admit()), so big jobs queue up behind each
+// other. If "report_file" isn't empty, every job's report goes there as JSON
+// too (see write_reports()). Returns the number of jobs that failed
+// (including malformed ones), or -1 if the job list can't be read.
+int run_jobs(string const& job_list, unsigned nthreads, MemoryBudget& budget, string const& report_file) {
+      ifstream file;
+      if (job_list != "-") {
+            file.open(job_list.c_str());
+            if (!file.good()) {
+                  cerr << "Error: I can't open " << job_list << "!" << endl;
+                  return -1;
+            }
+      }
+      istream& jobs = job_list == "-" ? cin : file;
+
+      mutex status_mutex;
+      int nfailed = 0;
+      unsigned njobs = 0;
+      vector<Report> reports;
+      double cpu_start = cpu_seconds();
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      // Jobs share the pool with the per-block work inside them, so "-t"
+      // bounds the whole run.
+      TaskGroup batch(ThreadPool::Shared(nthreads));
+
+      string line;
+      for (unsigned line_number = 1; getline(jobs, line); ++line_number) {
+            istringstream fields(line);
+            string mode_field;
+            if (!(fields >> mode_field) || mode_field[0] == '#') continue;
+            ++njobs;
+
+            vector<string> args;
+            for (string arg; fields >> arg; ) args.push_back(arg);
+
+            Mode const* mode = mode_field.size() == 1 ? find_mode(mode_field[0]) : NULL;
+            if (!mode || args.size() != mode->nargs) {
+                  lock_guard<mutex> lock(status_mutex);
+                  cout << "[bad job] " << line_number << ": " << line << endl;
+                  ++nfailed;
+                  continue;
+            }
+
+            // Waiting here, rather than in the task, keeps the jobs
+            // behind this one from piling up in the pool.
+            bool streamed;
+            unsigned long long bytes = admit(budget, mode->mode, args, streamed);
+
+            batch.Run([=, &status_mutex, &nfailed, &budget, &reports]() {
+                  Report report = measure(mode->mode, args, streamed);
+                  budget.Release(bytes);
+
+                  lock_guard<mutex> lock(status_mutex);
+                  cout << (report.ok ? "[ok] " : "[failed] ") << line_number << ": " << line
+                       << " (" << report.wall_seconds << "s, " << report.cpu_seconds << "s CPU, "
+                       << report.megabytes_per_second() << " MB/s, " << report.realtime_factor() << "x real time, "
+                       << report.peak_bytes / 1e6 << " MB peak" << (streamed ? ", streamed" : "") << ")" << endl;
+                  if (!report.ok) ++nfailed;
+                  reports.push_back(report);
+            });
+      }
+
+      batch.Wait();
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+      cout << njobs << " job(s), " << nfailed << " failed, in " << elapsed.count() << "s ("
+           << cpu_seconds() - cpu_start << "s CPU)." << endl;
+      if (!report_file.empty()) {
+            write_reports(report_file, reports, elapsed.count(), cpu_seconds() - cpu_start);
+      }
+      return nfailed;
+}
+
+// The modes that turn one WAV into another, which are the ones that can be
+// chained together by watch().
+bool chainable(char mode) {
+      return mode && strchr("fser+-R", mode);
+}
+
+// Runs a chain of modes (e.g., "e+" for an echo, then louder) on a file, each
+// step working on the last one's output. The steps in between go in temporary
+// files next to "result", and the last one's output is renamed into place at
+// the end. Each step is admitted to "budget" (see admit()) on its own, since
+// the files in between can be bigger or smaller than the first.
+bool run_chain(string const& chain, string const& filename, string const& result, MemoryBudget& budget) {
+      string input = filename;
+      bool ok = true;
+      for (unsigned i = 0; i != chain.size() && ok; ++i) {
+            ostringstream output;
+            output << result << (i + 1 == chain.size() ? ".part" : "." + to_string(i) + ".part");
+
+            vector<string> args;
+            args.push_back(input);
+            args.push_back(output.str());
+            bool streamed;
+            unsigned long long bytes = admit(budget, chain[i], args, streamed);
+            ok = run_admitted(chain[i], args, streamed);
+            budget.Release(bytes);
+
+            if (input != filename) remove(input.c_str());
+            input = output.str();
+      }
+
+      if (ok && rename(input.c_str(), result.c_str()) == 0) return true;
+      remove(input.c_str());
+      return false;
+}
+
+// Watches a directory and runs a chain of modes (see run_chain()) on every
+// .WAV file that arrives there, writing the results to another directory
+// under the same names. Files already there that are newer than their
+// results get done first. At most "max_files" files are worked on at once
+// (zero means one per thread). A file that changes again while it's being
+// worked on is looked at again once that's done, rather than twice at once.
+// Only returns if the watch fails.
+bool watch(string const& in_dir, string const& out_dir, string const& chain,
+           unsigned nthreads, unsigned max_files, MemoryBudget& budget) {
+      for (unsigned i = 0; i != chain.size(); ++i) {
+            if (!chainable(chain[i])) {
+                  cerr << "Error: '" << chain[i] << "' can't be part of a chain!" << endl;
+                  return false;
+            }
+      }
+
+      char in_path[PATH_MAX], out_path[PATH_MAX];
+      if (!realpath(in_dir.c_str(), in_path) || !realpath(out_dir.c_str(), out_path)
+                  || strcmp(in_path, out_path) == 0) {
+            cerr << "Error: " << in_dir << " and " << out_dir
+                 << " have to be two different directories that exist!" << endl;
+            return false;
+      }
+
+      // Start watching before catching up, so nothing slips through.
+      DirectoryWatcher watcher;
+      if (!watcher.Open(in_dir)) return false;
+
+      ThreadPool& pool = ThreadPool::Shared(nthreads);
+      if (!max_files) max_files = pool.size();
+
+      // The files being worked on, and the ones among them that changed
+      // again in the meantime.
+      TaskGroup batch(pool);
+      mutex status_mutex;
+      condition_variable slot_free;
+      unsigned in_flight = 0;
+      set<string> running, changed;
+
+      vector<string> names = watcher.Existing();
+      cout << "Watching " << in_dir << "." << endl;
+      do {
+            for (unsigned i = 0; i != names.size(); ++i) {
+                  string name = names[i];
+                  string input = in_dir + "/" + name;
+                  string output = out_dir + "/" + name;
+                  {
+                        lock_guard<mutex> lock(status_mutex);
+                        if (running.count(name)) {
+                              changed.insert(name);
+                              continue;
+                        }
+                  }
+                  if (!DirectoryWatcher::IsOutOfDate(input, output)) continue;
+
+                  {
+                        unique_lock<mutex> lock(status_mutex);
+                        slot_free.wait(lock, [&]() { return in_flight < max_files; });
+                        ++in_flight;
+                        running.insert(name);
+                  }
+
+                  batch.Run([=, &status_mutex, &slot_free, &in_flight, &running, &changed, &budget]() {
+                        // If it changes again while we're at it, keep the
+                        // slot and go around again (if it's still out of
+                        // date once we're done).
+                        for (bool out_of_date = true; ; ) {
+                              if (out_of_date) {
+                                    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                                    bool ok = run_chain(chain, input, output, budget);
+                                    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+                                    lock_guard<mutex> lock(status_mutex);
+                                    cout << (ok ? "[ok] " : "[failed] ") << input << " -> " << output
+                                         << " (" << elapsed.count() << "s)" << endl;
+                              }
+
+                              {
+                                    lock_guard<mutex> lock(status_mutex);
+                                    if (!changed.erase(name)) {
+                                          running.erase(name);
+                                          --in_flight;
+                                          slot_free.notify_one();
+                                          return;
+                                    }
+                              }
+                              out_of_date = DirectoryWatcher::IsOutOfDate(input, output);
+                        }
+                  });
+            }
+      } while (watcher.Next(names));
+
+      batch.Wait();
+      return false;
+}
+
+// Serves jobs over a Unix domain socket until it's told to stop (see
+// daemon.h). Each job is sized up the way admit() does it, and the server
+// holds it back until it fits in "budget". Returns false if it couldn't
+// start.
+bool serve(string const& socket_path, unsigned nthreads, MemoryBudget& budget) {
+      JobServer server(socket_path, [&budget](char mode, vector<string> const& args) {
+            JobPlan plan = { 0, []() { return JOB_BAD; } };
+            Mode const* found = find_mode(mode);
+            if (!found || args.size() != found->nargs) return plan;
+
+            plan.bytes = footprint(mode, args);
+            bool streamed = plan.bytes > budget.limit() && streamable(mode);
+            if (streamed) plan.bytes = STREAMED_FOOTPRINT;
+            plan.run = [mode, args, streamed]() { return run_admitted(mode, args, streamed) ? JOB_OK : JOB_FAILED; };
+            return plan;
+      }, budget, ThreadPool::Shared(nthreads));
+
+      cout << "Serving jobs on " << socket_path << "." << endl;
+      return server.Run();
+}
+
+// Sends one job to a running server and reports how it went. Returns the
+// exit status.
+int send_job(string const& socket_path, char mode, vector<string> const& args) {
+      JobReply reply;
+      if (!SendJob(socket_path, mode, args, reply)) return 2;
+
+      cout << (reply.status == JOB_OK ? "[ok]" : reply.status == JOB_FAILED ? "[failed]" : "[bad job]")
+           << " (queued " << reply.queued_ns / 1e9 << "s, ran " << reply.run_ns / 1e9 << "s)" << endl;
+      return reply.status;
+}
+
+// Writes the counters (see stats.h) to a file, or to standard error for "-".
+void write_stats(string const& filename) {
+      StatsSnapshot snapshot = Stats::Snapshot();
+      if (filename == "-") {
+            snapshot.WriteTo(cerr);
+            Stats::BlockLatencies().WriteTo(cerr, "block_latency");
+            return;
+      }
+
+      ofstream file(filename.c_str());
+      snapshot.WriteTo(file);
+      Stats::BlockLatencies().WriteTo(file, "block_latency");
+      if (!file.good()) cerr << "Error: I can't write the stats to " << filename << "!" << endl;
+}
+
+// Runs in one of six ways:
+//      wave                              Interactive.
+//      wave [-r <report>] <mode> <arguments>
+//                                        Runs one operation.
+//      wave [-t <threads>] [-r <report>] -j <jobs>
+//                                        Runs a job list (see run_jobs()).
+//      wave [-t <threads>] -d <socket>   Serves jobs on a socket (see serve()).
+//      wave -s <socket> <mode> <args>    Sends one job to a server.
+//      wave [-t <threads>] [-n <files>] -w <in dir> -o <out dir> -c <modes>
+//                                        Watches a directory (see watch()).
+// The job list, server and watcher also take "-m <megabytes>", the memory
+// their jobs can use at once (half the machine's, by default). One operation
+// reports its throughput (see Report) on standard error, and "-r" writes that
+// (or a job list's) as JSON too.
+// The exit status is 0 if everything worked, 1 if an operation failed and 2
+// if the command line didn't make sense.
+//
+// Defining WAVE_NO_MAIN leaves main() out, so the examples can be built into
+// another program (like the benchmarks in bench.cpp).
+#ifndef WAVE_NO_MAIN
 int main(int argc, char** argv) {
+      // If WAVE_KERNEL_CACHE names a file, start with the window, filter and
+      // FFT tables saved there and save them back on the way out.
+      char const* kernel_cache = getenv("WAVE_KERNEL_CACHE");
+      if (kernel_cache && ifstream(kernel_cache).good()) {
+            KernelCache::Instance().Load(kernel_cache);
+      }
+
+      // If WAVE_PIN_THREADS is set, each of the shared pool's workers stays
+      // on one CPU, spread across the NUMA nodes (see threadpool.h).
+      bool pin_threads = getenv("WAVE_PIN_THREADS") != NULL;
+
+      // If WAVE_STATS names a file ("-" for standard error), write the
+      // counters (see stats.h) there on the way out.
+      char const* stats = getenv("WAVE_STATS");
+
+      // If WAVE_TRACE names a file, record a trace (see trace.h) and write it
+      // there on the way out.
+      char const* trace = getenv("WAVE_TRACE");
+      if (trace) {
+            Trace::Start();
+            Trace::NameThread("main");
+      }
+
+      if (argc > 1) {
+            unsigned nthreads = 0, max_files = 0;
+            unsigned long long max_megabytes = 0;
+            string job_list, serve_socket, send_socket, watch_dir, out_dir, chain, report_file;
+            int arg = 1;
+            for (; arg + 1 < argc; arg += 2) {
+                  string flag = argv[arg];
+                  if (flag == "-t") {
+                        nthreads = atoi(argv[arg + 1]);
+                  } else if (flag == "-j") {
+                        job_list = argv[arg + 1];
+                  } else if (flag == "-d") {
+                        serve_socket = argv[arg + 1];
+                  } else if (flag == "-s") {
+                        send_socket = argv[arg + 1];
+                  } else if (flag == "-w") {
+                        watch_dir = argv[arg + 1];
+                  } else if (flag == "-o") {
+                        out_dir = argv[arg + 1];
+                  } else if (flag == "-c") {
+                        chain = argv[arg + 1];
+                  } else if (flag == "-n") {
+                        max_files = atoi(argv[arg + 1]);
+                  } else if (flag == "-r") {
+                        report_file = argv[arg + 1];
+                  } else if (flag == "-m") {
+                        max_megabytes = strtoull(argv[arg + 1], NULL, 10);
+                  } else {
+                        break;
+                  }
+            }
+
+            int status;
+            unsigned nways = !job_list.empty() + !serve_socket.empty() + !send_socket.empty() + !watch_dir.empty();
+            bool no_job = !job_list.empty() || !serve_socket.empty() || !watch_dir.empty();
+            Mode const* mode = arg < argc && argv[arg][0] && !argv[arg][1] ? find_mode(argv[arg][0]) : NULL;
+            bool bad_job = !mode || argc - arg - 1 != (int)mode->nargs;
+            if (nways > 1 || (no_job ? arg != argc : bad_job)
+                          || (!watch_dir.empty() && (out_dir.empty() || chain.empty()))
+                          || (!report_file.empty() && nways && job_list.empty())) {
+                  usage(cerr);
+                  cerr << "Or: [-t <threads>] -j <job list, one \"<mode> <arguments>\" per line>" << endl
+                       << "Or: [-t <threads>] -d <socket to serve jobs on>" << endl
+                       << "Or: -s <socket of a server> <mode> <arguments>" << endl
+                       << "Or: [-t <threads>] [-n <files at once>] -w <directory to watch> -o <output directory>" << endl
+                       << "    -c <modes to run on each new file, e.g. e+>" << endl
+                       << "(-j, -d and -w also take -m <megabytes of memory their jobs can use at once>)" << endl
+                       << "(One operation or -j can take -r <JSON report of each operation's throughput>)" << endl;
+                  return 2;
+            }
+
+            // Before the pool starts its threads.
+            if (!serve_socket.empty()) JobServer::BlockShutdownSignals();
+            ThreadPool::Shared(nthreads, pin_threads);
+
+            MemoryBudget budget(max_megabytes << 20);
+            if (!watch_dir.empty()) {
+                  status = watch(watch_dir, out_dir, chain, nthreads, max_files, budget) ? 0 : 2;
+            } else if (!job_list.empty()) {
+                  int nfailed = run_jobs(job_list, nthreads, budget, report_file);
+                  status = nfailed < 0 ? 2 : nfailed > 0 ? 1 : 0;
+            } else if (!serve_socket.empty()) {
+                  status = serve(serve_socket, nthreads, budget) ? 0 : 2;
+            } else if (!send_socket.empty()) {
+                  status = send_job(send_socket, mode->mode, vector<string>(argv + arg + 1, argv + argc));
+            } else {
+                  Report report = measure(mode->mode, vector<string>(argv + arg + 1, argv + argc), false);
+                  cerr << mode->mode << ": ";
+                  print_report(cerr, report);
+                  cerr << endl;
+                  if (!report_file.empty()) {
+                        write_reports(report_file, vector<Report>(1, report), report.wall_seconds, report.cpu_seconds);
+                  }
+                  status = report.ok ? 0 : 1;
+            }
+
+            if (kernel_cache) KernelCache::Instance().Save(kernel_cache);
+            if (stats) write_stats(stats);
+            if (trace) Trace::Write(trace);
+            return status;
+      }
+
+      ThreadPool::Shared(0, pin_threads);
 
       cout << "This here is an interactive program for manipulating MS Wave files." << endl;
 
-      cout << "Usage: <mode> <input WAV(s)> <output WAV>" << endl
-           << "Where mode can be one of the following:" << endl
-           << "\t f : Faster." << endl
-           << "\t s : Slower." << endl
-           << "\t e : Echo." << endl
-           << "\t r : Reverse." << endl
-           << "\t + : Plus volume." << endl
-           << "\t - : Minus volume." << endl
-           << "\t m : Mix two .WAV files together. Takes an extra filename argument." << endl
-           << "\t q : Quit." << endl
+      usage(cout);
+      cout << "\t q : Quit." << endl
            << endl;
 
-      // An infinite loop. Exits when the user enters 'q'.
+      // An infinite loop. Exits when the user enters 'q' (or the input runs
+      // out).
       for (;;) {
             cout << "> ";
 
             char mode;
-            cin >> mode;
-
-            string input_file, input_file2, output_file;
-            switch (mode) {
-                  case 'f':
-                        cin >> input_file >> output_file;
-                        cout << "Faster!" << endl;
-                        faster(input_file, output_file);
-                        break;
-                  case 's':
-                        cin >> input_file >> output_file;
-                        cout << "Slower!" << endl;
-                        slower(input_file, output_file);
-                        break;
-                  case 'e':
-                        cin >> input_file >> output_file;
-                        cout << "Echo!" << endl;
-                        echo(input_file, output_file);
-                        break;
-                  case 'r':
-                        cin >> input_file >> output_file;
-                        cout << "Reverse!" << endl;
-                        reverse(input_file, output_file);
-                        break;
-                  case '+':
-                        cin >> input_file >> output_file;
-                        cout << "Increase volume!" << endl;
-                        amp_up(input_file, output_file);
-                        break;
-                  case '-':
-                        cin >> input_file >> output_file;
-                        cout << "Decrease volume!" << endl;
-                        amp_down(input_file, output_file);
-                        break;
-                  case 'm':
-                        cin >> input_file >> input_file2 >> output_file;
-                        cout << "Mix!" << endl;
-                        mix(input_file, input_file2, output_file);
-                        break;
-                  case 'q':
-                        cout << "Exiting." << endl;
-                        return 0;
-                  default:
-                        cout << "Unknown mode: " << mode << endl
-                             << "Use 'q' to quit." << endl;
-                        cin.clear();
+            if (!(cin >> mode)) mode = 'q';
+
+            if (mode == 'q') {
+                  cout << "Exiting." << endl;
+                  if (kernel_cache) KernelCache::Instance().Save(kernel_cache);
+                  if (stats) write_stats(stats);
+                  if (trace) Trace::Write(trace);
+                  return 0;
+            }
+
+            Mode const* found = find_mode(mode);
+            if (!found) {
+                  cout << "Unknown mode: " << mode << endl
+                       << "Use 'q' to quit." << endl;
+                  cin.clear();
+            } else {
+                  vector<string> args(found->nargs);
+                  for (unsigned i = 0; i != args.size(); ++i) cin >> args[i];
+
+                  cout << found->message << endl;
+                  print_report(cout, measure(mode, args, false));
+                  cout << endl;
             }
 
             cout << endl;
@@ -260,21 +1311,24 @@ int main(int argc, char** argv) {
 
       return 0;
 }
+#endif
 
 // Reads and returns the sample values from a .WAV file. We return the samples
 // as a series of values between +1.0 and -1.0. Use WavLength() to get the
 // number of values returned. This functions allocates memory to store its
-// return value, so use delete[] to free this memory.
+// return value, so use delete[] to free this memory. Returns NULL if the file
+// can't be loaded.
 double* WavLoad(string const& filename) {
       Wave wave;
-      wave.Load(filename);
+      if (!wave.Load(filename)) return NULL;
 
       int nsamples = wave.nsamples();
       double* samples = new double[nsamples];
 
-      for (int i = 0; i != nsamples; ++i) {
-            samples[i] = wave.GetSample(i);
-      }
+      // Big files get converted in pieces, in parallel.
+      ParallelFor(ThreadPool::Shared(), 0, nsamples, 1 << 16, [&](unsigned begin, unsigned end) {
+            wave.GetSamples(begin, end - begin, samples + begin);
+      });
 
       return samples;
 }
@@ -288,8 +1342,8 @@ int WavLength(string const& filename) {
 
 // Writes or overwrites a .WAV file with the parameter sample values. We expect
 // the samples to be in the range -1.0 to +1.0, like those returned by
-// WavLoad().
-void WavSave(string const& filename, double const* samples, int nsamples) {
+// WavLoad(). Returns false if the file can't be written.
+bool WavSave(string const& filename, double const* samples, int nsamples) {
       Wave wave;
 
       // If the Wave file exists, then let's save as much metadata as possible
@@ -303,9 +1357,18 @@ void WavSave(string const& filename, double const* samples, int nsamples) {
 
       wave.Resize(nsamples);
 
-      for (int i = 0; i != nsamples; ++i) {
-            wave.SetSample(i, samples[i]);
-      }
+      ParallelFor(ThreadPool::Shared(), 0, nsamples, 1 << 16, [&](unsigned begin, unsigned end) {
+            wave.SetSamples(begin, end - begin, samples + begin);
+      });
+
+      return wave.Save(filename);
+}
 
-      wave.Save(filename);
+// The format WavSave() writes "filename" in: whatever format it already has
+// (or the defaults, if it doesn't exist yet), but with just one channel.
+FmtChunk WavFormat(string const& filename) {
+      Wave wave;
+      wave.LoadMetadata(filename);
+      wave.fmt_chunk.nchannels = 1;
+      return wave.fmt_chunk;
 }
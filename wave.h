@@ -32,11 +32,18 @@
 //
 
 //#include <stdint.h>
+#include "alloc.h"
+#include "numa.h"
+#include "stats.h"
+#include "trace.h"
+#include <algorithm>
 #include <cstring>
 #include <string>
 #include <fstream>
+#include <type_traits>
 #include <iostream>
 #include <vector>
+#include <sys/mman.h>
 
 typedef unsigned int uint32_t;
 typedef unsigned short uint16_t;
@@ -184,8 +191,23 @@ class FmtChunk : public Chunk {
             virtual void ReadFrom(std::istream& stream);
             virtual void WriteTo(std::ostream& stream) const;
 
+            // Whether samples in this format can be decoded without reading
+            // past the end of a frame: float samples have to be 32 or 64
+            // bits, and a frame (block_align bytes) has to hold a sample for
+            // every channel. If not, prints out a message about "filename".
+            bool Check(std::string const& filename) const;
+
             /*** Constants ***/
             static uint16_t const COMPRESSION_NONE = 1;
+            // IEEE floating point samples, 32 or 64 bits, nominally between
+            // -1.0 and +1.0.
+            static uint16_t const COMPRESSION_FLOAT = 3;
+            // WAVE_FORMAT_EXTENSIBLE: the format is in a subformat GUID,
+            // after a cbSize, the valid bits per sample and a channel mask.
+            static uint16_t const COMPRESSION_EXTENSIBLE = 0xFFFE;
+            static uint32_t const EXTENSIBLE_SIZE = 2 + 2 + 4 + 16;
+            // The subformat GUIDs are the format code followed by these.
+            static unsigned char const SUBFORMAT_GUID_TAIL[14];
 
             static uint16_t const DEFAULT_COMPRESSION = COMPRESSION_NONE;
             static uint16_t const DEFAULT_NCHANNELS = 1;
@@ -195,6 +217,10 @@ class FmtChunk : public Chunk {
             static uint32_t const DEFAULT_BYTES_PER_SEC = DEFAULT_SAMPLE_RATE * DEFAULT_BLOCK_ALIGN;
 };
 
+unsigned char const FmtChunk::SUBFORMAT_GUID_TAIL[14] = {
+      0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
 void FmtChunk::ReadFrom(std::istream& stream) {
       Chunk::ReadFrom(stream);
 
@@ -205,12 +231,54 @@ void FmtChunk::ReadFrom(std::istream& stream) {
       ReadLittleEndian(stream, block_align);
       ReadLittleEndian(stream, bits_per_sample);
 
-      if (compression != COMPRESSION_NONE) {
+      // Some files have a longer fmt chunk (e.g., with a cbSize field or
+      // the WAVE_FORMAT_EXTENSIBLE fields). We only keep (and write back out)
+      // the basic fields, so skip the rest. An extensible file's real format
+      // is in its subformat GUID, whose first two bytes are the ordinary
+      // format code for PCM and float; anything else we leave as
+      // extensible, which we can't deal with.
+      if (chunk_size > DEFAULT_CHUNK_SIZE_FMT) {
+            uint32_t extra = chunk_size - DEFAULT_CHUNK_SIZE_FMT + chunk_size % 2;
+            if (compression == COMPRESSION_EXTENSIBLE && extra >= EXTENSIBLE_SIZE) {
+                  uint16_t extension_size, valid_bits;
+                  uint32_t channel_mask;
+                  unsigned char subformat[16];
+                  ReadLittleEndian(stream, extension_size);
+                  ReadLittleEndian(stream, valid_bits);
+                  ReadLittleEndian(stream, channel_mask);
+                  stream.read((char*)subformat, sizeof(subformat));
+                  extra -= EXTENSIBLE_SIZE;
+
+                  uint16_t format = subformat[0] | subformat[1] << 8;
+                  if (std::memcmp(subformat + 2, SUBFORMAT_GUID_TAIL, sizeof(subformat) - 2) == 0
+                              && (format == COMPRESSION_NONE || format == COMPRESSION_FLOAT)) {
+                        compression = format;
+                  }
+            }
+            stream.ignore(extra);
+            chunk_size = DEFAULT_CHUNK_SIZE_FMT;
+      }
+
+      if (compression != COMPRESSION_NONE && compression != COMPRESSION_FLOAT) {
             std::cerr << "This WAV file appears to be compressed -- I can't deal with that." 
                       << std::endl;
       }
 }
 
+bool FmtChunk::Check(std::string const& filename) const {
+      if (compression == COMPRESSION_FLOAT && bits_per_sample != 32 && bits_per_sample != 64) {
+            std::cerr << "Error: " << filename << " has " << bits_per_sample
+                      << "-bit float samples -- they have to be 32 or 64 bits!" << std::endl;
+            return false;
+      }
+      if ((unsigned)nchannels * (bits_per_sample / 8) > block_align) {
+            std::cerr << "Error: " << filename << "'s frames (" << block_align << " bytes) are too short for "
+                      << nchannels << " channel(s) of " << bits_per_sample << "-bit samples!" << std::endl;
+            return false;
+      }
+      return true;
+}
+
 void FmtChunk::WriteTo(std::ostream& stream) const {
       Chunk::WriteTo(stream);
 
@@ -231,16 +299,16 @@ class DataChunk : public Chunk {
       public:
             /*** Constructors ***/
             DataChunk(void) 
-                  : Chunk(CHUNK_TYPE_DATA), data_(NULL), data_length_(0) { }
+                  : Chunk(CHUNK_TYPE_DATA), data_(NULL), data_length_(0), mapped_length_(0), account_(NULL) { }
             explicit DataChunk(uint32_t chunk_type) 
-                  : Chunk(chunk_type), data_(NULL), data_length_(0) { }
+                  : Chunk(chunk_type), data_(NULL), data_length_(0), mapped_length_(0), account_(NULL) { }
             // Because the DataChunk actually allocates some memory (see the
             // "new" in the ReAllocData() method), we should implement the copy
             // constructor, the assignment operator, and the destructor so our
             // class plays nice, for example, with the vector<> class (which we
             // use in the Wave class below).
             DataChunk(DataChunk const& other) 
-                  : Chunk(other), data_(NULL), data_length_(0) {
+                  : Chunk(other), data_(NULL), data_length_(0), mapped_length_(0), account_(NULL) {
                   ReAllocData(other.chunk_size);
                   std::memcpy(data_, other.data_, other.data_length_);
             }
@@ -256,6 +324,11 @@ class DataChunk : public Chunk {
             void ReAllocData(unsigned length);
             char* data() const { return data_; }
 
+            /*** Constants ***/
+            // Data this long or longer gets pages of its own, interleaved
+            // across the NUMA nodes (see ReAllocData()).
+            static unsigned const INTERLEAVE_LENGTH = 1 << 22;
+
             /*** Operators ***/
             DataChunk& operator=(DataChunk const& other) {
                   if (this == &other) return *this;
@@ -266,33 +339,74 @@ class DataChunk : public Chunk {
 
             /*** Destructor ***/
             ~DataChunk(void) { 
-                  if (data_) delete[] data_; 
-                  data_ = NULL; 
+                  FreeData();
             }
 
       private:
+            void FreeData(void);
+
             char* data_;
             unsigned data_length_;
 
+            // For data with pages of its own: how long the mapping is, and
+            // the account (see alloc.h) it was charged to.
+            unsigned mapped_length_;
+            AllocationAccount* account_;
+
 };
 
 void DataChunk::ReAllocData(unsigned length) {
-      if (data_) delete[] data_;
+      FreeData();
       data_length_ = chunk_size = length;
 
       // Chunks are word aligned, with a possible null-byte filler.
       data_length_ += chunk_size % 2;
 
-      if (data_length_) {
+      if (data_length_ >= INTERLEAVE_LENGTH) {
+            // A big chunk is usually filled by one thread (reading the file)
+            // and converted by all of them, so it's spread across the NUMA
+            // nodes rather than all landing on the reader's. It's mapped on
+            // its own for that: the policy sticks to whole pages, and heap
+            // pages are shared with (and reused for) other allocations.
+            void* pages = mmap(NULL, data_length_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pages == MAP_FAILED) throw std::bad_alloc();
+            data_ = (char*)pages;
+            mapped_length_ = data_length_;
+            InterleavePages(data_, data_length_);
+
+#ifdef WAVE_ALLOC_STATS
+            // operator new never sees it, so it's charged here instead.
+            account_ = AllocationAccount::Current();
+            if (account_) account_->Charge(mapped_length_);
+#endif
+      } else if (data_length_) {
             data_ = new char[data_length_];
+      }
+
+      if (data_length_) {
+            Stats::Add(COUNTER_ALLOCATIONS, 1);
+            Stats::Add(COUNTER_ALLOCATED_BYTES, data_length_);
             if (chunk_size % 2) data_[data_length_ - 1] = 0;
       }
 }
 
+void DataChunk::FreeData(void) {
+      if (mapped_length_) {
+            munmap(data_, mapped_length_);
+            if (account_) account_->Refund(mapped_length_);
+      } else if (data_) {
+            delete[] data_;
+      }
+      data_ = NULL;
+      mapped_length_ = 0;
+      account_ = NULL;
+}
+
 void DataChunk::ReadFrom(std::istream& stream) {
       Chunk::ReadFrom(stream);
       ReAllocData(chunk_size);
       stream.read(data_, data_length_);
+      Stats::Add(COUNTER_BYTES_READ, stream.gcount());
 }
 
 // Skips over the data chunk in the stream instead of reading and allocating
@@ -307,6 +421,7 @@ void DataChunk::Skip(std::istream& stream) {
 void DataChunk::WriteTo(std::ostream& stream) const {
       Chunk::WriteTo(stream);
       stream.write(data_, data_length_);
+      if (stream.good()) Stats::Add(COUNTER_BYTES_WRITTEN, data_length_);
 }
 
 /*** Wave ***/
@@ -333,10 +448,10 @@ class Wave {
             /*** Public Methods ***/
             // Load and save the Wave file. Load fails if the file doesn't
             // exist, Save will create a new file or overwrite an existing
-            // file.
-            void Load(std::string const& filename);
-            void LoadMetadata(std::string const& filename);
-            void Save(std::string const& filename);
+            // file. All return false if they fail.
+            bool Load(std::string const& filename);
+            bool LoadMetadata(std::string const& filename);
+            bool Save(std::string const& filename);
 
             // Resize the data chunk to support a certain number of samples.
             // The new size of the data chunk depends on the values set in the
@@ -348,6 +463,22 @@ class Wave {
             double GetSample(unsigned offset) const;
             void SetSample(unsigned offset, double value);
 
+            // Get & set "count" consecutive sample values starting at
+            // "offset". Same values as calling GetSample() or SetSample() in
+            // a loop, but converts whole runs of frames at a time, so use
+            // these for long stretches of the file. Samples past the end come
+            // back as 0 (or get dropped, when setting).
+            void GetSamples(unsigned offset, unsigned count, double* out) const;
+            void SetSamples(unsigned offset, unsigned count, double const* in);
+
+            // Bulk conversion between raw frames, laid out as described by
+            // "fmt", and sample values between -1.0 and +1.0. Decoding
+            // averages the channels and encoding writes the same value to
+            // every channel, just like GetSample() and SetSample(). These
+            // are what the streaming code (see stream.h) uses.
+            static void DecodeSamples(FmtChunk const& fmt, char const* frames, unsigned nframes, double* out);
+            static void EncodeSamples(FmtChunk const& fmt, double const* samples, unsigned nframes, char* frames);
+
             // Gets the number of samples in the data chunk.
             unsigned nsamples(void) const {
                   if (!data_chunk.chunk_size || !bytes_per_sample()) {
@@ -370,7 +501,7 @@ class Wave {
                   return fmt_chunk.bits_per_sample / 8;
             }
 
-            void Load(std::ifstream& file, std::string const& filename, bool load_data);
+            bool Load(std::ifstream& file, std::string const& filename, bool load_data);
             void UpdateRiffFileSize(void);
             void UpdateFmtValues(void);
 
@@ -386,6 +517,15 @@ class Wave {
                   return answer;
             }
 
+            template <unsigned Width>
+            static void DecodeFrames(unsigned char const* frames, unsigned nframes, unsigned stride, unsigned nchannels, double* out);
+            template <unsigned Width>
+            static void EncodeFrames(double const* samples, unsigned nframes, unsigned stride, unsigned nchannels, unsigned char* frames);
+            template <class Float>
+            static void DecodeFloatFrames(unsigned char const* frames, unsigned nframes, unsigned stride, unsigned nchannels, double* out);
+            template <class Float>
+            static void EncodeFloatFrames(double const* samples, unsigned nframes, unsigned stride, unsigned nchannels, unsigned char* frames);
+
             static unsigned long long GetValue(char const* things, unsigned sizeof_thing, bool thing_is_signed);
             static double TakeChannelAvg(char const* things, unsigned nthings, unsigned sizeof_thing, bool thing_is_signed);
             static void PutChannelAvg(double value, char* things, unsigned nthings, unsigned sizeof_thing, bool thing_is_signed);
@@ -402,7 +542,17 @@ double Wave::GetSample(unsigned offset) const {
 
       char* segment = data_chunk.data() + offset * bytes_per_sample();
 
-      if (bytes_per_sample_slice() == 1) {
+      // Floats go straight to the decoder (not through DecodeSamples()), so
+      // one sample isn't timed and counted like a whole block.
+      if (fmt_chunk.compression == FmtChunk::COMPRESSION_FLOAT) {
+            double value = 0;
+            if (bytes_per_sample_slice() == 8) {
+                  DecodeFloatFrames<double>((unsigned char const*)segment, 1, fmt_chunk.block_align, fmt_chunk.nchannels, &value);
+            } else if (bytes_per_sample_slice() == 4) {
+                  DecodeFloatFrames<float>((unsigned char const*)segment, 1, fmt_chunk.block_align, fmt_chunk.nchannels, &value);
+            }
+            return value;
+      } else if (bytes_per_sample_slice() == 1) {
             return TakeChannelAvg(segment, fmt_chunk.nchannels, bytes_per_sample_slice(), false);
       } else return TakeChannelAvg(segment, fmt_chunk.nchannels, bytes_per_sample_slice(), true);
 }
@@ -411,13 +561,208 @@ void Wave::SetSample(unsigned offset, double value) {
       if (offset >= nsamples()) return;
 
       char* segment = data_chunk.data() + offset * bytes_per_sample();
-      if (bytes_per_sample_slice() == 1) {
+      if (fmt_chunk.compression == FmtChunk::COMPRESSION_FLOAT) {
+            if (bytes_per_sample_slice() == 8) {
+                  EncodeFloatFrames<double>(&value, 1, fmt_chunk.block_align, fmt_chunk.nchannels, (unsigned char*)segment);
+            } else if (bytes_per_sample_slice() == 4) {
+                  EncodeFloatFrames<float>(&value, 1, fmt_chunk.block_align, fmt_chunk.nchannels, (unsigned char*)segment);
+            }
+      } else if (bytes_per_sample_slice() == 1) {
             PutChannelAvg(value, segment, fmt_chunk.nchannels, bytes_per_sample_slice(), false);
       } else return PutChannelAvg(value, segment, fmt_chunk.nchannels, bytes_per_sample_slice(), true);
 }
 
+void Wave::GetSamples(unsigned offset, unsigned count, double* out) const {
+      unsigned available = 0;
+      if (offset < nsamples()) available = std::min(count, nsamples() - offset);
+
+      DecodeSamples(fmt_chunk, data_chunk.data() + (unsigned long long)offset * bytes_per_sample(),
+                    available, out);
+
+      for (unsigned i = available; i < count; ++i) out[i] = 0;
+}
+
+void Wave::SetSamples(unsigned offset, unsigned count, double const* in) {
+      if (offset >= nsamples()) return;
+      count = std::min(count, nsamples() - offset);
+
+      EncodeSamples(fmt_chunk, in, count, data_chunk.data() + (unsigned long long)offset * bytes_per_sample());
+}
+
+void Wave::DecodeSamples(FmtChunk const& fmt, char const* frames, unsigned nframes, double* out) {
+      StageTimer timer(STAGE_DECODE);
+      TraceSpan span("decode", "convert");
+      Stats::Add(COUNTER_FRAMES_DECODED, nframes);
+
+      unsigned char const* bytes = (unsigned char const*)frames;
+      unsigned width = fmt.bits_per_sample / 8;
+
+      // Floats of any other width are a broken file (see
+      // FmtChunk::Check()), and we don't know how to read them.
+      if (fmt.compression == FmtChunk::COMPRESSION_FLOAT) {
+            if (width == 8) {
+                  DecodeFloatFrames<double>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+            } else if (width == 4) {
+                  DecodeFloatFrames<float>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+            } else {
+                  for (unsigned i = 0; i != nframes; ++i) out[i] = 0;
+            }
+            return;
+      }
+
+      switch (width) {
+            case 1:
+                  DecodeFrames<1>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+                  break;
+            case 2:
+                  DecodeFrames<2>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+                  break;
+            case 3:
+                  DecodeFrames<3>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+                  break;
+            case 4:
+                  DecodeFrames<4>(bytes, nframes, fmt.block_align, fmt.nchannels, out);
+                  break;
+            default:
+                  for (unsigned i = 0; i != nframes; ++i) {
+                        out[i] = TakeChannelAvg(frames + (unsigned long long)i * fmt.block_align,
+                                                fmt.nchannels, width, width != 1);
+                  }
+      }
+}
+
+void Wave::EncodeSamples(FmtChunk const& fmt, double const* samples, unsigned nframes, char* frames) {
+      StageTimer timer(STAGE_ENCODE);
+      TraceSpan span("encode", "convert");
+      Stats::Add(COUNTER_FRAMES_ENCODED, nframes);
+
+      unsigned char* bytes = (unsigned char*)frames;
+      unsigned width = fmt.bits_per_sample / 8;
+
+      // As in DecodeSamples(), other float widths are left alone.
+      if (fmt.compression == FmtChunk::COMPRESSION_FLOAT) {
+            if (width == 8) {
+                  EncodeFloatFrames<double>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+            } else if (width == 4) {
+                  EncodeFloatFrames<float>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+            }
+            return;
+      }
+
+      switch (width) {
+            case 1:
+                  EncodeFrames<1>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+                  break;
+            case 2:
+                  EncodeFrames<2>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+                  break;
+            case 3:
+                  EncodeFrames<3>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+                  break;
+            case 4:
+                  EncodeFrames<4>(samples, nframes, fmt.block_align, fmt.nchannels, bytes);
+                  break;
+            default:
+                  for (unsigned i = 0; i != nframes; ++i) {
+                        PutChannelAvg(samples[i], frames + (unsigned long long)i * fmt.block_align,
+                                      fmt.nchannels, width, width != 1);
+                  }
+      }
+}
+
+// Decodes frames of "Width"-byte channel slices into values between -1.0 and
+// +1.0, averaging the channels exactly like TakeChannelAvg() does. Signed
+// slices are mapped into the unsigned range by flipping the sign bit, which is
+// the same as the add/subtract dance in GetValue(). The arithmetic is done in
+// the same order as TakeChannelAvg() too (folding it into one multiply rounds
+// differently), so the results match to the last bit.
+template <unsigned Width>
+void Wave::DecodeFrames(unsigned char const* frames, unsigned nframes, unsigned stride, unsigned nchannels, double* out) {
+      unsigned long long const sign_bit = Width == 1 ? 0 : 1ULL << (8*Width - 1);
+      double const max = max_thing_value(Width);
+
+      for (unsigned i = 0; i != nframes; ++i) {
+            unsigned char const* slice = frames + (unsigned long long)i * stride;
+            unsigned long long total = 0;
+            for (unsigned c = 0; c != nchannels; ++c) {
+                  unsigned long long thing = 0;
+                  for (unsigned j = 0; j != Width; ++j) {
+                        thing |= (unsigned long long)slice[j] << 8*j;
+                  }
+                  total += thing ^ sign_bit;
+                  slice += Width;
+            }
+            out[i] = (total / (double)nchannels / max) * 2.0 - 1.0;
+      }
+}
+
+// The reverse of DecodeFrames(): the same value goes to every channel, like
+// PutChannelAvg().
+template <unsigned Width>
+void Wave::EncodeFrames(double const* samples, unsigned nframes, unsigned stride, unsigned nchannels, unsigned char* frames) {
+      unsigned long long const sign_bit = Width == 1 ? 0 : 1ULL << (8*Width - 1);
+      double const scale = max_thing_value(Width) / 2.0;
+
+      for (unsigned i = 0; i != nframes; ++i) {
+            double value = std::min(1.0, std::max(-1.0, samples[i]));
+            unsigned long long thing = (unsigned long long)((value + 1.0) * scale) ^ sign_bit;
+
+            unsigned char* slice = frames + (unsigned long long)i * stride;
+            for (unsigned c = 0; c != nchannels; ++c) {
+                  for (unsigned j = 0; j != Width; ++j) {
+                        slice[j] = thing >> 8*j;
+                  }
+                  slice += Width;
+            }
+      }
+}
+
+// DecodeFrames() and EncodeFrames() for float samples ("Float" is float or
+// double). The bytes are little-endian whatever the machine is, so they're
+// put together as an integer first. Encoding clips to -1.0 to +1.0, just like
+// it does for integer samples.
+template <class Float>
+void Wave::DecodeFloatFrames(unsigned char const* frames, unsigned nframes, unsigned stride, unsigned nchannels, double* out) {
+      typedef typename std::conditional<sizeof(Float) == 8, unsigned long long, uint32_t>::type Bits;
+
+      for (unsigned i = 0; i != nframes; ++i) {
+            unsigned char const* slice = frames + (unsigned long long)i * stride;
+            double total = 0;
+            for (unsigned c = 0; c != nchannels; ++c) {
+                  Bits bits = 0;
+                  for (unsigned j = 0; j != sizeof(Float); ++j) {
+                        bits |= (Bits)slice[j] << 8*j;
+                  }
+                  Float value;
+                  std::memcpy(&value, &bits, sizeof(Float));
+                  total += value;
+                  slice += sizeof(Float);
+            }
+            out[i] = total / nchannels;
+      }
+}
+
+template <class Float>
+void Wave::EncodeFloatFrames(double const* samples, unsigned nframes, unsigned stride, unsigned nchannels, unsigned char* frames) {
+      typedef typename std::conditional<sizeof(Float) == 8, unsigned long long, uint32_t>::type Bits;
+
+      for (unsigned i = 0; i != nframes; ++i) {
+            Float value = std::min(1.0, std::max(-1.0, samples[i]));
+            Bits bits;
+            std::memcpy(&bits, &value, sizeof(Float));
+
+            unsigned char* slice = frames + (unsigned long long)i * stride;
+            for (unsigned c = 0; c != nchannels; ++c) {
+                  for (unsigned j = 0; j != sizeof(Float); ++j) {
+                        slice[j] = bits >> 8*j;
+                  }
+                  slice += sizeof(Float);
+            }
+      }
+}
+
 // Helper function called by Load() and LoadMetadata().
-void Wave::Load(std::ifstream& file, std::string const& filename, bool load_data) {
+bool Wave::Load(std::ifstream& file, std::string const& filename, bool load_data) {
 
       uint32_t chunk_type;
       ReadLittleEndian(file, chunk_type);
@@ -426,7 +771,7 @@ void Wave::Load(std::ifstream& file, std::string const& filename, bool load_data
       if (chunk_type != Chunk::CHUNK_TYPE_RIFF) {
             std::cerr << "Error: " << filename << " doesn't appear to be a WAV file!" 
                       << std::endl;
-            return;
+            return false;
       }
 
       riff_chunk.ReadFrom(file);
@@ -435,7 +780,7 @@ void Wave::Load(std::ifstream& file, std::string const& filename, bool load_data
       if (riff_chunk.riff_type != RiffChunk::RIFF_TYPE_WAVE || !file.good()) {
             std::cerr << "Error: " << filename << " doesn't appear to be a WAV file!" 
                       << std::endl;
-            return;
+            return false;
       }
 
       while (file.good()) {
@@ -447,6 +792,7 @@ void Wave::Load(std::ifstream& file, std::string const& filename, bool load_data
             switch (chunk_type) {
                   case Chunk::CHUNK_TYPE_FMT:
                         fmt_chunk.ReadFrom(file);
+                        if (!fmt_chunk.Check(filename)) return false;
                         break;
                   case Chunk::CHUNK_TYPE_DATA:
                         if (load_data) { 
@@ -463,47 +809,52 @@ void Wave::Load(std::ifstream& file, std::string const& filename, bool load_data
       }
 
       file.close();
+      return true;
 }
 
 // Loads the contents of a .WAV file into this Wave object. Fails if the file
 // doesn't exist (and prints out some messages).
-void Wave::LoadMetadata(std::string const& filename) {
+bool Wave::LoadMetadata(std::string const& filename) {
       std::ifstream file(filename.c_str(), std::ios_base::binary | std::ios_base::in);
 
       // Fail if we can't open the file...
-      if (!file.good()) return; // We don't print an error here, as perverse as
-                                // that may seem, because this is an expected
-                                // failure in the WavSave() function if the
-                                // file doesn't exist.
+      if (!file.good()) return false; // We don't print an error here, as perverse as
+                                      // that may seem, because this is an
+                                      // expected failure in the WavSave()
+                                      // function if the file doesn't exist.
 
-      Load(file, filename, false);
+      return Load(file, filename, false);
 }
 
 
 // Loads the contents of a .WAV file into this Wave object. Fails if the file
 // doesn't exist (and prints out some messages).
-void Wave::Load(std::string const& filename) {
+bool Wave::Load(std::string const& filename) {
+      StageTimer timer(STAGE_LOAD);
+      TraceSpan span("load", "io");
       std::ifstream file(filename.c_str(), std::ios_base::binary | std::ios_base::in);
 
       // Fail if we can't open the file.
       if (!file.good()) {
             std::cerr << "Error: I can't open " << filename << "!" << std::endl;
-            return; 
+            return false;
       }
 
-      Load(file, filename, true);
+      return Load(file, filename, true);
 }
 
 // Writes this Wave object to a .WAV file. We create a new file if the file
 // doesn't exist, otherwise we overwrite its contents.
-void Wave::Save(std::string const& filename) {
+bool Wave::Save(std::string const& filename) {
+      StageTimer timer(STAGE_SAVE);
+      TraceSpan span("save", "io");
       std::ofstream file(filename.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
 
       // Fail if we can't open the file.
       if (!file.good()) {
             std::cerr << "Error: I can't open " << filename << " for writing!" 
                       << std::endl;
-            return;
+            return false;
       }
 
       UpdateRiffFileSize();
@@ -520,6 +871,7 @@ void Wave::Save(std::string const& filename) {
       data_chunk.WriteTo(file);
 
       file.close();
+      return !file.fail();
 }
 
 // Return the value of an arbitrary sized and signed chunk of memory of at most
@@ -528,7 +880,7 @@ unsigned long long Wave::GetValue(char const* things, unsigned sizeof_thing, boo
       unsigned long long answer = 0;
 
       for (unsigned i = 0; i != sizeof_thing; ++i) {
-            answer |= (unsigned char)things[i] << 8*i;
+            answer |= (unsigned long long)(unsigned char)things[i] << 8*i;
       }
 
       if (thing_is_signed) {
@@ -556,8 +908,10 @@ double Wave::TakeChannelAvg(char const* things, unsigned nthings, unsigned sizeo
       return munged;
 }
 
-// Write a value to all channels.
+// Write a value to all channels. Values outside of -1.0 to +1.0 are clipped
+// rather than wrapping around.
 void Wave::PutChannelAvg(double value, char* things, unsigned nthings, unsigned sizeof_thing, bool thing_is_signed) {
+      value = std::min(1.0, std::max(-1.0, value));
       unsigned long long thing = (value+1.0)/2.0 * max_thing_value(sizeof_thing);
 
       if (thing_is_signed) {
@@ -576,15 +930,16 @@ void Wave::PutChannelAvg(double value, char* things, unsigned nthings, unsigned
 }
 
 void Wave::UpdateRiffFileSize(void) {
-      unsigned total = 8 * 3; // Overhead for Riff, Fmt, Data 8-byte headers;
-
-      total += 4; // The Riff type.
+      // The RIFF chunk's size covers everything after its own 8-byte header.
+      unsigned total = 4; // The Riff type.
 
-      total += fmt_chunk.chunk_size;
-      total += data_chunk.chunk_size;
+      // Every other chunk has an 8-byte header, plus a pad byte if its size
+      // is odd.
+      total += 8 + fmt_chunk.chunk_size;
+      total += 8 + data_chunk.chunk_size + data_chunk.chunk_size % 2;
       for (std::vector<DataChunk>::iterator it = other_chunks.begin();
                   it != other_chunks.end(); ++it) {
-            total += it->chunk_size;
+            total += 8 + it->chunk_size + it->chunk_size % 2;
       }
 
       riff_chunk.chunk_size = total;